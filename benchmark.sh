@@ -25,7 +25,7 @@ if [ -f benchmarks/teestream_benchmark ]; then
         case "$1" in
             --quick)
                 # Quick benchmark with fewer iterations
-                ARGS="--throughput-iterations 10 --latency-iterations 100 --scalability-iterations 100 --buffer-iterations 100 --stream-iterations 100"
+                ARGS="--throughput-iterations 10 --latency-iterations 100 --scalability-iterations 100 --buffer-iterations 100 --stream-iterations 100 --wakeup-iterations 200 --churn-rounds 50 --format-iterations 100000 --print-iterations 100000 --deferred-iterations 100000 --json-iterations 100000 --routing-iterations 100000 --nesting-iterations 100000"
                 shift
                 ;;
             --throughput-only)
@@ -58,6 +58,54 @@ if [ -f benchmarks/teestream_benchmark ]; then
                 cd ..
                 exit 0
                 ;;
+            --wakeup-only)
+                # Run only wakeup latency benchmark
+                ./benchmarks/teestream_benchmark --wakeup-iterations 2000
+                cd ..
+                exit 0
+                ;;
+            --churn-only)
+                # Run only thread churn benchmark
+                ./benchmarks/teestream_benchmark --churn-rounds 500
+                cd ..
+                exit 0
+                ;;
+            --format-only)
+                # Run only numeric formatting benchmark
+                ./benchmarks/teestream_benchmark --format-iterations 1000000
+                cd ..
+                exit 0
+                ;;
+            --print-only)
+                # Run only format-string print benchmark
+                ./benchmarks/teestream_benchmark --print-iterations 1000000
+                cd ..
+                exit 0
+                ;;
+            --deferred-only)
+                # Run only deferred print latency benchmark
+                ./benchmarks/teestream_benchmark --deferred-iterations 1000000
+                cd ..
+                exit 0
+                ;;
+            --json-only)
+                # Run only JSON record benchmark
+                ./benchmarks/teestream_benchmark --json-iterations 1000000
+                cd ..
+                exit 0
+                ;;
+            --routing-only)
+                # Run only content routing benchmark
+                ./benchmarks/teestream_benchmark --routing-iterations 1000000
+                cd ..
+                exit 0
+                ;;
+            --nesting-only)
+                # Run only nested tee benchmark
+                ./benchmarks/teestream_benchmark --nesting-iterations 1000000
+                cd ..
+                exit 0
+                ;;
             *)
                 # Add other arguments directly
                 ARGS="$ARGS $1"
@@ -1,6 +1,8 @@
 #include <algorithm>
 #include <atomic>
 #include <chrono>
+#include <cstdint>
+#include <cstring>
 #include <fstream>
 #include <functional>
 #include <iomanip>
@@ -322,6 +324,30 @@ void benchmark_buffer_sizes(size_t data_size, int iterations) {
         
         std::cout << "Throughput: " << std::fixed << std::setprecision(2) << mb_per_sec << " MB/s" << std::endl;
     }
+
+    // Let adaptive sizing pick the buffer size, starting from the default
+    {
+        TeeStream tee;
+        tee.enable_adaptive_sizing();
+        tee.add_stream(null_stream1);
+        tee.add_stream(null_stream2);
+
+        Timer timer("Adaptive buffer size");
+        for (int i = 0; i < iterations; ++i) {
+            tee.write(data.data(), data.size());
+        }
+        tee.flush_thread_buffer();
+
+        double seconds = timer.stop();
+        double total_mb = (data_size * iterations) / (1024.0 * 1024.0);
+        double mb_per_sec = total_mb / seconds;
+
+        std::cout << "Throughput: " << std::fixed << std::setprecision(2) << mb_per_sec << " MB/s" << std::endl;
+        for (const auto& stats : tee.thread_buffer_stats()) {
+            std::cout << "Chosen buffer size: " << stats.buffer_size << " bytes, threshold: "
+                      << stats.flush_threshold << " bytes" << std::endl;
+        }
+    }
 }
 
 // Benchmark 5: Stream count impact - how the number of streams affects performance
@@ -373,6 +399,535 @@ void benchmark_stream_count(size_t data_size, int iterations) {
     }
 }
 
+// Benchmark 6: Wakeup latency - delay from enqueue to sink write for each async wakeup mode
+void benchmark_wakeup_latency(int iterations) {
+    std::cout << "\n=== Wakeup Latency Benchmark ===" << std::endl;
+    std::cout << "Iterations: " << iterations << std::endl;
+
+    // A sink that records how long each timestamped message took to arrive
+    class TimestampBuffer : public std::streambuf {
+    public:
+        std::vector<double> latencies;
+
+    protected:
+        virtual int overflow(int c) override { return c; }
+        virtual std::streamsize xsputn(const char* s, std::streamsize n) override {
+            auto now = std::chrono::steady_clock::now().time_since_epoch().count();
+            for (std::streamsize offset = 0; offset + 8 <= n; offset += 8) {
+                int64_t stamp;
+                std::memcpy(&stamp, s + offset, sizeof(stamp));
+                latencies.push_back(static_cast<double>(now - stamp));
+            }
+            return n;
+        }
+    };
+
+    std::vector<std::pair<std::string, WakeupMode>> modes = {
+        {"Blocking", WakeupMode::Blocking},
+        {"Spin-then-park", WakeupMode::SpinThenPark},
+        {"Busy-poll", WakeupMode::BusyPoll}
+    };
+
+    for (const auto& mode : modes) {
+        TimestampBuffer timestamp_buffer;
+        std::ostream timestamp_stream(&timestamp_buffer);
+
+        {
+            TeeStream tee;
+            tee.set_wakeup_mode(mode.second);
+            tee.enable_async();
+            tee.add_stream(timestamp_stream);
+
+            for (int i = 0; i < iterations; ++i) {
+                int64_t stamp = std::chrono::steady_clock::now().time_since_epoch().count();
+                tee.write(reinterpret_cast<const char*>(&stamp), sizeof(stamp));
+                tee.flush_thread_buffer();
+
+                // Leave the writer idle between messages so every message needs a wakeup
+                std::this_thread::sleep_for(std::chrono::microseconds(200));
+            }
+
+            tee.drain();
+        }
+
+        // Calculate statistics
+        std::vector<double>& latencies = timestamp_buffer.latencies;
+        if (latencies.empty()) {
+            continue;
+        }
+        std::sort(latencies.begin(), latencies.end());
+        double avg = std::accumulate(latencies.begin(), latencies.end(), 0.0) / latencies.size();
+        double median = latencies[latencies.size() / 2];
+        double p95 = latencies[static_cast<size_t>(latencies.size() * 0.95)];
+        double p99 = latencies[static_cast<size_t>(latencies.size() * 0.99)];
+
+        std::cout << std::setw(16) << std::left << mode.first << std::right << " | "
+                  << "Avg: " << std::setw(8) << std::fixed << std::setprecision(2) << avg << " ns | "
+                  << "Median: " << std::setw(8) << median << " ns | "
+                  << "p95: " << std::setw(8) << p95 << " ns | "
+                  << "p99: " << std::setw(8) << p99 << " ns" << std::endl;
+    }
+}
+
+// Benchmark 7: Thread churn - short-lived threads each getting a fresh thread buffer
+void benchmark_thread_churn(int rounds) {
+    std::cout << "\n=== Thread Churn Benchmark ===" << std::endl;
+    std::cout << "Rounds: " << rounds << std::endl;
+
+    // Create null streams that discard output
+    class NullBuffer : public std::streambuf {
+    protected:
+        virtual int overflow(int c) override { return c; }
+        virtual std::streamsize xsputn(const char*, std::streamsize n) override { return n; }
+    };
+
+    NullBuffer null_buffer;
+    std::ostream null_stream(&null_buffer);
+
+    const int threads_per_round = 8;
+    const int lines_per_thread = 16;
+    std::string line = generate_random_data(63) + "\n";
+
+    size_t max_pooled = BufferPool::get_max_pooled_bytes();
+    std::vector<size_t> buffer_sizes = {8192, 262144};
+
+    for (size_t buffer_size : buffer_sizes) {
+        for (bool pooled : {false, true}) {
+            BufferPool::trim();
+            BufferPool::set_max_pooled_bytes(pooled ? max_pooled : 0);
+
+            TeeStream tee(buffer_size, buffer_size * 3 / 4);
+            tee.add_stream(null_stream);
+
+            auto start = std::chrono::high_resolution_clock::now();
+            for (int r = 0; r < rounds; ++r) {
+                std::vector<std::thread> threads;
+                for (int t = 0; t < threads_per_round; ++t) {
+                    threads.emplace_back([&tee, &line]() {
+                        for (int i = 0; i < lines_per_thread; ++i) {
+                            tee.write(line.data(), line.size());
+                        }
+                    });
+                }
+                for (auto& thread : threads) {
+                    thread.join();
+                }
+            }
+            auto end = std::chrono::high_resolution_clock::now();
+
+            double seconds = std::chrono::duration_cast<std::chrono::microseconds>(end - start).count() / 1000000.0;
+            double threads_per_sec = (rounds * threads_per_round) / seconds;
+
+            std::cout << "Buffer size: " << std::setw(8) << buffer_size << " bytes | "
+                      << std::setw(10) << std::left << (pooled ? "pooled" : "unpooled") << std::right << " | "
+                      << "Time: " << std::fixed << std::setprecision(6) << seconds << " s | "
+                      << "Threads: " << std::fixed << std::setprecision(2) << threads_per_sec << " /s" << std::endl;
+        }
+    }
+
+    BufferPool::set_max_pooled_bytes(max_pooled);
+}
+
+// Benchmark 8: Numeric formatting - operator<< chains against the to_chars fast path
+void benchmark_formatting(int iterations) {
+    std::cout << "\n=== Formatting Benchmark ===" << std::endl;
+    std::cout << "Iterations: " << iterations << std::endl;
+
+    // Create null streams that discard output
+    class NullBuffer : public std::streambuf {
+    protected:
+        virtual int overflow(int c) override { return c; }
+        virtual std::streamsize xsputn(const char*, std::streamsize n) override { return n; }
+    };
+
+    NullBuffer null_buffer;
+    std::ostream null_stream(&null_buffer);
+
+    // The formatting states of the FormattingOptions test. fast() formats the first three
+    // itself and falls back to operator<< under showbase and setw.
+    struct Case {
+        const char* name;
+        std::function<void(TeeStream&)> setup;
+        bool padded;  // setw() before every number, as it only applies to the next one
+    };
+    std::vector<Case> cases = {
+        {"default", [](TeeStream&) {}, false},
+        {"fixed", [](TeeStream& tee) { tee << std::fixed << std::setprecision(3); }, false},
+        {"hex", [](TeeStream& tee) { tee << std::hex; }, false},
+        {"showbase", [](TeeStream& tee) { tee << std::hex << std::showbase; }, false},
+        {"setw", [](TeeStream& tee) { tee << std::setfill('0') << std::right; }, true},
+    };
+
+    for (const auto& format : cases) {
+        for (bool fast : {false, true}) {
+            TeeStream tee;
+            tee.add_stream(null_stream);
+            format.setup(tee);
+
+            auto start = std::chrono::high_resolution_clock::now();
+            for (int i = 0; i < iterations; ++i) {
+                double value = i * 0.37;
+                if (format.padded && fast) {
+                    tee.fast() << "id=" << std::setw(10) << i << " value=" << std::setw(10) << value
+                               << " count=" << std::setw(10) << (i * 31u) << '\n';
+                } else if (format.padded) {
+                    tee << "id=" << std::setw(10) << i << " value=" << std::setw(10) << value
+                        << " count=" << std::setw(10) << (i * 31u) << '\n';
+                } else if (fast) {
+                    tee.fast() << "id=" << i << " value=" << value << " count=" << (i * 31u) << '\n';
+                } else {
+                    tee << "id=" << i << " value=" << value << " count=" << (i * 31u) << '\n';
+                }
+            }
+            tee.flush();
+            auto end = std::chrono::high_resolution_clock::now();
+
+            double seconds = std::chrono::duration_cast<std::chrono::microseconds>(end - start).count() / 1000000.0;
+            double ns_per_line = seconds * 1e9 / iterations;
+
+            std::cout << std::setw(8) << std::left << format.name << " | "
+                      << std::setw(10) << (fast ? "fast()" : "operator<<") << std::right << " | "
+                      << "Time: " << std::fixed << std::setprecision(6) << seconds << " s | "
+                      << "Per line: " << std::fixed << std::setprecision(2) << ns_per_line << " ns" << std::endl;
+        }
+    }
+}
+
+// Benchmark 9: Format strings - print() against the operator<< chains of the examples
+void benchmark_print(int iterations) {
+    std::cout << "\n=== Print Benchmark ===" << std::endl;
+    std::cout << "Iterations: " << iterations << std::endl;
+
+    // Create null streams that discard output
+    class NullBuffer : public std::streambuf {
+    protected:
+        virtual int overflow(int c) override { return c; }
+        virtual std::streamsize xsputn(const char*, std::streamsize n) override { return n; }
+    };
+
+    NullBuffer null_buffer;
+    std::ostream null_stream(&null_buffer);
+
+    const std::string timestamp = "[2024-01-01 12:00:00] ";
+    const std::string name = "request";
+
+    std::vector<std::string> variants = {"operator<<", "print()"};
+    for (const auto& variant : variants) {
+        TeeStream tee;
+        tee.add_stream(null_stream);
+
+        auto start = std::chrono::high_resolution_clock::now();
+        for (int i = 0; i < iterations; ++i) {
+            double us = i * 0.25;
+            if (variant == "print()") {
+                tee.print(TEE_FMT("{}Message {}: {} took {:.2f}us\n"), timestamp, i, name, us);
+            } else {
+                tee << timestamp << "Message " << i << ": " << name << " took "
+                    << std::fixed << std::setprecision(2) << us << "us" << '\n';
+            }
+        }
+        tee.flush();
+        auto end = std::chrono::high_resolution_clock::now();
+
+        double seconds = std::chrono::duration_cast<std::chrono::microseconds>(end - start).count() / 1000000.0;
+        double ns_per_line = seconds * 1e9 / iterations;
+
+        std::cout << std::setw(12) << std::left << variant << std::right << " | "
+                  << "Time: " << std::fixed << std::setprecision(6) << seconds << " s | "
+                  << "Per line: " << std::fixed << std::setprecision(2) << ns_per_line << " ns" << std::endl;
+    }
+}
+
+// Benchmark 10: Call-site latency of deferred print compared with formatting on the calling thread
+void benchmark_deferred_latency(int iterations) {
+    std::cout << "\n=== Deferred Print Latency Benchmark ===" << std::endl;
+    std::cout << "Iterations: " << iterations << std::endl;
+
+    // Create null streams that discard output
+    class NullBuffer : public std::streambuf {
+    protected:
+        virtual int overflow(int c) override { return c; }
+        virtual std::streamsize xsputn(const char*, std::streamsize n) override { return n; }
+    };
+
+    NullBuffer null_buffer;
+    std::ostream null_stream(&null_buffer);
+
+    // Calls are timed in batches since a single one is shorter than the clock resolution
+    const int batch_size = 100;
+    const char* name = "request";
+
+    std::vector<std::string> variants = {"operator<<", "print()", "print_deferred()"};
+    for (const auto& variant : variants) {
+        std::vector<double> latencies;
+        latencies.reserve(iterations / batch_size + 1);
+
+        {
+            // A deep queue keeps the writer's formatting from throttling the calls being measured
+            TeeStream tee(65536, 49152);
+            tee.enable_async(64 * 1024 * 1024);
+            tee.add_stream(null_stream);
+
+            for (int i = 0; i < iterations; i += batch_size) {
+                auto start = std::chrono::high_resolution_clock::now();
+                for (int j = i; j < i + batch_size; ++j) {
+                    double us = j * 0.25;
+                    if (variant == "print_deferred()") {
+                        tee.print_deferred("Message {}: {} took {:.2f}us\n", j, name, us);
+                    } else if (variant == "print()") {
+                        tee.print(TEE_FMT("Message {}: {} took {:.2f}us\n"), j, name, us);
+                    } else {
+                        tee << "Message " << j << ": " << name << " took "
+                            << std::fixed << std::setprecision(2) << us << "us" << '\n';
+                    }
+                }
+                auto end = std::chrono::high_resolution_clock::now();
+                latencies.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count() /
+                                    static_cast<double>(batch_size));
+            }
+            tee.drain();
+        }
+
+        // Calculate statistics
+        std::sort(latencies.begin(), latencies.end());
+        double avg = std::accumulate(latencies.begin(), latencies.end(), 0.0) / latencies.size();
+        double median = latencies[latencies.size() / 2];
+        double p99 = latencies[static_cast<size_t>(latencies.size() * 0.99)];
+
+        std::cout << std::setw(18) << std::left << variant << std::right << " | "
+                  << "Avg: " << std::setw(8) << std::fixed << std::setprecision(2) << avg << " ns | "
+                  << "Median: " << std::setw(8) << median << " ns | "
+                  << "p99: " << std::setw(8) << p99 << " ns" << std::endl;
+    }
+}
+
+// Benchmark 11: JSON lines - record() against hand-written operator<< JSON
+void benchmark_json(int iterations) {
+    std::cout << "\n=== JSON Record Benchmark ===" << std::endl;
+    std::cout << "Iterations: " << iterations << std::endl;
+
+    // Create null streams that discard output
+    class NullBuffer : public std::streambuf {
+    protected:
+        virtual int overflow(int c) override { return c; }
+        virtual std::streamsize xsputn(const char*, std::streamsize n) override { return n; }
+    };
+
+    NullBuffer null_buffer;
+    std::ostream null_stream(&null_buffer);
+
+    // The usual hand-written escaping, one character at a time
+    auto escape = [](const std::string& text) {
+        std::string escaped;
+        escaped.reserve(text.size());
+        for (char c : text) {
+            switch (c) {
+                case '"': escaped += "\\\""; break;
+                case '\\': escaped += "\\\\"; break;
+                case '\n': escaped += "\\n"; break;
+                default: escaped += c; break;
+            }
+        }
+        return escaped;
+    };
+
+    std::vector<std::string> messages;
+    for (int i = 0; i < 16; ++i) {
+        std::string message = generate_random_data(120);
+        std::replace(message.begin(), message.end(), '\\', '/');
+        std::replace(message.begin(), message.end(), '"', '\'');
+        if (i % 4 == 0) {
+            message[60] = '"';
+        }
+        messages.push_back(message);
+    }
+
+    for (bool builder : {false, true}) {
+        TeeStream tee;
+        tee.add_stream(null_stream);
+
+        auto start = std::chrono::high_resolution_clock::now();
+        for (int i = 0; i < iterations; ++i) {
+            const std::string& message = messages[i % messages.size()];
+            double latency = i * 0.125;
+            if (builder) {
+                tee.record()
+                    .field("event", "request")
+                    .field("id", i)
+                    .field("latency_ms", latency)
+                    .field("ok", i % 7 != 0)
+                    .field("message", message);
+            } else {
+                tee << "{\"event\":\"request\",\"id\":" << i << ",\"latency_ms\":" << latency
+                    << ",\"ok\":" << (i % 7 != 0 ? "true" : "false")
+                    << ",\"message\":\"" << escape(message) << "\"}\n";
+            }
+        }
+        tee.flush();
+        auto end = std::chrono::high_resolution_clock::now();
+
+        double seconds = std::chrono::duration_cast<std::chrono::microseconds>(end - start).count() / 1000000.0;
+        double ns_per_record = seconds * 1e9 / iterations;
+
+        std::cout << std::setw(12) << std::left << (builder ? "record()" : "operator<<") << std::right << " | "
+                  << "Time: " << std::fixed << std::setprecision(6) << seconds << " s | "
+                  << "Per record: " << std::fixed << std::setprecision(2) << ns_per_record << " ns" << std::endl;
+    }
+}
+
+// Benchmark 12: Content routing - leveled records with an alerting stream that takes only
+// records containing a marker, compared with the same tee without it
+void benchmark_routing(int iterations) {
+    std::cout << "\n=== Content Routing Benchmark ===" << std::endl;
+    std::cout << "Iterations: " << iterations << std::endl;
+
+    // Create null streams that discard output
+    class NullBuffer : public std::streambuf {
+    protected:
+        virtual int overflow(int c) override { return c; }
+        virtual std::streamsize xsputn(const char*, std::streamsize n) override { return n; }
+    };
+
+    NullBuffer null_buffer;
+    std::ostream null_stream(&null_buffer);
+    NullBuffer alert_buffer;
+    std::ostream alert_stream(&alert_buffer);
+
+    // One record in 100 carries a marker
+    std::vector<std::string> messages;
+    for (int i = 0; i < 100; ++i) {
+        std::string message = generate_random_data(100);
+        std::replace(message.begin(), message.end(), 'E', 'e');
+        std::replace(message.begin(), message.end(), 't', 'T');
+        if (i == 42) {
+            message.replace(50, 5, "ERROR");
+        }
+        messages.push_back(message);
+    }
+
+    const char* names[] = {"one stream", "+ level", "+ content"};
+    for (int mode = 0; mode < 3; ++mode) {
+        TeeStream tee(65536, 49152);
+        tee.add_stream(null_stream);
+        if (mode == 1) {
+            SinkOptions warnings;
+            warnings.min_level = LogLevel::Warn;
+            tee.add_stream(alert_stream, warnings);
+        } else if (mode == 2) {
+            SinkOptions alerts;
+            alerts.match = {"ERROR", "trace=7f"};
+            tee.add_stream(alert_stream, alerts);
+        }
+
+        size_t bytes = 0;
+        auto start = std::chrono::high_resolution_clock::now();
+        for (int i = 0; i < iterations; ++i) {
+            const std::string& message = messages[i % messages.size()];
+            TEE_INFO(tee) << message << '\n';
+            bytes += message.size() + 1;
+        }
+        tee.flush();
+        auto end = std::chrono::high_resolution_clock::now();
+
+        double seconds = std::chrono::duration_cast<std::chrono::microseconds>(end - start).count() / 1000000.0;
+        double mb_per_sec = (bytes / (1024.0 * 1024.0)) / seconds;
+        double ns_per_record = seconds * 1e9 / iterations;
+
+        std::cout << std::setw(12) << std::left << names[mode] << std::right << " | "
+                  << "Throughput: " << std::fixed << std::setprecision(2) << mb_per_sec << " MB/s | "
+                  << "Per record: " << std::fixed << std::setprecision(2) << ns_per_record << " ns" << std::endl;
+    }
+}
+
+// Benchmark 13: Nested tees - records passing through 1 to 4 nested tees, each with a stream
+// of its own, with the nested tees linked compared with buffering what is written to them
+void benchmark_nesting(int iterations) {
+    std::cout << "\n=== Nested Tee Benchmark ===" << std::endl;
+    std::cout << "Iterations: " << iterations << std::endl;
+
+    // Create null streams that discard output
+    class NullBuffer : public std::streambuf {
+    protected:
+        virtual int overflow(int c) override { return c; }
+        virtual std::streamsize xsputn(const char*, std::streamsize n) override { return n; }
+    };
+
+    // Hides a tee behind another stream buffer, so it buffers what it is given
+    class ForwardBuffer : public std::streambuf {
+    public:
+        explicit ForwardBuffer(std::ostream& target) : target(target) {}
+    protected:
+        virtual int overflow(int c) override {
+            target.put(static_cast<char>(c));
+            return c;
+        }
+        virtual std::streamsize xsputn(const char* s, std::streamsize n) override {
+            target.write(s, n);
+            return n;
+        }
+        virtual int sync() override {
+            target.flush();
+            return 0;
+        }
+    private:
+        std::ostream& target;
+    };
+
+    std::vector<std::string> messages;
+    for (int i = 0; i < 100; ++i) {
+        messages.push_back(generate_random_data(100));
+    }
+
+    for (int depth = 1; depth <= 4; ++depth) {
+        for (bool linked : {true, false}) {
+            NullBuffer null_buffer;
+            std::ostream null_stream(&null_buffer);
+
+            // tees[0] is written to; every other tee is nested in the one before it
+            std::vector<std::unique_ptr<TeeStream>> tees;
+            std::vector<std::unique_ptr<ForwardBuffer>> forwards;
+            std::vector<std::unique_ptr<std::ostream>> hidden;
+            for (int i = 0; i <= depth; ++i) {
+                tees.push_back(std::make_unique<TeeStream>(65536, 49152));
+                tees.back()->add_stream(null_stream);
+            }
+            for (int i = depth; i > 0; --i) {
+                if (linked) {
+                    tees[i - 1]->add_stream(*tees[i]);
+                } else {
+                    forwards.push_back(std::make_unique<ForwardBuffer>(*tees[i]));
+                    hidden.push_back(std::make_unique<std::ostream>(forwards.back().get()));
+                    tees[i - 1]->add_stream(*hidden.back());
+                }
+            }
+
+            size_t bytes = 0;
+            auto start = std::chrono::high_resolution_clock::now();
+            for (int i = 0; i < iterations; ++i) {
+                const std::string& message = messages[i % messages.size()];
+                *tees[0] << message << '\n';
+                bytes += message.size() + 1;
+            }
+            tees[0]->flush();
+            auto end = std::chrono::high_resolution_clock::now();
+
+            double seconds = std::chrono::duration_cast<std::chrono::microseconds>(end - start).count() / 1000000.0;
+            double mb_per_sec = (bytes / (1024.0 * 1024.0)) / seconds;
+            double ns_per_record = seconds * 1e9 / iterations;
+
+            std::cout << "Depth " << depth << " " << std::setw(8) << std::left << (linked ? "linked" : "buffered")
+                      << std::right << " | "
+                      << "Throughput: " << std::fixed << std::setprecision(2) << mb_per_sec << " MB/s | "
+                      << "Per record: " << std::fixed << std::setprecision(2) << ns_per_record << " ns" << std::endl;
+
+            // A tee goes before the tees nested in it, which it flushes into
+            for (auto& tee : tees) {
+                tee.reset();
+            }
+        }
+    }
+}
+
 int main(int argc, char* argv[]) {
     std::cout << "TeeStream Performance Benchmarks" << std::endl;
     std::cout << "===============================" << std::endl;
@@ -391,6 +946,22 @@ int main(int argc, char* argv[]) {
     
     size_t stream_count_data_size = 1024 * 64;  // 64 KB
     int stream_count_iterations = 1000;
+
+    int wakeup_iterations = 2000;
+
+    int churn_rounds = 500;
+
+    int format_iterations = 1000000;
+
+    int print_iterations = 1000000;
+
+    int deferred_iterations = 1000000;
+
+    int json_iterations = 1000000;
+
+    int routing_iterations = 1000000;
+
+    int nesting_iterations = 1000000;
     
     // Parse command line arguments
     for (int i = 1; i < argc; i += 2) {
@@ -420,6 +991,22 @@ int main(int argc, char* argv[]) {
             stream_count_data_size = std::stoul(value);
         } else if (param == "--stream-iterations") {
             stream_count_iterations = std::stoi(value);
+        } else if (param == "--wakeup-iterations") {
+            wakeup_iterations = std::stoi(value);
+        } else if (param == "--churn-rounds") {
+            churn_rounds = std::stoi(value);
+        } else if (param == "--format-iterations") {
+            format_iterations = std::stoi(value);
+        } else if (param == "--print-iterations") {
+            print_iterations = std::stoi(value);
+        } else if (param == "--deferred-iterations") {
+            deferred_iterations = std::stoi(value);
+        } else if (param == "--json-iterations") {
+            json_iterations = std::stoi(value);
+        } else if (param == "--routing-iterations") {
+            routing_iterations = std::stoi(value);
+        } else if (param == "--nesting-iterations") {
+            nesting_iterations = std::stoi(value);
         } else {
             std::cerr << "Unknown parameter: " << param << std::endl;
             return 1;
@@ -429,9 +1016,17 @@ int main(int argc, char* argv[]) {
     // Run benchmarks
     benchmark_throughput(throughput_data_size, throughput_iterations);
     benchmark_latency(latency_iterations);
+    benchmark_deferred_latency(deferred_iterations);
     benchmark_scalability(scalability_data_size, scalability_iterations);
     benchmark_buffer_sizes(buffer_test_data_size, buffer_test_iterations);
     benchmark_stream_count(stream_count_data_size, stream_count_iterations);
+    benchmark_wakeup_latency(wakeup_iterations);
+    benchmark_thread_churn(churn_rounds);
+    benchmark_formatting(format_iterations);
+    benchmark_print(print_iterations);
+    benchmark_json(json_iterations);
+    benchmark_routing(routing_iterations);
+    benchmark_nesting(nesting_iterations);
     
     return 0;
 } 
\ No newline at end of file
@@ -0,0 +1,64 @@
+#include "TeeStreamCoro.h"
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <asio.hpp>
+
+using Executor = asio::io_context::executor_type;
+
+// Fire-and-forget coroutine type, started from the io_context
+struct DetachedTask {
+    struct promise_type {
+        DetachedTask get_return_object() { return {}; }
+        std::suspend_never initial_suspend() { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+// A producer that never blocks an io_context thread: when the stream queues are
+// full it suspends and is resumed on the io_context once they drain
+DetachedTask produce(AsyncTeeStream<Executor>& tee, int id, int count,
+                     asio::executor_work_guard<Executor> work) {
+    for (int i = 0; i < count; ++i) {
+        std::string line = "Producer " + std::to_string(id) + ": message " + std::to_string(i) + "\n";
+        co_await tee.async_write(line);
+    }
+
+    // Wait until everything this producer wrote has reached the streams
+    co_await tee.async_flush();
+    std::string done = "Producer " + std::to_string(id) + " finished\n";
+    co_await tee.async_write(done);
+    co_await tee.async_flush();
+}
+
+int main() {
+    std::cout << "TeeStream Coroutine Example" << std::endl;
+    std::cout << "===========================" << std::endl;
+
+    asio::io_context io_context;
+    std::ofstream log_file("coroutine_example.log");
+
+    // Small queues so backpressure actually happens
+    AsyncTeeStream<Executor> tee(io_context.get_executor(), 256);
+    tee.add_stream(std::cout);
+    tee.add_stream(log_file);
+
+    for (int id = 0; id < 4; ++id) {
+        asio::post(io_context, [&tee, &io_context, id]() {
+            produce(tee, id, 10, asio::make_work_guard(io_context));
+        });
+    }
+
+    // Run the coroutines on two threads
+    std::thread runner([&io_context]() { io_context.run(); });
+    io_context.run();
+    runner.join();
+
+    tee.drain();
+    std::cout << "All producers completed. Check coroutine_example.log for output." << std::endl;
+
+    return 0;
+}
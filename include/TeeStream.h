@@ -12,47 +12,978 @@
 #include <thread>
 #include <functional>
 #include <shared_mutex>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <condition_variable>
+#include <charconv>
+#include <cmath>
+#include <cstring>
+#include <string_view>
+#include <type_traits>
+#include <array>
+#include <limits>
+#include <stdexcept>
+#include <tuple>
+#include <utility>
 
-// A high-performance thread-safe tee streambuf using thread-local buffers
-class TeeStreamBuf : public std::streambuf {
+// Format strings are checked at compile time where consteval is available
+#if defined(__cpp_consteval)
+#define TEESTREAM_CONSTEVAL consteval
+#else
+#define TEESTREAM_CONSTEVAL constexpr
+#endif
+
+// How a stream receives what is written to the tee
+enum class SinkFormat {
+    Text,    // Plain text; deferred print records are formatted
+    Binary   // Framed binary: text frames, and deferred records in their compact form
+};
+
+// Statements below this level compile to nothing (0 Trace, 1 Debug, 2 Info, 3 Warn,
+// 4 Error, 5 Fatal, 6 Off)
+#ifndef TEESTREAM_MIN_LEVEL
+#define TEESTREAM_MIN_LEVEL 0
+#endif
+
+// Severity of a leveled statement (see TEE_LOG); the statement's record has this level
+enum class LogLevel {
+    Trace,
+    Debug,
+    Info,
+    Warn,
+    Error,
+    Fatal,
+    Off     // Above every statement
+};
+
+// Metadata of a record, for stream filters (see TeeStreamBuf::begin_record)
+struct RecordInfo {
+    int level = 0;
+    const char* tag = nullptr;  // A string that outlives the tee, or nullptr
+    std::thread::id thread;
+};
+
+// What a rate limit counts
+enum class RateUnit {
+    Records,
+    Bytes
+};
+
+// Token bucket: `per_second` tokens are added every second, up to `burst`
+struct RateLimit {
+    double per_second = 0;   // No limit if 0
+    double burst = 0;        // `per_second` if 0; at least one record
+    RateUnit unit = RateUnit::Records;
+};
+
+// Kinds of sensitive text a stream can have masked
+enum class RedactionKind {
+    CardNumbers,   // 13 to 19 digits passing the Luhn check; the last 4 stay visible
+    ValueAfter     // The value after `prefix`, up to whitespace, a quote or , ; & ) ] }
+};
+
+struct RedactionRule {
+    RedactionKind kind = RedactionKind::CardNumbers;
+    std::string prefix;   // For ValueAfter, e.g. "token="
+};
+
+// How a stream receives what is written to the tee
+struct SinkOptions {
+    SinkFormat format = SinkFormat::Text;
+    LogLevel min_level = LogLevel::Trace;           // Records below this level are not written
+    std::function<bool(const RecordInfo&)> filter;  // Records to write; every record if empty
+    std::vector<std::string> match;                 // If not empty, only records containing one of these
+    uint64_t sample_every = 1;                      // Write the first of every N records that pass
+    RateLimit rate_limit;                           // Records over the limit are suppressed
+    std::chrono::milliseconds dedup_window{0};      // Collapse repeats of a record within this time
+    std::vector<RedactionRule> redact;              // Masked with '*' before the stream sees them
+};
+
+// Bounds and tuning for adaptive per-thread buffer sizing
+struct AdaptiveSizingPolicy {
+    size_t min_buffer_size = 1024;
+    size_t max_buffer_size = 1024 * 1024;
+    double threshold_ratio = 0.75;         // Flush threshold as a fraction of the buffer size
+    double target_flush_overhead = 0.10;   // Grow while flushing takes more than this share of the time
+    double min_improvement = 0.10;         // Keep a larger buffer only if it cut flush cost per byte by this much
+    size_t sample_flushes = 16;            // Flushes per measurement window
+};
+
+// How background writers wait for queued data in async mode
+enum class WakeupMode {
+    Blocking,       // Sleep right away; lowest CPU use
+    SpinThenPark,   // Spin briefly, then sleep until woken
+    BusyPoll        // Never sleep; dedicates a core to each writer for the lowest latency
+};
+
+// Snapshot of one thread's buffer for a TeeStreamBuf
+struct ThreadBufferStats {
+    std::thread::id thread;
+    size_t buffer_size;
+    size_t flush_threshold;
+    uint64_t flushes;
+    uint64_t bytes_flushed;
+};
+
+// Snapshot of the process-wide buffer pool
+struct BufferPoolStats {
+    size_t pooled_bytes;     // Storage currently held for reuse
+    size_t pooled_blocks;
+    size_t total_bytes;      // All storage charged to the memory budget, in use or pooled
+    uint64_t reused;         // Acquisitions served from the pool
+    uint64_t allocated;      // Acquisitions that had to allocate
+    uint64_t denied;         // Acquisitions refused by the memory budget
+};
+
+// What happens when the memory budget is reached
+enum class BudgetPolicy {
+    Block,   // Queued data waits for memory to be released; threads that get no buffer write through
+    Shrink,  // Thread buffers get a smaller size that fits; queued data waits as with Block
+    Drop     // Queued data that does not fit is dropped; threads that get no buffer write through
+};
+
+// How the buffer pool allocates new storage
+struct BufferAllocationOptions {
+    bool huge_pages = false;  // Back blocks of 1 MiB and up with 2 MiB transparent huge pages (Linux)
+    bool prefault = false;    // Touch every page at allocation so first writes don't page-fault
+};
+
+// Clock read for timestamp prefixes
+enum class TimestampClock {
+    Realtime,   // Full resolution
+    Coarse      // Cheaper, at the kernel tick's resolution (CLOCK_REALTIME_COARSE on Linux)
+};
+
+// Format of timestamp prefixes, "[2024-01-01 12:00:00.123456] " by default
+struct TimestampOptions {
+    unsigned fraction_digits = 6;   // Sub-second digits, 0 to 9
+    bool utc = false;               // UTC instead of local time
+    TimestampClock clock = TimestampClock::Realtime;
+};
+
+// Timestamp formatting for line prefixes. The calendar part is formatted once per
+// second and cached per thread; only the sub-second digits are written each time.
+class TimestampPrefix {
+public:
+    static constexpr size_t kMaxSize = 32;
+
+    // Write the current time into `out` (at least kMaxSize bytes); returns its length
+    static size_t format(char* out, const TimestampOptions& options = TimestampOptions());
+};
+
+// Process-wide, lock-free pool of buffer storage. Buffers released by exited
+// threads (or destroyed TeeStreams) are handed to new ones without zeroing.
+class BufferPool {
+public:
+    // Uninitialized storage of at least the requested size, returned to the pool when destroyed
+    class Block {
+    private:
+        char* ptr;
+        size_t cap;
+
+    public:
+        Block() : ptr(nullptr), cap(0) {}
+        Block(char* ptr, size_t cap) : ptr(ptr), cap(cap) {}
+        Block(Block&& other) noexcept : ptr(other.ptr), cap(other.cap) {
+            other.ptr = nullptr;
+            other.cap = 0;
+        }
+        Block& operator=(Block&& other) noexcept {
+            if (this != &other) {
+                BufferPool::release(ptr, cap);
+                ptr = other.ptr;
+                cap = other.cap;
+                other.ptr = nullptr;
+                other.cap = 0;
+            }
+            return *this;
+        }
+        Block(const Block&) = delete;
+        Block& operator=(const Block&) = delete;
+        ~Block() { BufferPool::release(ptr, cap); }
+
+        char* data() const { return ptr; }
+        size_t capacity() const { return cap; }
+    };
+
+    // Get storage for at least `size` bytes. Over the memory budget this waits for
+    // memory to be released, or returns an empty block under the Drop policy.
+    static Block acquire(size_t size);
+
+    // Get storage without waiting: `size` bytes, or under the Shrink policy as little
+    // as `min_size`. Returns an empty block if nothing fits the memory budget.
+    static Block try_acquire(size_t size, size_t min_size);
+
+    // Allocate `count` blocks of at least `size` bytes up front and keep them pooled
+    static void warm_up(size_t size, size_t count);
+
+    // Choose how new storage is allocated; existing blocks keep their allocation
+    static void set_allocation_options(const BufferAllocationOptions& options);
+    static BufferAllocationOptions get_allocation_options();
+
+    // Limit how much released storage is kept for reuse (0 disables pooling)
+    static void set_max_pooled_bytes(size_t max_bytes);
+    static size_t get_max_pooled_bytes();
+
+    // Cap the memory of every buffer, queued chunk and pooled block (0 for no limit)
+    static void set_memory_budget(size_t max_bytes, BudgetPolicy policy = BudgetPolicy::Block);
+    static size_t get_memory_budget();
+    static BudgetPolicy get_budget_policy();
+
+    // Bytes currently charged to the budget, in use or pooled: the storage of thread
+    // buffers, queued chunks and pooled blocks. Not charged, and not limited by the budget:
+    // Chunk objects and their shared_ptr control blocks, queue deque nodes, record marks
+    // and admissions, the text and binary encodings and joined copies made for streams
+    // and chunks, the text a redacting stream holds back, and the last record kept for
+    // repeat suppression.
+    static size_t memory_usage();
+
+    // Free everything currently pooled
+    static void trim();
+
+    static BufferPoolStats stats();
+
+private:
+    static void release(char* ptr, size_t capacity);
+};
+
+// A high-performance thread-safe tee streambuf using thread-local buffers, for any
+// character type. The char specialization is the engine itself.
+template<typename CharT, typename Traits = std::char_traits<CharT>>
+class basic_TeeStreamBuf;
+
+template<>
+class basic_TeeStreamBuf<char> : public std::streambuf {
 private:
+    // Where a record starts in buffered or flushed data, and its metadata. A record ends
+    // after a newline, at end_record(), and where begin_record() starts the next one;
+    // record-atomic flushing and stream filters both go by this, except that flushing
+    // never cuts a line begin_record() left open. A text record that starts
+    // after a newline gets no mark of its own, so readers split text at newlines. A record
+    // is all text or all deferred records (see begin_text()).
+    struct RecordMark {
+        size_t offset;
+        RecordInfo info;
+        bool deferred = false;  // A deferred print record rather than text
+        uint16_t prefix = 0;    // Bytes of timestamp prefix the record starts with
+    };
+
     // Thread-local buffer structure
     struct ThreadBuffer {
-        std::unique_ptr<char[]> buffer;
+        BufferPool::Block buffer;
         size_t size;
         size_t used;
+        size_t record_end;  // End of the last complete record (record-atomic mode)
+        bool record_open;   // The last record has begun and not ended
+        size_t preferred_size;  // Size to return to after growing for an oversized record
+        size_t threshold;
+        bool deferred;      // The last record is a deferred print record rather than text
+        bool line_start;    // The next text byte begins a line (timestamp prefixes)
+        std::thread::id thread;
+        std::vector<RecordMark> marks;  // Records in the buffer; the first one is at offset 0
+
+        // Measurements for adaptive sizing, owned by the writing thread
+        struct AdaptiveWindow {
+            std::chrono::steady_clock::time_point start;
+            uint64_t flushes = 0;
+            uint64_t bytes = 0;
+            uint64_t flush_ns = 0;
+            size_t peak_used = 0;
+            double last_cost_per_byte = 0.0;
+            bool grew = false;
+            unsigned growth_backoff = 0;
+        } window;
+
+        // Published for stats readers on other threads
+        std::atomic<size_t> stat_size;
+        std::atomic<size_t> stat_threshold;
+        std::atomic<uint64_t> stat_flushes;
+        std::atomic<uint64_t> stat_bytes;
+
+        ThreadBuffer(size_t buffer_size, size_t flush_threshold);
+
+        // Change the preferred size and threshold and publish them
+        void set_size(size_t new_size, size_t new_threshold);
+    };
+
+    // Producer-to-writer signal: the writer spins on an epoch counter, then parks
+    // on it (futex on Linux), and producers only make a syscall if it is parked
+    class WakeSignal {
+    private:
+        std::atomic<uint32_t> value;
+        std::atomic<uint32_t> sleepers;
+#if !defined(__linux__)
+        std::mutex mutex;
+        std::condition_variable cv;
+#endif
+
+    public:
+        WakeSignal() : value(0), sleepers(0) {}
+
+        uint32_t epoch() const { return value.load(std::memory_order_acquire); }
+        void notify();
+
+        // Return once the epoch differs from `seen`
+        void wait(uint32_t seen, WakeupMode mode, unsigned spin_iterations);
+    };
+
+    // Flushed data shared by every stream queue. Pooled storage goes back to the pool,
+    // and borrowed storage is released, once the last queue has written it.
+    struct Chunk {
+        BufferPool::Block block;
+        const char* ptr;
+        size_t length;
+        std::function<void()> on_release;  // Only for borrowed data
+        std::string head;                   // Timestamp prefix written before borrowed data
+        bool deferred = false;              // Deferred print records, formatted by the first writer
+        std::vector<RecordMark> marks;      // Only while a stream filters records; cover the head
+
+        Chunk(BufferPool::Block block, size_t length, bool deferred = false)
+            : block(std::move(block)), ptr(this->block.data()), length(length), deferred(deferred) {
+            queued_blocks.fetch_add(1, std::memory_order_seq_cst);
+        }
+        Chunk(const char* ptr, size_t length, std::function<void()> on_release, std::string head = std::string())
+            : ptr(ptr), length(length), on_release(std::move(on_release)), head(std::move(head)) {}
+        Chunk(const Chunk&) = delete;
+        Chunk& operator=(const Chunk&) = delete;
+        ~Chunk() {
+            if (on_release) {
+                on_release();
+            }
+            if (block.data()) {
+                queued_blocks.fetch_sub(1, std::memory_order_seq_cst);  // The block is released next
+            }
+        }
+
+        const char* data() const { return ptr; }
+        size_t size() const { return length; }
+
+        // Text of a deferred chunk, formatted once and shared by every writer
+        const std::string& formatted() const;
+
+        // SinkFormat::Binary encoding of the chunk, produced once and shared likewise
+        const std::string& encoded() const;
+
+        // The head and the data in one piece, for streams that look at whole records;
+        // copied once and shared likewise
+        const std::string& joined() const;
+
+    private:
+        mutable std::once_flag format_once;
+        mutable std::string text;
+        mutable std::once_flag encode_once;
+        mutable std::string binary;
+        mutable std::once_flag join_once;
+        mutable std::string whole;
+    };
+
+    // The records of flushed data a stream takes, in data offsets, decided by
+    // admit_records() on the flushing thread
+    struct Admission {
+        struct Record {
+            size_t begin;
+            size_t end;
+            uint16_t prefix;      // Timestamp prefix bytes at `begin`, as in RecordMark
+            uint64_t suppressed;  // Records the rate limit kept out since the last one it let through
+        };
+        std::vector<Record> records;
+    };
+
+    // A chunk queued for one stream, with the records it takes if the stream picks records
+    struct QueuedChunk {
+        std::shared_ptr<const Chunk> chunk;
+        std::unique_ptr<const Admission> admission;
+    };
+
+    // Data queued for one stream in async mode, written by a background thread
+    struct SinkQueue {
+        std::mutex mutex;
+        WakeSignal not_empty;
+        std::condition_variable not_full;
+        std::deque<QueuedChunk> chunks;
+        size_t capacity;
+        size_t queued_bytes;
+        uint64_t enqueued;  // Chunks ever queued
+        uint64_t written;   // Chunks ever written
+        bool sync_requested;
+        bool syncing;  // Writer is syncing with the queue lock released
+        bool stop;
+        std::vector<std::pair<uint64_t, std::function<void()>>> drain_waiters;
+        std::thread writer;
+
+        explicit SinkQueue(size_t capacity)
+            : capacity(capacity), queued_bytes(0), enqueued(0), written(0),
+              sync_requested(false), syncing(false), stop(false) {}
+    };
+
+    // Finds a stream's patterns in flushed text; built once when the stream is added
+    class PatternScanner;
+
+    struct Registry;
 
-        explicit ThreadBuffer(size_t buffer_size);
+    // Counters of a stream's sampling and rate limit that a thread updates once per flush,
+    // one per cache line so flushing threads do not contend on them
+    static constexpr size_t kAdmitShards = 16;
+    struct alignas(64) AdmitShard {
+        std::atomic<uint64_t> sampled{0};
+        std::atomic<uint64_t> suppressed{0};
     };
 
-    // Thread-local storage for buffers
-    static thread_local std::unique_ptr<ThreadBuffer> local_buffer;
+    // An output stream and the lock that serializes writes to it
+    struct Sink {
+        std::ostream& stream;
+        SinkFormat format;
+        LogLevel min_level;
+        std::function<bool(const RecordInfo&)> filter;
+        std::vector<std::string> patterns;
+        std::unique_ptr<PatternScanner> scanner;  // Only with patterns
+        std::mutex mutex;
+        std::unique_ptr<SinkQueue> queue;  // Only in async mode
+
+        // Sampling and rate limiting, decided before data is queued without a lock. The
+        // bucket is kept as the time it is next full, in seconds since `started` (see
+        // admit_records()); sample and suppressed counts are split over `shards`.
+        uint64_t sample_every;
+        RateLimit rate_limit;
+        std::chrono::steady_clock::time_point started;
+        std::atomic<double> full_at;
+        std::unique_ptr<AdmitShard[]> shards;  // Only with sampling or a rate limit
+        std::atomic<bool> suppressed_any;      // Set after a shard's suppressed count grows
+
+        // Repeated-record suppression, also only used by whoever holds `mutex`
+        std::chrono::steady_clock::duration dedup_window;
+        uint64_t last_hash;
+        std::string last_record;
+        std::chrono::steady_clock::time_point last_written;
+        uint64_t repeats;
+
+        // Redaction rules, and the end of the last flush a secret may continue past;
+        // only used by whoever holds `mutex`
+        bool redact_cards;
+        std::vector<std::string> redact_prefixes;
+        std::unique_ptr<PatternScanner> prefix_scanner;  // Only with prefixes
+        std::string redact_held;
+
+        // The tee behind `stream` when it is one, to hand flushes straight to its streams;
+        // only used while hold_stream() keeps it alive
+        basic_TeeStreamBuf* nested;
+
+        // The registry of the tee behind `stream` when it is one, linked or not, so the
+        // stream is left alone once that tee is destroyed
+        std::shared_ptr<Registry> stream_registry;
+
+        // Checked by flushers without a lock; see SinkHandle
+        std::atomic<bool> enabled;
+
+        // The level the stream is listed at, or -1 while it is not in `streams`, and the
+        // level it is counted at in level_streams, or -1; see recount_sink()
+        std::atomic<int> listed_level;
+        std::atomic<int> counted_level;
+
+        // Set once the stream is removed, after which flushers skip it. It stays in
+        // `streams` as a tombstone until the list is compacted.
+        std::atomic<bool> removed;
+
+        // Flushers using the stream right now, and a signal for the last of them leaving
+        // once it is removed; see SinkUse
+        std::atomic<size_t> users;
+        WakeSignal released;
+
+        Sink(std::ostream& stream, const SinkOptions& options);
+        ~Sink();
+
+        bool filtered() const {
+            return filter || min_level != LogLevel::Trace || !patterns.empty() || sample_every > 1 ||
+                   rate_limit.per_second > 0 || dedup_window.count() > 0 || redacting();
+        }
+        bool redacting() const { return redact_cards || !redact_prefixes.empty(); }
+        bool picks() const {
+            return filter || min_level != LogLevel::Trace || !patterns.empty() || sample_every > 1 ||
+                   rate_limit.per_second > 0;
+        }
+        bool accepts(const RecordInfo& info) const {
+            return info.level >= static_cast<int>(min_level) && (!filter || filter(info));
+        }
+    };
+
+    // Counts a flusher in as a user of a stream for its lifetime, unless the stream has
+    // been removed. Removal waits for the users of the stream it removes and no others.
+    class SinkUse {
+    private:
+        Sink& sink;
+        bool held;
+
+        void leave() {
+            if (sink.users.fetch_sub(1) == 1 && sink.removed.load()) {
+                sink.released.notify();
+            }
+        }
+
+    public:
+        explicit SinkUse(Sink& sink) : sink(sink), held(false) {
+            sink.users.fetch_add(1);
+            held = !sink.removed.load();
+            if (!held) {
+                leave();
+            }
+        }
+        ~SinkUse() {
+            if (held) {
+                leave();
+            }
+        }
+        SinkUse(const SinkUse&) = delete;
+        SinkUse& operator=(const SinkUse&) = delete;
+
+        explicit operator bool() const { return held; }
+    };
+
+    // State shared between a TeeStreamBuf and the threads holding buffers for it.
+    // `mutex` only guards `buffers` and is never held while taking another lock.
+    struct Registry {
+        std::mutex mutex;
+        std::vector<std::shared_ptr<ThreadBuffer>> buffers;
+
+        // Null once the tee is being destroyed. Exiting threads, stream handles and tees
+        // writing to it as a stream hold `alive` shared while they use the tee; its
+        // destructor takes it exclusively to clear `owner`, so it never goes away under them.
+        std::atomic<basic_TeeStreamBuf*> owner;
+        std::shared_mutex alive;
+
+        explicit Registry(basic_TeeStreamBuf* owner) : owner(owner) {}
+    };
+
+    // Chunks of every tee holding pooled storage; a producer over the memory budget only
+    // waits while there are any, as only their release can make room
+    static std::atomic<size_t> queued_blocks;
+
+    // Thread-local storage for buffers, one per TeeStreamBuf the thread writes to
+    struct LocalBuffers;
+    static thread_local LocalBuffers local_buffers;
+
+    // Set while the calling thread writes or flushes for try_write() or notify_when_drained().
+    // Text is then flushed at record boundaries, a full queue takes a chunk over its
+    // capacity rather than keep the thread waiting, and data the memory budget has no room
+    // for stays buffered or is refused rather than wait for memory.
+    static thread_local bool nonblocking;
+
+    struct NonblockingScope {
+        bool saved;
+        NonblockingScope() : saved(nonblocking) { nonblocking = true; }
+        ~NonblockingScope() { nonblocking = saved; }
+    };
+
+    std::shared_ptr<Registry> registry;
+
+    // Buffer for writers not tied to one thread (see try_write_shared()), made on first
+    // use and listed in the registry with the thread buffers
+    std::shared_ptr<ThreadBuffer> shared_buffer;
+    std::mutex shared_buffer_mutex;
 
-    // Master stream list with shared mutex for reader/writer lock
-    std::vector<std::reference_wrapper<std::ostream>> streams;
+    // Master stream list with shared mutex for reader/writer lock.
+    // Lock order: a tee's shared_buffer_mutex, then its streams_mutex, then a stream's mutex,
+    // then the locks of tees nested in it, tee by tee down the nesting. add_stream() rejects
+    // a stream that would nest a tee in itself, so the order has no cycles; registry->mutex
+    // is always last.
+    std::vector<std::shared_ptr<Sink>> streams;
     mutable std::shared_mutex streams_mutex;
 
+    // Removed streams still in `streams`. The list is compacted once they are half of it,
+    // by whoever holds streams_mutex exclusively next, so the others keep their order.
+    std::atomic<size_t> tombstones;
+
+    // Held while a tee is added as a stream, so nesting checks and changes are one step
+    static std::mutex nesting_mutex;
+
+    // Number of enabled streams at each min_level. Updated without a lock, so a count can
+    // dip below zero for a moment; only whether it is above zero matters.
+    std::array<std::atomic<std::ptrdiff_t>, static_cast<size_t>(LogLevel::Off) + 1> level_streams;
+
+    // Streams that filter records or hand them to a nested tee; record marks are only passed
+    // on to queued chunks while there are any
+    std::atomic<size_t> filtered_streams;
+
+    // Lowest level a leveled statement is written at: the tee's level or the lowest level
+    // any stream takes, whichever is higher, and kNoStreams without enabled streams
+    static constexpr int kNoStreams = std::numeric_limits<int>::max();
+    std::atomic<int> write_level;
+    std::atomic<LogLevel> level;
+
     // Buffer configuration
     size_t buffer_size;
     size_t flush_threshold;
+    std::atomic<bool> record_atomic;
+
+    // Adaptive sizing configuration
+    std::atomic<bool> adaptive_sizing;
+    AdaptiveSizingPolicy adaptive_policy;
+    std::atomic<size_t> sample_flushes;
+    mutable std::mutex adaptive_mutex;
+
+    // Async mode configuration, guarded by streams_mutex
+    bool async_enabled;
+    size_t queue_capacity;
+    std::atomic<WakeupMode> wakeup_mode;
+    std::atomic<unsigned> spin_iterations;
+
+    // Number of stream queues at capacity, and callbacks waiting for it to drop to zero
+    std::atomic<size_t> full_queues;
+    std::vector<std::function<void()>> writable_callbacks;
+    std::mutex callbacks_mutex;
+
+    // Bytes dropped under the Drop budget policy
+    std::atomic<uint64_t> dropped;
+
+    // Timestamp prefix configuration
+    std::atomic<bool> timestamps;
+    std::atomic<unsigned> timestamp_digits;
+    std::atomic<bool> timestamp_utc;
+    std::atomic<TimestampClock> timestamp_clock;
 
     // Initialize thread-local buffer if not already done
     ThreadBuffer* get_thread_buffer();
 
+    // Write data to every stream, or queue it in async mode (sharing `chunk` if given).
+    // A head on `chunk` is written before the data. `marks` locates its records for
+    // filtered streams. If `data` is the start of `donor`'s
+    // buffer, queued streams may take over its storage. Deferred print records are
+    // formatted before they reach a stream.
+    bool write_to_streams(const char* data, size_t size, const std::vector<RecordMark>& marks,
+                          ThreadBuffer* donor = nullptr, const std::shared_ptr<const Chunk>& chunk = nullptr,
+                          bool deferred = false);
+
+    // Wrap flushed data in a pooled chunk for the stream queues; null if the budget drops it
+    std::shared_ptr<const Chunk> make_chunk(const char* data, size_t size, const std::vector<RecordMark>& marks,
+                                            ThreadBuffer* donor, bool deferred);
+
+    // Copy the marks of the records in the first `size` bytes of data to its chunk
+    void attach_marks(Chunk& chunk, const std::vector<RecordMark>& marks, size_t size) const;
+
+    // Write flushed data to one stream in its format, encoding it into `text` or `binary`
+    // the first time a stream needs that encoding. A redacting stream may hold back the
+    // end of the data for the next write, unless it is `final`.
+    bool write_to_sink(Sink& sink, const char* data, size_t size, bool deferred,
+                       std::string& text, std::string& binary, bool final = false);
+
+    // Write what a stream still owes on a sync or its removal: text a redacting stream held
+    // back, and the summaries of suppressed and repeated records not yet written; the
+    // caller holds the stream's mutex
+    bool write_pending(Sink& sink);
+
+    // Write flushed data to the streams of a nested tee, after what this thread has buffered in it
+    bool write_nested(basic_TeeStreamBuf& nested, const char* data, size_t size,
+                      const std::vector<RecordMark>& marks, const std::shared_ptr<const Chunk>& chunk,
+                      bool deferred);
+
+    // Flush this thread's buffer if it has one, without creating it
+    void flush_local_buffer();
+
+    // Flush the shared buffer if there is one; false if flush_range() flushed nothing
+    bool flush_shared_buffer();
+
+    // try_write() into a given buffer
+    bool try_write_to(ThreadBuffer* tb, const char* s, size_t n);
+
+    // Link a stream to the tee behind it, if it is a plain text stream of another tee
+    void link_nested(Sink& sink);
+
+    // Keep the tee behind a stream, if it is one, alive while the stream is written to;
+    // false once that tee is being destroyed, and the stream must not be touched
+    static bool hold_stream(const Sink& sink, std::shared_lock<std::shared_mutex>& alive);
+
+    // Whether `tee` is this tee or nested in it, directly or through other tees
+    bool reaches(const basic_TeeStreamBuf* tee) const;
+
+    // Mark a stream removed and wait for the flushers using it; false if it already was.
+    // The caller holds streams_mutex, shared or exclusively, and calls retire_sink() once
+    // it is released.
+    bool tombstone_sink(Sink& sink);
+
+    // Drop removed streams from the list once they are half of it; the caller holds
+    // streams_mutex exclusively
+    void compact_streams();
+
+    // Stop a removed stream's writer and write what it held back, without streams_mutex
+    void retire_sink(Sink& sink);
+
+    // Count a stream in level_streams at its level while it is listed and enabled, and
+    // recompute write_level; needs no lock
+    void recount_sink(Sink& sink);
+
+    // Recompute write_level; needs no lock
+    void update_write_level();
+
+    // Sample and rate-limit the records a stream's level, filter and patterns took, in
+    // place; `costs` holds their sizes for a byte limit. Takes no lock.
+    static void limit_records(Sink& sink, Admission& admission, const std::vector<size_t>& costs);
+
+    // Take the count of records a stream's rate limit suppressed since it was last taken
+    static uint64_t take_suppressed(Sink& sink);
+
+    // Decide which records of flushed data a stream takes: its level, filter, patterns,
+    // sampling and rate limit. In async mode this runs before the data is queued. Takes
+    // no lock.
+    static void admit_records(Sink& sink, const char* data, size_t size, bool deferred,
+                              const std::vector<RecordMark>& marks, Admission& admission);
+
+    // Write the records a stream took, with its repeated-record suppression
+    bool write_admitted(Sink& sink, const char* data, size_t size, bool deferred,
+                        const Admission& admission);
+
+    // A span of text masked by redact(); its masked bytes are in one string with the others
+    struct MaskedSpan {
+        size_t begin;
+        size_t end;
+    };
+
+    // Mask the secrets a redacting stream's rules find in text; returns how much of it
+    // can be written now (see the definition)
+    static size_t redact(const Sink& sink, const char* s, size_t n, bool final,
+                         std::vector<MaskedSpan>& spans, std::string& masked);
+
+    // Write text with its masked spans replaced, the rest straight from `data`
+    static bool write_masked(Sink& sink, const char* data, size_t size,
+                             const std::vector<MaskedSpan>& spans, const std::string& masked);
+
+    // Write the records that pass a stream's filter, each run of them with one write
+    bool write_filtered(Sink& sink, const char* data, size_t size, bool deferred,
+                        const std::vector<RecordMark>& marks);
+
+    // Start a text record, or a deferred print record, at the end of a buffer. It has the
+    // metadata of the record before it; text after text goes on in the same record.
+    void begin_buffer_kind(ThreadBuffer* tb, bool deferred);
+
+    // Start a record at the end of a buffer for a line that begins with a timestamp prefix
+    // of `prefix_size` bytes, written next
+    void begin_prefixed_line(ThreadBuffer* tb, size_t prefix_size);
+
+    // Make the end of a buffer take text. A deferred line left open is formatted into text
+    // first, so the record it is part of stays all text.
+    void begin_text(ThreadBuffer* tb);
+
+    // Start and stop the background writer for a stream
+    void start_writer(Sink& sink);
+    void stop_writer(Sink& sink);
+    void run_writer(Sink* sink);
+
+    // Queue a chunk for a stream, waiting while its queue is full
+    void enqueue_chunk(SinkQueue& queue, const std::shared_ptr<const Chunk>& chunk,
+                       std::unique_ptr<const Admission> admission = nullptr);
+
+    // Run writable callbacks once no queue is full
+    void fire_writable_callbacks();
+
+    // Flush the first `end` bytes of a buffer and keep the rest. False, flushing nothing,
+    // if the calling thread must not wait and the memory budget has no room for the copy
+    // the flush needs.
+    bool flush_range(ThreadBuffer* tb, size_t end);
+
+    // Reallocate a buffer, preserving its contents; false if the memory budget does not allow it
+    bool resize_buffer(ThreadBuffer* tb, size_t new_size);
+
+    // Make room for `n` more bytes, flushing and then growing the buffer if needed;
+    // false if the memory budget does not allow it
+    bool make_room(ThreadBuffer* tb, size_t n, bool records);
+
+    // Append data in record-atomic mode. False, appending nothing, if the calling thread
+    // must not wait and the memory budget has no room for the data.
+    bool append_record_data(ThreadBuffer* tb, const char* s, size_t n);
+
+    // Account for `n` bytes just placed after the used part of the buffer in record-atomic mode
+    void records_appended(ThreadBuffer* tb, size_t n);
+
+    // Flush the complete records of a buffer once it is above its threshold (record-atomic mode)
+    void flush_complete_records(ThreadBuffer* tb);
+
+    // Account for `n` bytes just placed after the used part of the buffer
+    void bytes_appended(ThreadBuffer* tb, size_t n);
+
+    // Append text to a buffer, flushing or writing through as needed; false if a stream failed
+    bool append_text(ThreadBuffer* tb, const char* s, size_t n);
+
+    // Append text with a timestamp before every line
+    bool append_prefixed(ThreadBuffer* tb, const char* s, size_t n);
+
+    // Format this tee's timestamp prefix into `out` (TimestampPrefix::kMaxSize bytes)
+    size_t format_prefix(char* out) const;
+
+    // Re-evaluate a buffer's size from the last measurement window
+    void adapt_buffer(ThreadBuffer* tb);
+
+    // Sync every stream
+    int sync_streams();
+
 public:
+    // A stream added to a tee. Copies refer to the same stream; a default-constructed
+    // handle refers to none. Handles may outlive the stream and the tee.
+    class SinkHandle {
+    public:
+        SinkHandle() = default;
+
+        // Stop and resume writing to the stream. Flushers check this with one relaxed
+        // load, and neither call takes a lock a flusher holds, so they return even while
+        // one waits on a full queue. Data already queued in async mode is still written.
+        // Levels that only disabled streams take are not buffered.
+        void enable() { set_enabled(true); }
+        void disable() { set_enabled(false); }
+        bool is_enabled() const { return sink && sink->enabled.load(std::memory_order_relaxed); }
+
+        // Change the lowest level of record the stream takes
+        void set_min_level(LogLevel level);
+
+        // Remove the stream from its tee without searching for it; false if it is no longer
+        // there. Takes the tee's stream list lock shared, and only waits for flushers
+        // writing to this stream. The other streams are written in the same order as before.
+        bool remove();
+
+        // Whether the stream is still in its tee
+        explicit operator bool() const;
+
+    private:
+        friend class basic_TeeStreamBuf;
+
+        SinkHandle(std::weak_ptr<Registry> registry, std::shared_ptr<Sink> sink)
+            : registry(std::move(registry)), sink(std::move(sink)) {}
+
+        void set_enabled(bool enabled);
+
+        // The tee, kept alive by `lock`, or null once it is being destroyed
+        basic_TeeStreamBuf* lock_tee(std::shared_lock<std::shared_mutex>& lock) const;
+
+        std::weak_ptr<Registry> registry;
+        std::shared_ptr<Sink> sink;
+    };
+
     // Constructor with configurable buffer size and flush threshold
-    explicit TeeStreamBuf(size_t buffer_size = 8192, size_t flush_threshold = 6144);
+    explicit basic_TeeStreamBuf(size_t buffer_size = 8192, size_t flush_threshold = 6144);
     
     // Destructor - flush any remaining data
-    ~TeeStreamBuf();
+    ~basic_TeeStreamBuf();
 
     // Thread-safe stream management
-    void add_stream(std::ostream& stream);
+    SinkHandle add_stream(std::ostream& stream, SinkFormat format = SinkFormat::Text);
+    SinkHandle add_stream(std::ostream& stream, const SinkOptions& options);
     void remove_stream(std::ostream& stream);
     
     // Manually flush the thread-local buffer
     void flush_thread_buffer();
 
+    // Start a record in the calling thread's buffer, ending the one before it. What the
+    // thread writes from here to its next begin_record() has this metadata, which stream
+    // filters are evaluated on once per record when it is flushed.
+    void begin_record(int level, const char* tag = nullptr);
+
+    // Leveled statements below `level` are skipped (LogLevel::Trace by default)
+    void set_level(LogLevel level);
+    LogLevel get_level() const;
+
+    // Whether a statement at `level` would be written anywhere: one relaxed load
+    bool is_level_enabled(LogLevel level) const {
+        return static_cast<int>(level) >= write_level.load(std::memory_order_relaxed);
+    }
+
+    // Whether any stream is enabled; without one, writes are dropped before they are buffered
+    bool has_enabled_streams() const {
+        return write_level.load(std::memory_order_relaxed) != kNoStreams;
+    }
+
+    // Pre-allocate pooled buffers for `thread_count` threads before traffic starts
+    void warm_up(size_t thread_count);
+
+    // Zero-copy writes: get space for `n` bytes directly in the calling thread's buffer
+    // (flushing or growing it first), write into it, then commit how many bytes were used.
+    // The space is valid until the next write from this thread. Returns nullptr if the
+    // memory budget does not allow the space, or if no stream is enabled.
+    char* reserve(size_t n);
+    void commit(size_t n);
+
+    // Space for, and commit of, deferred print records (see TeeStream::print_deferred)
+    char* reserve_deferred(size_t n);
+    void commit_deferred(size_t n);
+
+    // Format a run of deferred print records and append the text to `out`
+    static void format_deferred(const char* data, size_t size, std::string& out);
+
+    // Append the SinkFormat::Binary encoding of flushed data to `out`
+    static void encode_binary(const char* data, size_t size, bool deferred, std::string& out);
+
+    // Write a large payload without copying it: streams write straight from `data`, and
+    // async queues hold on to it. `on_release` is called once every stream is done with
+    // it, possibly on a background writer thread; `data` must stay valid until then.
+    bool write_borrowed(const char* data, size_t size, std::function<void()> on_release);
+    bool write_borrowed(std::string&& data);
+    bool write_borrowed(std::vector<char>&& data);
+
+    // Record-atomic mode: flush only whole records, never a partial line
+    void set_record_atomic(bool enabled);
+    bool is_record_atomic() const;
+
+    // Mark the end of a logical record in the calling thread's buffer. Stream filters see
+    // the same boundary; what follows keeps the record's metadata.
+    void end_record();
+
+    // Adaptive sizing: grow or shrink each thread's buffer from its write rate and flush cost
+    void enable_adaptive_sizing(const AdaptiveSizingPolicy& policy = AdaptiveSizingPolicy());
+    void disable_adaptive_sizing();
+    bool is_adaptive_sizing() const;
+
+    // Buffer sizes and counters for every thread with a buffer
+    std::vector<ThreadBufferStats> thread_buffer_stats() const;
+
+    // Async mode: flushed data is queued per stream (up to `queue_capacity` bytes each)
+    // and written by one background thread per stream
+    void enable_async(size_t queue_capacity = 1024 * 1024);
+    void disable_async();
+    bool is_async() const;
+
+    // True while any stream queue is full, so flushing would block
+    bool backpressured() const;
+
+    // Call `callback` once no stream queue is full. Returns false without storing
+    // the callback if nothing is full right now.
+    bool notify_when_writable(std::function<void()> callback);
+
+    // Flush the calling thread's buffer and the shared buffer, and call `callback` once
+    // every stream has written and synced everything queued so far. Returns false without
+    // storing the callback if nothing is queued. The flush does not wait for full queues
+    // or the memory budget; text the budget has no room to queue stays buffered.
+    bool notify_when_drained(std::function<void()> callback);
+
+    // Buffer text without ever waiting for a stream queue or the memory budget. Returns
+    // false, writing nothing, if the text would fill the buffer while a queue is full; the
+    // complete records already buffered are flushed then, so they stay ahead of the text
+    // when it is retried. Also returns false, writing nothing, if the budget has no room
+    // for the text; a flush the budget has no room for leaves the text buffered.
+    // Buffered text is only flushed at record boundaries.
+    bool try_write(const char* s, size_t n);
+
+    // try_write() into one buffer the tee shares between threads rather than the calling
+    // thread's, for writers that may go on from another thread, such as coroutines on a
+    // multi-threaded executor. Each call's text is buffered whole. notify_when_drained(),
+    // drain() and sync() from any thread flush it.
+    bool try_write_shared(const char* s, size_t n);
+
+    // Flush the shared buffer without waiting for a stream queue or the memory budget.
+    // Returns false, flushing nothing, if the budget has no room to queue its text.
+    bool try_flush_shared();
+
+    // Block until everything queued so far has been written
+    void drain();
+
+    // How background writers wait for data; takes effect from their next wait
+    void set_wakeup_mode(WakeupMode mode, unsigned spin_iterations = 4000);
+    WakeupMode get_wakeup_mode() const;
+
+    // Bytes dropped because the memory budget was reached (BudgetPolicy::Drop)
+    uint64_t dropped_bytes() const;
+
+    // Start every line of text with a timestamp
+    void enable_timestamps(const TimestampOptions& options = TimestampOptions());
+    void disable_timestamps();
+    bool has_timestamps() const;
+
 protected:
     // Override streambuf methods
     virtual int_type overflow(int_type c) override;
@@ -60,25 +991,1158 @@ protected:
     virtual int sync() override;
 };
 
-// A high-performance thread-safe tee stream
-class TeeStream : public std::ostream {
+using TeeStreamBuf = basic_TeeStreamBuf<char>;
+using SinkHandle = TeeStreamBuf::SinkHandle;
+
+// Tee streambuf for wide and UTF-8 text. The characters' bytes are buffered by a char
+// engine, so thread buffers, async mode and adaptive sizing work as they do for char,
+// and each stream is written whole characters straight from the engine's buffers.
+// Sizes are in characters; thread buffer stats are in bytes.
+template<typename CharT, typename Traits>
+class basic_TeeStreamBuf : public std::basic_streambuf<CharT, Traits> {
+public:
+    using int_type = typename Traits::int_type;
+    using stream_type = std::basic_ostream<CharT, Traits>;
+
+private:
+    // A stream of CharT as seen by the engine. The engine never splits a write, so
+    // everything it writes is a whole number of characters.
+    class SinkAdapter : public std::streambuf {
+    public:
+        stream_type& target;
+        std::ostream stream;
+
+        explicit SinkAdapter(stream_type& target) : target(target), stream(this) {}
+
+    protected:
+        std::streamsize xsputn(const char* s, std::streamsize n) override {
+            target.write(reinterpret_cast<const CharT*>(s), n / static_cast<std::streamsize>(sizeof(CharT)));
+            return target ? n : 0;
+        }
+
+        int sync() override {
+            return target.flush() ? 0 : -1;
+        }
+    };
+
+    // Declared before the engine, which writes to them until it is destroyed
+    std::vector<std::unique_ptr<SinkAdapter>> adapters;
+    std::mutex adapters_mutex;
+    TeeStreamBuf engine;
+
+public:
+    explicit basic_TeeStreamBuf(size_t buffer_size = 8192, size_t flush_threshold = 6144)
+        : engine(buffer_size * sizeof(CharT), flush_threshold * sizeof(CharT)) {}
+
+    // Thread-safe stream management
+    void add_stream(stream_type& stream);
+    void remove_stream(stream_type& stream);
+
+    void flush_thread_buffer() { engine.flush_thread_buffer(); }
+    void warm_up(size_t thread_count) { engine.warm_up(thread_count); }
+
+    void enable_adaptive_sizing(const AdaptiveSizingPolicy& policy = AdaptiveSizingPolicy()) {
+        engine.enable_adaptive_sizing(policy);
+    }
+    void disable_adaptive_sizing() { engine.disable_adaptive_sizing(); }
+    bool is_adaptive_sizing() const { return engine.is_adaptive_sizing(); }
+    std::vector<ThreadBufferStats> thread_buffer_stats() const { return engine.thread_buffer_stats(); }
+
+    void enable_async(size_t queue_capacity = 1024 * 1024) { engine.enable_async(queue_capacity); }
+    void disable_async() { engine.disable_async(); }
+    bool is_async() const { return engine.is_async(); }
+    void drain() { engine.drain(); }
+
+    uint64_t dropped_bytes() const { return engine.dropped_bytes(); }
+
+protected:
+    int_type overflow(int_type c) override {
+        if (Traits::eq_int_type(c, Traits::eof())) {
+            return Traits::eof();
+        }
+        CharT ch = Traits::to_char_type(c);
+        return xsputn(&ch, 1) == 1 ? c : Traits::eof();
+    }
+
+    // The character width is a compile-time constant, so this is the char path's copy
+    std::streamsize xsputn(const CharT* s, std::streamsize n) override {
+        if (n <= 0) {
+            return 0;
+        }
+        auto bytes = n * static_cast<std::streamsize>(sizeof(CharT));
+        return engine.sputn(reinterpret_cast<const char*>(s), bytes) == bytes ? n : 0;
+    }
+
+    int sync() override {
+        return engine.pubsync();
+    }
+};
+
+// Add a stream to write to
+template<typename CharT, typename Traits>
+void basic_TeeStreamBuf<CharT, Traits>::add_stream(stream_type& stream) {
+    std::lock_guard<std::mutex> lock(adapters_mutex);
+    adapters.push_back(std::make_unique<SinkAdapter>(stream));
+    engine.add_stream(adapters.back()->stream);
+}
+
+// Remove a stream once the engine has stopped writing to it
+template<typename CharT, typename Traits>
+void basic_TeeStreamBuf<CharT, Traits>::remove_stream(stream_type& stream) {
+    std::lock_guard<std::mutex> lock(adapters_mutex);
+    auto removed = std::stable_partition(adapters.begin(), adapters.end(),
+        [&stream](const std::unique_ptr<SinkAdapter>& adapter) {
+            return &adapter->target != &stream;
+        }
+    );
+    for (auto it = removed; it != adapters.end(); ++it) {
+        engine.remove_stream((*it)->stream);
+    }
+    adapters.erase(removed, adapters.end());
+}
+
+// Selects the TeeFormatString constructor that parses at run time
+struct TeeFormatRuntime {};
+
+// Base of the types TEE_FMT makes: each carries one string literal in its type, so the
+// format string is parsed once, at compile time, under every standard
+struct TeeFormatLiteral {};
+
+// Format string for print() and print_deferred() that is checked at compile time in C++17
+// too, e.g. tee.print(TEE_FMT("{} took {}us\n"), name, us)
+#define TEE_FMT(literal) \
+    [] { \
+        struct TeeFormatLiteralType : TeeFormatLiteral { \
+            static constexpr std::string_view value() { return literal; } \
+        }; \
+        return TeeFormatLiteralType(); \
+    }()
+
+template<typename T>
+inline constexpr bool is_tee_format_literal = std::is_base_of_v<TeeFormatLiteral, T>;
+
+// One placeholder of a TeeFormatString: the literal text before it, then the argument spec
+struct TeeFormatSegment {
+    size_t literal_begin = 0;
+    size_t literal_size = 0;
+    bool escaped = false;       // Literal contains "{{" or "}}" to collapse
+    char type = 0;              // Presentation type such as 'x' or 'f'; 0 for the default
+    int precision = -1;
+};
+
+// Format string for TeeStream::print, parsed when it is constructed. Supports the
+// std::format subset "{}" and "{:[.precision][type]}" with types d x X o b for
+// integers, e f g for floating point, s for strings and bools and c for chars.
+// Every argument needs exactly one placeholder, in order. Plain strings convert only
+// where consteval is available; C++17 code passes TEE_FMT("...") instead.
+template<typename... Args>
+class TeeFormatString {
+public:
+    // Argument categories: integer, floating point, bool, char, string; 0 if unsupported
+    template<typename T>
+    static constexpr char kind() {
+        if constexpr (std::is_same_v<T, bool>) {
+            return 'b';
+        } else if constexpr (std::is_same_v<T, char>) {
+            return 'c';
+        } else if constexpr (std::is_integral_v<T>) {
+            return 'i';
+        } else if constexpr (std::is_floating_point_v<T>) {
+            return 'f';
+        } else if constexpr (std::is_convertible_v<const T&, std::string_view>) {
+            return 's';
+        } else {
+            return 0;
+        }
+    }
+
+    std::string_view text;
+    std::array<TeeFormatSegment, sizeof...(Args) + 1> segments{};   // The last one holds only the trailing literal
+
+#if defined(__cpp_consteval)
+    template<typename S, std::enable_if_t<std::is_convertible_v<const S&, std::string_view>, int> = 0>
+    consteval TeeFormatString(const S& format)
+        : TeeFormatString(TeeFormatRuntime(), std::string_view(format)) {}
+#else
+    // Without consteval a plain string could only be checked when print() is called
+    template<typename S, std::enable_if_t<std::is_convertible_v<const S&, std::string_view>, int> = 0>
+    TeeFormatString(const S&) {
+        static_assert(!std::is_same_v<S, S>,
+                      "Format strings are checked at compile time; before C++20 wrap them in TEE_FMT(\"...\")");
+    }
+#endif
+
+    // Parse a format string that is only known at run time; throws std::invalid_argument
+    constexpr TeeFormatString(TeeFormatRuntime, std::string_view format) : text(format) {
+        constexpr std::array<char, sizeof...(Args)> kinds = {kind<Args>()...};
+        size_t arg = 0;
+        size_t i = 0;
+        segments[0].literal_begin = 0;
+
+        while (i < text.size()) {
+            char c = text[i];
+            if (c == '}') {
+                if (i + 1 >= text.size() || text[i + 1] != '}') {
+                    throw std::invalid_argument("TeeFormatString: unmatched '}'");
+                }
+                segments[arg].escaped = true;
+                i += 2;
+                continue;
+            }
+            if (c != '{') {
+                i++;
+                continue;
+            }
+            if (i + 1 < text.size() && text[i + 1] == '{') {
+                segments[arg].escaped = true;
+                i += 2;
+                continue;
+            }
+
+            // A placeholder for argument `arg`
+            if (arg >= sizeof...(Args)) {
+                throw std::invalid_argument("TeeFormatString: more placeholders than arguments");
+            }
+            TeeFormatSegment& segment = segments[arg];
+            segment.literal_size = i - segment.literal_begin;
+            i++;
+            if (i < text.size() && text[i] == ':') {
+                i++;
+                if (i < text.size() && text[i] == '.') {
+                    i++;
+                    segment.precision = 0;
+                    size_t digits = 0;
+                    for (; i < text.size() && text[i] >= '0' && text[i] <= '9' && digits < 4; i++, digits++) {
+                        segment.precision = segment.precision * 10 + (text[i] - '0');
+                    }
+                    if (digits == 0 || kinds[arg] != 'f') {
+                        throw std::invalid_argument("TeeFormatString: bad precision");
+                    }
+                }
+                if (i < text.size() && text[i] != '}') {
+                    segment.type = text[i++];
+                }
+            }
+            if (i >= text.size() || text[i] != '}') {
+                throw std::invalid_argument("TeeFormatString: unsupported format spec");
+            }
+            i++;
+
+            std::string_view allowed = kinds[arg] == 'i' ? "dxXob"
+                : kinds[arg] == 'f' ? "efg"
+                : kinds[arg] == 'c' ? "c"
+                : "s";
+            if (segment.type != 0 && allowed.find(segment.type) == std::string_view::npos) {
+                throw std::invalid_argument("TeeFormatString: presentation type does not match the argument");
+            }
+
+            arg++;
+            segments[arg].literal_begin = i;
+        }
+
+        if (arg != sizeof...(Args)) {
+            throw std::invalid_argument("TeeFormatString: fewer placeholders than arguments");
+        }
+        segments[arg].literal_size = text.size() - segments[arg].literal_begin;
+    }
+};
+
+// A TEE_FMT format string, parsed while compiling; a bad one is a compile error
+template<typename Format, typename... Args>
+inline constexpr TeeFormatString<Args...> tee_format_parsed{TeeFormatRuntime(), Format::value()};
+
+// Type print() formats an argument of type `const T&` as; arrays become const pointers.
+// Being a non-deduced context, it also keeps print() from deducing from the format string.
+template<typename T>
+using TeeFormatArg = std::decay_t<const T>;
+
+// Renders format-string pieces into caller-provided space
+struct TeeFormatRender {
+    // Upper bound on the rendered size of a value
+    template<typename T>
+    static size_t bound(const T& value, const TeeFormatSegment& segment) {
+        if constexpr (std::is_same_v<T, bool> || std::is_same_v<T, char>) {
+            return 5;
+        } else if constexpr (std::is_integral_v<T>) {
+            return std::numeric_limits<T>::digits + 2;
+        } else if constexpr (std::is_floating_point_v<T>) {
+            size_t precision = segment.precision < 0 ? 6 : static_cast<size_t>(segment.precision);
+            size_t digits = segment.type == 'f' ? std::numeric_limits<T>::max_exponent10 : 0;
+            return digits + precision + 48;
+        } else {
+            return std::string_view(value).size();
+        }
+    }
+
+    // Render a value into at least bound() bytes at `out`; returns the end of the output
+    template<typename T>
+    static char* value(char* out, char* end, const T& value, const TeeFormatSegment& segment) {
+        if constexpr (std::is_same_v<T, bool>) {
+            std::memcpy(out, value ? "true" : "false", value ? 4 : 5);
+            return out + (value ? 4 : 5);
+        } else if constexpr (std::is_same_v<T, char>) {
+            *out = value;
+            return out + 1;
+        } else if constexpr (std::is_integral_v<T>) {
+            int base = segment.type == 'x' || segment.type == 'X' ? 16
+                : segment.type == 'o' ? 8
+                : segment.type == 'b' ? 2
+                : 10;
+            char* last = std::to_chars(out, end, value, base).ptr;
+            if (segment.type == 'X') {
+                for (char* p = out; p != last; p++) {
+                    if (*p >= 'a' && *p <= 'f') {
+                        *p = static_cast<char>(*p - 'a' + 'A');
+                    }
+                }
+            }
+            return last;
+        } else if constexpr (std::is_floating_point_v<T>) {
+            if (segment.type == 0 && segment.precision < 0) {
+                return std::to_chars(out, end, value).ptr;
+            }
+            std::chars_format format = segment.type == 'e' ? std::chars_format::scientific
+                : segment.type == 'f' ? std::chars_format::fixed
+                : std::chars_format::general;
+            return std::to_chars(out, end, value, format, segment.precision < 0 ? 6 : segment.precision).ptr;
+        } else {
+            std::string_view s(value);
+            if (!s.empty()) {
+                std::memcpy(out, s.data(), s.size());
+            }
+            return out + s.size();
+        }
+    }
+
+    // Render literal text into text.size() bytes at `out`, collapsing "{{" and "}}" when escaped
+    static char* literal(char* out, std::string_view text, bool escaped) {
+        if (!escaped) {
+            if (!text.empty()) {
+                std::memcpy(out, text.data(), text.size());
+            }
+            return out + text.size();
+        }
+        for (size_t i = 0; i < text.size(); i++) {
+            *out++ = text[i];
+            if ((text[i] == '{' || text[i] == '}') && i + 1 < text.size() && text[i + 1] == text[i]) {
+                i++;
+            }
+        }
+        return out;
+    }
+};
+
+// Format string for TeeStream::print_deferred. Records point at it until they are
+// formatted, so it must be a string literal. Checked at compile time where consteval
+// is available or when passed through TEE_FMT; otherwise a bad format string is
+// reported in the output.
+template<typename... Args>
+class TeeDeferredFormat {
+public:
+    const char* text;
+
+    template<size_t N>
+    TEESTREAM_CONSTEVAL TeeDeferredFormat(const char (&format)[N]) : text(format) {
+#if defined(__cpp_consteval)
+        TeeFormatString<Args...> checked(format);
+        (void)checked;
+#endif
+    }
+
+    template<typename Format, std::enable_if_t<is_tee_format_literal<Format>, int> = 0>
+    constexpr TeeDeferredFormat(Format)
+        : text((void(tee_format_parsed<Format, Args...>), Format::value().data())) {}
+};
+
+// What deferred records with one list of argument types share
+struct TeeDeferredArgs {
+    void (*format)(const char* text, const char* payload, std::string& out);
+    const char* signature;      // One code per argument in Python struct style, e.g. "iqd?s"
+};
+
+// Deferred records as stored in a thread buffer: this header, then the raw arguments.
+// Strings are stored as a 32-bit length and their bytes; everything else as its bytes.
+struct TeeDeferredHeader {
+    const TeeDeferredArgs* args;
+    const char* text;
+    size_t payload_size;
+};
+
+// Encoding of print_deferred arguments and their formatting on the way out
+struct TeeDeferredCodec {
+    template<typename T>
+    static constexpr bool is_string = TeeFormatString<>::kind<T>() == 's';
+
+    // Type an argument is read back as
+    template<typename T>
+    using Stored = std::conditional_t<is_string<T>, std::string_view, T>;
+
+    template<typename T>
+    static size_t size(const T& value) {
+        if constexpr (is_string<T>) {
+            return sizeof(uint32_t) + std::string_view(value).size();
+        } else {
+            return sizeof(T);
+        }
+    }
+
+    template<typename T>
+    static char* encode(char* out, const T& value) {
+        if constexpr (is_string<T>) {
+            std::string_view s(value);
+            uint32_t length = static_cast<uint32_t>(s.size());
+            std::memcpy(out, &length, sizeof(length));
+            if (length > 0) {
+                std::memcpy(out + sizeof(length), s.data(), length);
+            }
+            return out + sizeof(length) + length;
+        } else {
+            std::memcpy(out, &value, sizeof(T));
+            return out + sizeof(T);
+        }
+    }
+
+    template<typename T>
+    static Stored<T> decode(const char*& in) {
+        if constexpr (is_string<T>) {
+            uint32_t length;
+            std::memcpy(&length, in, sizeof(length));
+            std::string_view s(in + sizeof(length), length);
+            in += sizeof(length) + length;
+            return s;
+        } else {
+            T value;
+            std::memcpy(&value, in, sizeof(T));
+            in += sizeof(T);
+            return value;
+        }
+    }
+
+    // Format one record's payload and append it to `out`
+    template<typename... Args>
+    static void format(const char* text, const char* payload, std::string& out) {
+        format_values(TeeFormatString<Args...>(TeeFormatRuntime(), text), payload, out,
+                      std::index_sequence_for<Args...>());
+    }
+
+    // Signature code of an argument type: ? bool, c char, s string, b h i q signed and
+    // B H I Q unsigned integers of 1, 2, 4 and 8 bytes, f d g float, double, long double
+    template<typename T>
+    static constexpr char code() {
+        if constexpr (std::is_same_v<T, bool>) {
+            return '?';
+        } else if constexpr (std::is_same_v<T, char>) {
+            return 'c';
+        } else if constexpr (is_string<T>) {
+            return 's';
+        } else if constexpr (std::is_floating_point_v<T>) {
+            return sizeof(T) == sizeof(float) ? 'f' : sizeof(T) == sizeof(double) ? 'd' : 'g';
+        } else {
+            constexpr char codes[] = "bhiqBHIQ";
+            constexpr size_t size_index = sizeof(T) == 1 ? 0 : sizeof(T) == 2 ? 1 : sizeof(T) == 4 ? 2 : 3;
+            return codes[size_index + (std::is_signed_v<T> ? 0 : 4)];
+        }
+    }
+
+    template<typename... Args>
+    static constexpr char signature[] = {code<Args>()..., '\0'};
+
+    template<typename... Args>
+    static constexpr TeeDeferredArgs args = {&format<Args...>, signature<Args...>};
+
+private:
+    template<typename... Args, size_t... I>
+    static void format_values(const TeeFormatString<Args...>& format, const char* payload, std::string& out,
+                              std::index_sequence<I...>) {
+        // Braced initialization reads the arguments in order
+        std::tuple<Stored<Args>...> values{decode<Args>(payload)...};
+        (void)values;
+        ((append_literal(out, format, format.segments[I]), append_value(out, std::get<I>(values), format.segments[I])), ...);
+        append_literal(out, format, format.segments[sizeof...(Args)]);
+    }
+
+    template<typename Format>
+    static void append_literal(std::string& out, const Format& format, const TeeFormatSegment& segment) {
+        size_t used = out.size();
+        out.resize(used + segment.literal_size);
+        char* last = TeeFormatRender::literal(&out[used], format.text.substr(segment.literal_begin, segment.literal_size),
+                                              segment.escaped);
+        out.resize(static_cast<size_t>(last - out.data()));
+    }
+
+    template<typename T>
+    static void append_value(std::string& out, const T& value, const TeeFormatSegment& segment) {
+        size_t used = out.size();
+        out.resize(used + TeeFormatRender::bound(value, segment));
+        char* last = TeeFormatRender::value(&out[used], &out[0] + out.size(), value, segment);
+        out.resize(static_cast<size_t>(last - out.data()));
+    }
+};
+
+class TeeFastWriter;
+class TeeJsonRecord;
+
+// A high-performance thread-safe tee stream, for any character type
+template<typename CharT, typename Traits = std::char_traits<CharT>>
+class basic_TeeStream;
+
+template<>
+class basic_TeeStream<char> : public std::ostream {
 private:
     TeeStreamBuf buffer;
 
 public:
     // Constructor with configurable buffer size and flush threshold
-    explicit TeeStream(size_t buffer_size = 8192, size_t flush_threshold = 6144);
+    explicit basic_TeeStream(size_t buffer_size = 8192, size_t flush_threshold = 6144);
     
     // Constructor that takes a list of streams to write to
     template<typename... Streams>
-    explicit TeeStream(Streams&... streams) : std::ostream(&buffer) {
+    explicit basic_TeeStream(Streams&... streams) : std::ostream(&buffer) {
         (add_stream(streams), ...);
     }
 
     // Stream management
-    void add_stream(std::ostream& stream);
+    SinkHandle add_stream(std::ostream& stream, SinkFormat format = SinkFormat::Text);
+    SinkHandle add_stream(std::ostream& stream, const SinkOptions& options);
     void remove_stream(std::ostream& stream);
     
     // Manually flush the thread-local buffer
     void flush_thread_buffer();
+
+    // Metadata for the calling thread's next writes, for stream filters
+    void begin_record(int level, const char* tag = nullptr);
+
+    // Severity levels (see TEE_LOG)
+    void set_level(LogLevel level);
+    LogLevel get_level() const;
+    bool is_level_enabled(LogLevel level) const { return buffer.is_level_enabled(level); }
+    bool has_enabled_streams() const { return buffer.has_enabled_streams(); }
+
+    // Pre-allocate pooled buffers for `thread_count` threads before traffic starts
+    void warm_up(size_t thread_count);
+
+    // Zero-copy writes into the calling thread's buffer
+    char* reserve(size_t n);
+    void commit(size_t n);
+
+    // Writes that hand the caller's buffer to the streams instead of copying it
+    void write_borrowed(const char* data, size_t size, std::function<void()> on_release);
+    void write_borrowed(std::string&& data);
+    void write_borrowed(std::vector<char>&& data);
+
+    // Record-atomic mode
+    void set_record_atomic(bool enabled);
+    bool is_record_atomic() const;
+    void end_record();
+
+    // Adaptive buffer sizing
+    void enable_adaptive_sizing(const AdaptiveSizingPolicy& policy = AdaptiveSizingPolicy());
+    void disable_adaptive_sizing();
+    bool is_adaptive_sizing() const;
+    std::vector<ThreadBufferStats> thread_buffer_stats() const;
+
+    // Async mode
+    void enable_async(size_t queue_capacity = 1024 * 1024);
+    void disable_async();
+    bool is_async() const;
+    bool backpressured() const;
+    bool notify_when_writable(std::function<void()> callback);
+    bool notify_when_drained(std::function<void()> callback);
+    bool try_write(const char* s, std::streamsize n);
+    bool try_write_shared(const char* s, std::streamsize n);
+    bool try_flush_shared();
+    void drain();
+    void set_wakeup_mode(WakeupMode mode, unsigned spin_iterations = 4000);
+    WakeupMode get_wakeup_mode() const;
+
+    // Bytes dropped because the memory budget was reached (BudgetPolicy::Drop)
+    uint64_t dropped_bytes() const;
+
+    // Timestamp prefix on every line
+    void enable_timestamps(const TimestampOptions& options = TimestampOptions());
+    void disable_timestamps();
+    bool has_timestamps() const;
+
+    // Fast insertion: numbers are formatted with std::to_chars straight into the thread buffer
+    TeeFastWriter fast();
+
+    // Format-string output rendered straight into the thread buffer, e.g. print("{} took {}us", name, us).
+    // Always the bundled formatter, so this class is the same in C++17 and C++20 code. The format
+    // string is checked at compile time: a plain string literal needs C++20, TEE_FMT works in C++17.
+    template<typename... Args>
+    void print(TeeFormatString<TeeFormatArg<Args>...> format,
+               const Args&... args);
+    template<typename Format, typename... Args, std::enable_if_t<is_tee_format_literal<Format>, int> = 0>
+    void print(Format format, const Args&... args);
+
+    // Structured output: one JSON object per line, built field by field in the thread buffer
+    TeeJsonRecord record();
+
+    // Deferred print: copies the raw arguments and a pointer to the format string into the
+    // thread buffer and formats them when the buffer is flushed, on the background writers
+    // in async mode. `format` must be a string literal.
+    template<typename... Args>
+    void print_deferred(TeeDeferredFormat<TeeFormatArg<Args>...> format, const Args&... args);
+};
+
+using TeeStream = basic_TeeStream<char>;
+
+// Tee stream for wide and UTF-8 text, with the char stream's buffering and async mode.
+// The formatting extensions (fast(), print(), record(), ...) are char only.
+template<typename CharT, typename Traits>
+class basic_TeeStream : public std::basic_ostream<CharT, Traits> {
+private:
+    basic_TeeStreamBuf<CharT, Traits> buffer;
+
+public:
+    using stream_type = std::basic_ostream<CharT, Traits>;
+
+    // Constructor with configurable buffer size and flush threshold, in characters
+    explicit basic_TeeStream(size_t buffer_size = 8192, size_t flush_threshold = 6144)
+        : stream_type(&buffer), buffer(buffer_size, flush_threshold) {}
+
+    // Constructor that takes a list of streams to write to
+    template<typename... Streams>
+    explicit basic_TeeStream(Streams&... streams) : stream_type(&buffer) {
+        (add_stream(streams), ...);
+    }
+
+    // Stream management
+    void add_stream(stream_type& stream) { buffer.add_stream(stream); }
+    void remove_stream(stream_type& stream) { buffer.remove_stream(stream); }
+
+    // Manually flush the thread-local buffer
+    void flush_thread_buffer() { buffer.flush_thread_buffer(); }
+    void warm_up(size_t thread_count) { buffer.warm_up(thread_count); }
+
+    // Adaptive buffer sizing
+    void enable_adaptive_sizing(const AdaptiveSizingPolicy& policy = AdaptiveSizingPolicy()) {
+        buffer.enable_adaptive_sizing(policy);
+    }
+    void disable_adaptive_sizing() { buffer.disable_adaptive_sizing(); }
+    bool is_adaptive_sizing() const { return buffer.is_adaptive_sizing(); }
+    std::vector<ThreadBufferStats> thread_buffer_stats() const { return buffer.thread_buffer_stats(); }
+
+    // Async mode
+    void enable_async(size_t queue_capacity = 1024 * 1024) { buffer.enable_async(queue_capacity); }
+    void disable_async() { buffer.disable_async(); }
+    bool is_async() const { return buffer.is_async(); }
+    void drain() { buffer.drain(); }
+
+    // Bytes dropped because the memory budget was reached (BudgetPolicy::Drop)
+    uint64_t dropped_bytes() const { return buffer.dropped_bytes(); }
+};
+
+using WTeeStreamBuf = basic_TeeStreamBuf<wchar_t>;
+using WTeeStream = basic_TeeStream<wchar_t>;
+
+// Instantiated in the library. The char8_t ones are too when it is built as C++20;
+// otherwise code using them instantiates them from this header.
+extern template class basic_TeeStreamBuf<wchar_t>;
+extern template class basic_TeeStream<wchar_t>;
+
+#if defined(__cpp_char8_t)
+using U8TeeStreamBuf = basic_TeeStreamBuf<char8_t>;
+using U8TeeStream = basic_TeeStream<char8_t>;
+#endif
+
+// Inserter returned by TeeStream::fast(). Formats numbers with std::to_chars directly
+// into the calling thread's buffer, skipping sentries, locale facets and num_put.
+// Output matches the classic locale under the stream's base, floatfield and precision;
+// any other formatting state (width, showbase, showpos, boolalpha, ...) falls back to
+// the regular operator<<.
+class TeeFastWriter {
+private:
+    TeeStream& tee;
+    bool muted;  // No stream is enabled, so numbers are not formatted at all
+
+    // Largest number the fast path formats in place; longer output takes the regular path
+    static constexpr size_t kMaxNumberSize = 128;
+
+    // Flags the fast path cannot reproduce
+    static constexpr std::ios_base::fmtflags kSlowFlags =
+        std::ios_base::showbase | std::ios_base::showpos | std::ios_base::showpoint |
+        std::ios_base::uppercase | std::ios_base::boolalpha;
+
+    bool plain() const {
+        return tee.width() == 0 && (tee.flags() & kSlowFlags) == 0;
+    }
+
+    template<typename T>
+    void write_integer(T value) {
+        int base = 10;
+        switch (tee.flags() & std::ios_base::basefield) {
+            case std::ios_base::hex: base = 16; break;
+            case std::ios_base::oct: base = 8; break;
+            default: break;
+        }
+
+        char* out = tee.reserve(kMaxNumberSize);
+        if (!out) {
+            tee << value;
+            return;
+        }
+
+        // Like num_put, other bases print the unsigned representation
+        std::to_chars_result result = base == 10
+            ? std::to_chars(out, out + kMaxNumberSize, value)
+            : std::to_chars(out, out + kMaxNumberSize, static_cast<std::make_unsigned_t<T>>(value), base);
+        tee.commit(static_cast<size_t>(result.ptr - out));
+    }
+
+    template<typename T>
+    void write_floating(T value) {
+        std::ios_base::fmtflags floatfield = tee.flags() & std::ios_base::floatfield;
+        int precision = static_cast<int>(tee.precision());
+        char* out = floatfield == (std::ios_base::fixed | std::ios_base::scientific)
+            ? nullptr : tee.reserve(kMaxNumberSize);
+        if (out) {
+            std::chars_format format = floatfield == std::ios_base::fixed ? std::chars_format::fixed
+                : floatfield == std::ios_base::scientific ? std::chars_format::scientific
+                : std::chars_format::general;
+            std::to_chars_result result = std::to_chars(out, out + kMaxNumberSize, value, format, precision);
+            if (result.ec == std::errc()) {
+                tee.commit(static_cast<size_t>(result.ptr - out));
+                return;
+            }
+            tee.commit(0);
+        }
+        tee << value;
+    }
+
+    void write_chars(const char* s, size_t n) {
+        tee.rdbuf()->sputn(s, static_cast<std::streamsize>(n));
+    }
+
+public:
+    explicit TeeFastWriter(TeeStream& tee) : tee(tee), muted(!tee.has_enabled_streams()) {}
+
+    template<typename T, std::enable_if_t<std::is_integral_v<T> && !std::is_same_v<T, bool> &&
+                                          !std::is_same_v<T, char> && !std::is_same_v<T, signed char> &&
+                                          !std::is_same_v<T, unsigned char>, int> = 0>
+    TeeFastWriter& operator<<(T value) {
+        if (muted) {
+            tee.width(0);
+        } else if (plain()) {
+            write_integer(value);
+        } else {
+            tee << value;
+        }
+        return *this;
+    }
+
+    template<typename T, std::enable_if_t<std::is_floating_point_v<T>, int> = 0>
+    TeeFastWriter& operator<<(T value) {
+        if (muted) {
+            tee.width(0);
+        } else if (plain()) {
+            write_floating(value);
+        } else {
+            tee << value;
+        }
+        return *this;
+    }
+
+    TeeFastWriter& operator<<(bool value) {
+        if (plain()) {
+            write_chars(value ? "1" : "0", 1);
+        } else {
+            tee << value;
+        }
+        return *this;
+    }
+
+    TeeFastWriter& operator<<(char c) {
+        if (tee.width() == 0) {
+            write_chars(&c, 1);
+        } else {
+            tee << c;
+        }
+        return *this;
+    }
+
+    // Like the tee's operator<<, signed and unsigned chars are written as characters
+    TeeFastWriter& operator<<(signed char c) {
+        if (tee.width() == 0) {
+            write_chars(reinterpret_cast<const char*>(&c), 1);
+        } else {
+            tee << c;
+        }
+        return *this;
+    }
+
+    TeeFastWriter& operator<<(unsigned char c) {
+        if (tee.width() == 0) {
+            write_chars(reinterpret_cast<const char*>(&c), 1);
+        } else {
+            tee << c;
+        }
+        return *this;
+    }
+
+    TeeFastWriter& operator<<(std::string_view s) {
+        if (tee.width() == 0) {
+            write_chars(s.data(), s.size());
+        } else {
+            tee << s;
+        }
+        return *this;
+    }
+
+    TeeFastWriter& operator<<(const char* s) {
+        return *this << std::string_view(s);
+    }
+
+    TeeFastWriter& operator<<(const std::string& s) {
+        return *this << std::string_view(s);
+    }
+
+    // Anything else, such as std::setprecision or user types, goes through the tee's operator<<
+    template<typename T, std::enable_if_t<!std::is_arithmetic_v<T> &&
+                                          !std::is_convertible_v<const T&, std::string_view>, int> = 0>
+    TeeFastWriter& operator<<(const T& value) {
+        tee << value;
+        return *this;
+    }
+
+    // Manipulators such as std::endl and std::hex apply to the tee
+    TeeFastWriter& operator<<(std::ostream& (*manip)(std::ostream&)) {
+        manip(tee);
+        return *this;
+    }
+
+    TeeFastWriter& operator<<(std::ios_base& (*manip)(std::ios_base&)) {
+        manip(tee);
+        return *this;
+    }
+};
+
+inline TeeFastWriter TeeStream::fast() {
+    return TeeFastWriter(*this);
+}
+
+// Output cursor for TeeStream::print. Renders into space reserved in the calling
+// thread's buffer and commits it once; if the memory budget refuses the space it
+// writes through a small scratch array instead.
+class TeePrintWriter {
+private:
+    TeeStream& tee;
+    char* start = nullptr;
+    char* pos = nullptr;
+    char* end = nullptr;
+    bool reserved = false;
+    char scratch[256];
+    std::string spill;          // Scratch for single values larger than `scratch`
+
+public:
+    TeePrintWriter(TeeStream& tee, size_t estimate) : tee(tee) {
+        need(estimate);
+    }
+
+    ~TeePrintWriter() {
+        finish();
+    }
+
+    // Hand over what has been rendered so far
+    void finish() {
+        if (reserved) {
+            tee.commit(static_cast<size_t>(pos - start));
+        } else if (pos != start) {
+            tee.write(start, pos - start);
+        }
+        start = pos = end = nullptr;
+        reserved = false;
+    }
+
+    // Space for at least `n` more bytes
+    char* need(size_t n) {
+        if (static_cast<size_t>(end - pos) >= n) {
+            return pos;
+        }
+        finish();
+        start = tee.reserve(n);
+        reserved = start != nullptr;
+        if (!reserved) {
+            if (n > sizeof(scratch)) {
+                spill.resize(n);
+                start = &spill[0];
+            } else {
+                start = scratch;
+                n = sizeof(scratch);
+            }
+        }
+        pos = start;
+        end = start + n;
+        return pos;
+    }
+
+    void advance(char* to) {
+        pos = to;
+    }
+
+    void append(const char* data, size_t size) {
+        pos = TeeFormatRender::literal(need(size), std::string_view(data, size), false);
+    }
+
+    void literal(std::string_view text, bool escaped) {
+        pos = TeeFormatRender::literal(need(text.size()), text, escaped);
+    }
+
+    template<typename T>
+    void value(const T& value, const TeeFormatSegment& segment) {
+        pos = TeeFormatRender::value(need(TeeFormatRender::bound(value, segment)), end, value, segment);
+    }
+};
+
+template<typename... Args>
+void TeeStream::print(TeeFormatString<TeeFormatArg<Args>...> format,
+                      const Args&... args) {
+    static_assert(((TeeFormatString<>::kind<TeeFormatArg<Args>>() != 0) && ...),
+                  "TeeStream::print supports arithmetic, char and string arguments");
+    if (!has_enabled_streams()) {
+        return;
+    }
+
+    // Size the reservation so the whole line is normally rendered in one piece
+    size_t estimate = format.segments[sizeof...(Args)].literal_size;
+    size_t index = 0;
+    ((estimate += format.segments[index].literal_size +
+                  TeeFormatRender::bound<TeeFormatArg<Args>>(args, format.segments[index]), index++), ...);
+
+    TeePrintWriter writer(*this, estimate);
+    index = 0;
+    ((writer.literal(format.text.substr(format.segments[index].literal_begin, format.segments[index].literal_size),
+                     format.segments[index].escaped),
+      writer.value<TeeFormatArg<Args>>(args, format.segments[index]), index++), ...);
+    const TeeFormatSegment& tail = format.segments[sizeof...(Args)];
+    writer.literal(format.text.substr(tail.literal_begin, tail.literal_size), tail.escaped);
+}
+
+template<typename Format, typename... Args, std::enable_if_t<is_tee_format_literal<Format>, int>>
+void TeeStream::print(Format, const Args&... args) {
+    print<Args...>(tee_format_parsed<Format, TeeFormatArg<Args>...>, args...);
+}
+
+// Builder returned by TeeStream::record(). Writes one JSON object per line straight into
+// the thread buffer, e.g. tee.record().field("event", "login").field("user", id);
+// the line is finished when the builder is destroyed. Strings are scanned for characters
+// that need escaping with SSE2/AVX2 where available. Nothing else may be written to the
+// tee from the same thread while a record is open.
+class TeeJsonRecord {
+private:
+    TeePrintWriter writer;
+    bool first = true;
+    bool muted;  // No stream is enabled, so fields are not rendered
+
+    void key(std::string_view name);
+    void string(std::string_view value);
+
+public:
+    explicit TeeJsonRecord(TeeStream& tee);
+    ~TeeJsonRecord();
+    TeeJsonRecord(const TeeJsonRecord&) = delete;
+    TeeJsonRecord& operator=(const TeeJsonRecord&) = delete;
+
+    TeeJsonRecord& field(std::string_view name, std::string_view value);
+    TeeJsonRecord& field(std::string_view name, const char* value);   // null writes null
+    TeeJsonRecord& field(std::string_view name, char value);
+    TeeJsonRecord& field(std::string_view name, bool value);
+    TeeJsonRecord& field(std::string_view name, std::nullptr_t);
+
+    template<typename T, std::enable_if_t<std::is_integral_v<T> && !std::is_same_v<T, bool> &&
+                                          !std::is_same_v<T, char>, int> = 0>
+    TeeJsonRecord& field(std::string_view name, T value) {
+        if (muted) {
+            return *this;
+        }
+        key(name);
+        char* out = writer.need(std::numeric_limits<T>::digits10 + 3);
+        writer.advance(std::to_chars(out, out + std::numeric_limits<T>::digits10 + 3, value).ptr);
+        return *this;
+    }
+
+    // JSON has no infinities or NaN, so they are written as null
+    template<typename T, std::enable_if_t<std::is_floating_point_v<T>, int> = 0>
+    TeeJsonRecord& field(std::string_view name, T value) {
+        if (muted) {
+            return *this;
+        }
+        if (!std::isfinite(value)) {
+            return field(name, nullptr);
+        }
+        key(name);
+        char* out = writer.need(64);
+        writer.advance(std::to_chars(out, out + 64, value).ptr);
+        return *this;
+    }
+
+    // Length of the leading part of `s` that needs no escaping
+    static size_t plain_length(const char* s, size_t n);
 };
+
+inline TeeJsonRecord TeeStream::record() {
+    return TeeJsonRecord(*this);
+}
+
+template<typename... Args>
+void TeeStream::print_deferred(TeeDeferredFormat<TeeFormatArg<Args>...> format, const Args&... args) {
+    static_assert(((TeeFormatString<>::kind<TeeFormatArg<Args>>() != 0) && ...),
+                  "TeeStream::print_deferred supports arithmetic, char and string arguments");
+    if (!has_enabled_streams()) {
+        return;
+    }
+
+    TeeDeferredHeader header{&TeeDeferredCodec::args<TeeFormatArg<Args>...>, format.text, 0};
+    header.payload_size = (size_t(0) + ... + TeeDeferredCodec::size<TeeFormatArg<Args>>(args));
+    size_t size = sizeof(header) + header.payload_size;
+
+    char* out = buffer.reserve_deferred(size);
+    std::string record;
+    if (!out) {
+        // Over the memory budget: the record is formatted right away and written through
+        record.resize(size);
+        out = &record[0];
+    }
+
+    std::memcpy(out, &header, sizeof(header));
+    char* payload = out + sizeof(header);
+    ((payload = TeeDeferredCodec::encode<TeeFormatArg<Args>>(payload, args)), ...);
+    (void)payload;
+
+    if (record.empty()) {
+        buffer.commit_deferred(size);
+        return;
+    }
+    std::string text;
+    TeeStreamBuf::format_deferred(record.data(), record.size(), text);
+    write(text.data(), static_cast<std::streamsize>(text.size()));
+}
+
+// One leveled statement (see TEE_LOG). What it writes is a record at its level, and what
+// the thread writes after it is back at level 0.
+class TeeLogStatement {
+private:
+    TeeStream& tee;
+
+public:
+    TeeLogStatement(TeeStream& tee, LogLevel level, const char* tag = nullptr) : tee(tee) {
+        tee.begin_record(static_cast<int>(level), tag);
+    }
+    ~TeeLogStatement() {
+        tee.begin_record(0);
+    }
+    TeeLogStatement(const TeeLogStatement&) = delete;
+    TeeLogStatement& operator=(const TeeLogStatement&) = delete;
+
+    TeeStream& stream() { return tee; }
+};
+
+// Leveled statement: TEE_LOG(tee, LogLevel::Warn) << "disk " << percent << "% full\n";
+// Unless the level is enabled, nothing is buffered and the arguments are not evaluated.
+#define TEE_LOG_TAG(tee, level, tag) \
+    if (static_cast<int>(level) < TEESTREAM_MIN_LEVEL || !(tee).is_level_enabled(level)) {} \
+    else TeeLogStatement((tee), (level), (tag)).stream()
+
+#define TEE_LOG(tee, level) TEE_LOG_TAG(tee, level, nullptr)
+
+// Token bucket for one call site and thread (see TEE_LOG_RATE). Once a statement gets
+// through after others were suppressed, "suppressed N records" is written before it.
+class TeeRateLimiter {
+private:
+    double per_second;
+    double burst;
+    double tokens;
+    std::chrono::steady_clock::time_point refilled;
+    uint64_t suppressed;
+
+public:
+    // A burst below one record would never let one through, so it holds at least one
+    explicit TeeRateLimiter(double per_second, double burst = 0)
+        : per_second(per_second), burst(std::max(burst > 0 ? burst : per_second, 1.0)), tokens(this->burst),
+          refilled(std::chrono::steady_clock::now()), suppressed(0) {}
+
+    bool admit(TeeStream& tee, LogLevel level) {
+        // No limit if `per_second` is 0, as for RateLimit
+        if (per_second <= 0) {
+            return true;
+        }
+        auto now = std::chrono::steady_clock::now();
+        tokens = std::min(burst, tokens + std::chrono::duration<double>(now - refilled).count() * per_second);
+        refilled = now;
+        if (tokens < 1) {
+            suppressed++;
+            return false;
+        }
+        tokens -= 1;
+        if (suppressed > 0) {
+            TeeLogStatement(tee, level).stream() << "suppressed " << suppressed << " records\n";
+            suppressed = 0;
+        }
+        return true;
+    }
+};
+
+// Deterministic 1-in-N sampling for one call site and thread (see TEE_LOG_EVERY_N)
+class TeeSampler {
+private:
+    uint64_t every;
+    uint64_t count;
+
+public:
+    explicit TeeSampler(uint64_t every) : every(every > 0 ? every : 1), count(0) {}
+
+    bool admit() { return count++ % every == 0; }
+};
+
+// Leveled statements written at most `per_second` times a second, or once every `n`
+// times, by each thread. The limiter's state is per thread, so threads never contend on it.
+#define TEE_LOG_RATE(tee, level, per_second) \
+    if (static_cast<int>(level) < TEESTREAM_MIN_LEVEL || !(tee).is_level_enabled(level)) {} \
+    else if (static thread_local TeeRateLimiter tee_rate_limiter(per_second); \
+             !tee_rate_limiter.admit((tee), (level))) {} \
+    else TeeLogStatement((tee), (level)).stream()
+
+#define TEE_LOG_EVERY_N(tee, level, n) \
+    if (static_cast<int>(level) < TEESTREAM_MIN_LEVEL || !(tee).is_level_enabled(level)) {} \
+    else if (static thread_local TeeSampler tee_sampler(n); !tee_sampler.admit()) {} \
+    else TeeLogStatement((tee), (level)).stream()
+
+// One macro per level. Below TEESTREAM_MIN_LEVEL they are still type-checked, but
+// generate no code.
+#define TEESTREAM_DISABLED_LOG(tee) if (true) {} else (tee)
+
+#if TEESTREAM_MIN_LEVEL <= 0
+#define TEE_TRACE(tee) TEE_LOG(tee, LogLevel::Trace)
+#else
+#define TEE_TRACE(tee) TEESTREAM_DISABLED_LOG(tee)
+#endif
+
+#if TEESTREAM_MIN_LEVEL <= 1
+#define TEE_DEBUG(tee) TEE_LOG(tee, LogLevel::Debug)
+#else
+#define TEE_DEBUG(tee) TEESTREAM_DISABLED_LOG(tee)
+#endif
+
+#if TEESTREAM_MIN_LEVEL <= 2
+#define TEE_INFO(tee) TEE_LOG(tee, LogLevel::Info)
+#else
+#define TEE_INFO(tee) TEESTREAM_DISABLED_LOG(tee)
+#endif
+
+#if TEESTREAM_MIN_LEVEL <= 3
+#define TEE_WARN(tee) TEE_LOG(tee, LogLevel::Warn)
+#else
+#define TEE_WARN(tee) TEESTREAM_DISABLED_LOG(tee)
+#endif
+
+#if TEESTREAM_MIN_LEVEL <= 4
+#define TEE_ERROR(tee) TEE_LOG(tee, LogLevel::Error)
+#else
+#define TEE_ERROR(tee) TEESTREAM_DISABLED_LOG(tee)
+#endif
+
+#if TEESTREAM_MIN_LEVEL <= 5
+#define TEE_FATAL(tee) TEE_LOG(tee, LogLevel::Fatal)
+#else
+#define TEE_FATAL(tee) TEESTREAM_DISABLED_LOG(tee)
+#endif
@@ -0,0 +1,152 @@
+#pragma once
+
+// C++20 coroutine front end for TeeStream. The core library stays on C++17;
+// only code including this header needs C++20 (link the teestream_coro target).
+
+#include "TeeStream.h"
+
+#include <coroutine>
+#include <span>
+#include <utility>
+
+// Awaitable returned by AsyncTeeStream::async_write().
+// Buffers the data in the tee's shared buffer, not the thread's, so nothing is left behind
+// on a thread the coroutine moves away from. Completes without suspending unless that needs
+// a flush while a stream queue is full, or memory the budget has no room for. A suspended
+// coroutine is resumed through `executor`, never on a TeeStream writer thread, once the data
+// has been written there.
+template<typename Executor>
+class TeeWriteAwaiter {
+private:
+    TeeStream& tee;
+    std::span<const char> data;
+    Executor executor;
+
+    bool try_write() {
+        return tee.try_write_shared(data.data(), static_cast<std::streamsize>(data.size()));
+    }
+
+    // Runs on the executor once no queue is full; another writer may have filled one again
+    void retry(std::coroutine_handle<> handle) {
+        if (try_write() || !await_suspend(handle)) {
+            handle.resume();
+        }
+    }
+
+public:
+    TeeWriteAwaiter(TeeStream& tee, std::span<const char> data, Executor executor)
+        : tee(tee), data(data), executor(std::move(executor)) {}
+
+    bool await_ready() {
+        return try_write();
+    }
+
+    bool await_suspend(std::coroutine_handle<> handle) {
+        // If the queues drained meanwhile the write is retried here, and on success
+        // returning false resumes the coroutine right away
+        auto resume = [this, handle]() {
+            executor.execute([this, handle]() { retry(handle); });
+        };
+        while (!tee.notify_when_writable(resume)) {
+            if (try_write()) {
+                return false;
+            }
+
+            // No queue is full, so the memory budget had no room. Writers free memory as
+            // they write what is queued; with nothing queued none will be freed, and the
+            // data is written here as a blocking write would
+            if (tee.notify_when_drained(resume)) {
+                return true;
+            }
+            tee.flush();
+            tee.write(data.data(), static_cast<std::streamsize>(data.size()));
+            tee.flush_thread_buffer();
+            return false;
+        }
+        return true;
+    }
+
+    void await_resume() {}
+};
+
+// Awaitable returned by AsyncTeeStream::async_flush().
+// Completes once every stream has written and synced what was queued before it.
+template<typename Executor>
+class TeeFlushAwaiter {
+private:
+    TeeStream& tee;
+    Executor executor;
+
+public:
+    TeeFlushAwaiter(TeeStream& tee, Executor executor)
+        : tee(tee), executor(std::move(executor)) {}
+
+    bool await_ready() {
+        return false;
+    }
+
+    bool await_suspend(std::coroutine_handle<> handle) {
+        // Over the memory budget the flush is tried again once what is queued is written;
+        // with nothing queued it is a blocking flush, which writes through
+        if (!tee.try_flush_shared()) {
+            if (tee.notify_when_drained([this, handle]() {
+                executor.execute([this, handle]() {
+                    if (!await_suspend(handle)) {
+                        handle.resume();
+                    }
+                });
+            })) {
+                return true;
+            }
+            tee.flush();
+        }
+        return tee.notify_when_drained([executor = executor, handle]() mutable {
+            executor.execute([handle]() { handle.resume(); });
+        });
+    }
+
+    void await_resume() {}
+};
+
+// A TeeStream in async mode with coroutine writes.
+// Executor is any type with `execute(f)`, such as an Asio executor.
+template<typename Executor>
+class AsyncTeeStream : public TeeStream {
+private:
+    Executor executor;
+
+public:
+    // Constructor with the executor coroutines resume on, the per-stream queue capacity,
+    // and the usual buffer size and flush threshold
+    explicit AsyncTeeStream(Executor executor, size_t queue_capacity = 1024 * 1024,
+                            size_t buffer_size = 8192, size_t flush_threshold = 6144)
+        : TeeStream(buffer_size, flush_threshold), executor(std::move(executor)) {
+        enable_async(queue_capacity);
+    }
+
+    // Write data, suspending only while a stream queue is full
+    TeeWriteAwaiter<Executor> async_write(std::span<const char> data) {
+        return TeeWriteAwaiter<Executor>(*this, data, executor);
+    }
+
+    // Same, resuming on another executor
+    template<typename OtherExecutor>
+    TeeWriteAwaiter<OtherExecutor> async_write(std::span<const char> data, OtherExecutor other) {
+        return TeeWriteAwaiter<OtherExecutor>(*this, data, std::move(other));
+    }
+
+    // Flush what coroutines have written and wait until every stream has written it
+    TeeFlushAwaiter<Executor> async_flush() {
+        return TeeFlushAwaiter<Executor>(*this, executor);
+    }
+
+    // Same, resuming on another executor
+    template<typename OtherExecutor>
+    TeeFlushAwaiter<OtherExecutor> async_flush(OtherExecutor other) {
+        return TeeFlushAwaiter<OtherExecutor>(*this, std::move(other));
+    }
+
+    const Executor& get_executor() const {
+        return executor;
+    }
+};
@@ -1,86 +1,2987 @@
 #include "TeeStream.h"
+#include <climits>
 #include <cstring>
+#include <ctime>
+#include <future>
+
+#if defined(__linux__)
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+namespace {
+
+// Tell the CPU we are spinning
+inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    _mm_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#else
+    std::this_thread::yield();
+#endif
+}
+
+#if defined(__linux__)
+// Sleep while *addr == expected
+inline void futex_wait(std::atomic<uint32_t>* addr, uint32_t expected) {
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(addr), FUTEX_WAIT_PRIVATE, expected, nullptr, nullptr, 0);
+}
+
+// Wake every thread sleeping on addr
+inline void futex_wake(std::atomic<uint32_t>* addr) {
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(addr), FUTEX_WAKE_PRIVATE, INT_MAX, nullptr, nullptr, 0);
+}
+#endif
+
+// Buffer pool size classes are powers of two from 256 bytes to 64 MiB
+constexpr size_t kMinPoolClassShift = 8;
+constexpr size_t kPoolClasses = 19;
+constexpr size_t kPoolSlotsPerClass = 256;
+
+// Blocks of at least a huge page are mapped directly, aligned to a huge page
+constexpr size_t kHugePageSize = 2 * 1024 * 1024;
+constexpr size_t kHugePageClass = 21 - kMinPoolClassShift;
+constexpr size_t kPageSize = 4096;
+
+// Under the Shrink budget policy thread buffers get no smaller than this
+constexpr size_t kMinShrunkBufferSize = 1024;
+
+// Pool state. Constant-initialized and trivially destructible, so it is usable
+// from static and thread-local destructors; whatever is pooled at exit is left to the OS.
+struct PoolState {
+    std::atomic<char*> slots[kPoolClasses][kPoolSlotsPerClass];
+    std::atomic<size_t> class_counts[kPoolClasses];
+    std::atomic<size_t> pooled_bytes{0};
+    std::atomic<size_t> max_bytes{64 * 1024 * 1024};
+    std::atomic<uint64_t> reused{0};
+    std::atomic<uint64_t> allocated{0};
+    std::atomic<bool> huge_pages{false};
+    std::atomic<bool> prefault{false};
+
+    // Memory budget: every allocated block is charged, whether in use or pooled
+    std::atomic<size_t> total_bytes{0};
+    std::atomic<size_t> budget{0};
+    std::atomic<BudgetPolicy> budget_policy{BudgetPolicy::Block};
+    std::atomic<uint64_t> denied{0};
+
+    // Bumped whenever storage is released, for acquisitions waiting on the budget
+    std::atomic<uint64_t> release_epoch{0};
+    std::atomic<size_t> budget_waiters{0};
+};
+
+PoolState pool_state;
+
+// Where acquisitions wait for the budget. Never destroyed, like the pool state.
+struct BudgetWait {
+    std::mutex mutex;
+    std::condition_variable cv;
+};
+
+BudgetWait& budget_wait() {
+    static BudgetWait* wait = new BudgetWait;
+    return *wait;
+}
+
+// Wake acquisitions waiting for memory
+void notify_budget_waiters() {
+    pool_state.release_epoch.fetch_add(1, std::memory_order_seq_cst);
+    if (pool_state.budget_waiters.load(std::memory_order_seq_cst) > 0) {
+        BudgetWait& wait = budget_wait();
+        std::lock_guard<std::mutex> lock(wait.mutex);
+        wait.cv.notify_all();
+    }
+}
+
+// Size class for a request, or kPoolClasses if it is too large to pool
+size_t pool_class(size_t size) {
+    size_t cls = 0;
+    while (cls < kPoolClasses && (size_t(1) << (cls + kMinPoolClassShift)) < size) {
+        ++cls;
+    }
+    return cls;
+}
+
+size_t class_capacity(size_t cls) {
+    return size_t(1) << (cls + kMinPoolClassShift);
+}
+
+// Allocate fresh storage, which is never zeroed: buffers are always written before they are read
+char* allocate_block(size_t capacity) {
+    char* ptr;
+#if defined(__linux__)
+    if (capacity >= kHugePageSize) {
+        // Over-map by one huge page and trim so the block is huge-page aligned
+        size_t length = capacity + kHugePageSize;
+        void* mapping = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mapping == MAP_FAILED) {
+            throw std::bad_alloc();
+        }
+        uintptr_t start = reinterpret_cast<uintptr_t>(mapping);
+        uintptr_t aligned = (start + kHugePageSize - 1) & ~(uintptr_t(kHugePageSize) - 1);
+        if (aligned > start) {
+            munmap(mapping, aligned - start);
+        }
+        if (start + length > aligned + capacity) {
+            munmap(reinterpret_cast<void*>(aligned + capacity), start + length - aligned - capacity);
+        }
+        ptr = reinterpret_cast<char*>(aligned);
+
+        if (pool_state.huge_pages.load(std::memory_order_relaxed)) {
+            madvise(ptr, capacity, MADV_HUGEPAGE);
+        }
+    } else {
+        ptr = static_cast<char*>(::operator new(capacity));
+    }
+#else
+    ptr = static_cast<char*>(::operator new(capacity));
+#endif
+
+    if (pool_state.prefault.load(std::memory_order_relaxed)) {
+        volatile char* pages = ptr;
+        for (size_t offset = 0; offset < capacity; offset += kPageSize) {
+            pages[offset] = 0;
+        }
+    }
+    return ptr;
+}
+
+// Free storage from allocate_block() and give its bytes back to the budget
+void free_block(char* ptr, size_t capacity) {
+#if defined(__linux__)
+    if (capacity >= kHugePageSize) {
+        munmap(ptr, capacity);
+    } else {
+        ::operator delete(ptr);
+    }
+#else
+    ::operator delete(ptr);
+#endif
+    pool_state.total_bytes.fetch_sub(capacity, std::memory_order_seq_cst);
+    notify_budget_waiters();
+}
+
+// Allocate fresh storage if the budget allows it, or return nullptr
+char* allocate_charged(size_t capacity) {
+    size_t budget = pool_state.budget.load(std::memory_order_relaxed);
+    size_t total = pool_state.total_bytes.load(std::memory_order_relaxed);
+    do {
+        if (budget != 0 && total + capacity > budget) {
+            return nullptr;
+        }
+    } while (!pool_state.total_bytes.compare_exchange_weak(total, total + capacity, std::memory_order_seq_cst));
+
+    char* ptr;
+    try {
+        ptr = allocate_block(capacity);
+    } catch (...) {
+        pool_state.total_bytes.fetch_sub(capacity, std::memory_order_seq_cst);
+        throw;
+    }
+    pool_state.allocated.fetch_add(1, std::memory_order_relaxed);
+    return ptr;
+}
+
+// Take a pooled block of class `cls`, or return nullptr
+char* take_pooled(size_t cls) {
+    if (pool_state.class_counts[cls].load(std::memory_order_relaxed) == 0) {
+        return nullptr;
+    }
+    for (auto& slot : pool_state.slots[cls]) {
+        char* ptr = slot.load(std::memory_order_relaxed);
+        if (ptr && slot.compare_exchange_strong(ptr, nullptr, std::memory_order_acquire)) {
+            pool_state.class_counts[cls].fetch_sub(1, std::memory_order_relaxed);
+            pool_state.pooled_bytes.fetch_sub(class_capacity(cls), std::memory_order_relaxed);
+            pool_state.reused.fetch_add(1, std::memory_order_relaxed);
+            return ptr;
+        }
+    }
+    return nullptr;
+}
+
+// Get a block of at least `min_size` bytes, preferring `size`, without waiting.
+// Smaller blocks are only handed out under the Shrink policy.
+BufferPool::Block acquire_within_budget(size_t size, size_t min_size) {
+    size_t cls = pool_class(size);
+    if (cls == kPoolClasses) {
+        // Too large to pool; mapped sizes are rounded to whole huge pages
+        size_t capacity = (size + kHugePageSize - 1) & ~(kHugePageSize - 1);
+        for (int attempt = 0; attempt < 2; ++attempt) {
+            if (char* ptr = allocate_charged(capacity)) {
+                return BufferPool::Block(ptr, capacity);
+            }
+            if (attempt == 0 && pool_state.pooled_bytes.load(std::memory_order_relaxed) == 0) {
+                break;
+            }
+            BufferPool::trim();
+        }
+        return BufferPool::Block();
+    }
+
+    // Half a huge page or more is worth a whole one when huge pages are requested
+    if (cls < kHugePageClass && size >= kHugePageSize / 2 &&
+        pool_state.huge_pages.load(std::memory_order_relaxed)) {
+        cls = kHugePageClass;
+    }
+
+    bool shrink = pool_state.budget_policy.load(std::memory_order_relaxed) == BudgetPolicy::Shrink;
+    for (int attempt = 0; attempt < 2; ++attempt) {
+        for (size_t c = cls + 1; c-- > 0 && (c == cls || class_capacity(c) >= min_size);) {
+            if (char* ptr = take_pooled(c)) {
+                return BufferPool::Block(ptr, class_capacity(c));
+            }
+            if (char* ptr = allocate_charged(class_capacity(c))) {
+                return BufferPool::Block(ptr, class_capacity(c));
+            }
+            if (!shrink) {
+                break;
+            }
+        }
+
+        // Pooled blocks of other sizes count against the budget, so free them and retry
+        if (attempt == 0 && pool_state.pooled_bytes.load(std::memory_order_relaxed) == 0) {
+            break;
+        }
+        BufferPool::trim();
+    }
+    return BufferPool::Block();
+}
+
+// Get `size` bytes, waiting for the memory budget while `worth_waiting` says some
+// storage will be released; an empty block if the policy is Drop or waiting stops
+BufferPool::Block acquire_waiting(size_t size, const std::function<bool()>& worth_waiting) {
+    size_t seen = pool_state.release_epoch.load(std::memory_order_seq_cst);
+    BufferPool::Block block = acquire_within_budget(size, size);
+    if (block.data()) {
+        return block;
+    }
+
+    BudgetWait& wait = budget_wait();
+    pool_state.budget_waiters.fetch_add(1, std::memory_order_seq_cst);
+    for (;;) {
+        // Waiting is pointless if the policy drops, the request could never fit, or
+        // nothing that holds storage is going to release it
+        size_t budget = pool_state.budget.load(std::memory_order_relaxed);
+        if (pool_state.budget_policy.load(std::memory_order_relaxed) == BudgetPolicy::Drop ||
+            (budget != 0 && size > budget) || !worth_waiting()) {
+            break;
+        }
+
+        // Every release bumps the epoch, so `worth_waiting` is asked again after each one
+        {
+            std::unique_lock<std::mutex> lock(wait.mutex);
+            wait.cv.wait(lock, [seen] {
+                return pool_state.release_epoch.load(std::memory_order_seq_cst) != seen;
+            });
+        }
+
+        seen = pool_state.release_epoch.load(std::memory_order_seq_cst);
+        block = acquire_within_budget(size, size);
+        if (block.data()) {
+            break;
+        }
+    }
+    pool_state.budget_waiters.fetch_sub(1, std::memory_order_seq_cst);
+
+    if (!block.data()) {
+        pool_state.denied.fetch_add(1, std::memory_order_relaxed);
+    }
+    return block;
+}
+
+} // namespace
+
+// Get storage for at least `size` bytes, waiting for the memory budget unless the policy is Drop
+BufferPool::Block BufferPool::acquire(size_t size) {
+    return acquire_waiting(size, [] { return true; });
+}
+
+// Get storage without waiting; under the Shrink policy possibly less than `size`
+BufferPool::Block BufferPool::try_acquire(size_t size, size_t min_size) {
+    Block block = acquire_within_budget(size, std::min(size, min_size));
+    if (!block.data()) {
+        pool_state.denied.fetch_add(1, std::memory_order_relaxed);
+    }
+    return block;
+}
+
+// Return storage to the pool, or free it if the pool is full
+void BufferPool::release(char* ptr, size_t capacity) {
+    if (!ptr) {
+        return;
+    }
+
+    size_t cls = pool_class(capacity);
+    if (cls < kPoolClasses && class_capacity(cls) == capacity) {
+        // Reserve room under the limit before publishing the block
+        size_t pooled = pool_state.pooled_bytes.load(std::memory_order_relaxed);
+        do {
+            if (pooled + capacity > pool_state.max_bytes.load(std::memory_order_relaxed)) {
+                free_block(ptr, capacity);
+                return;
+            }
+        } while (!pool_state.pooled_bytes.compare_exchange_weak(pooled, pooled + capacity,
+                                                                std::memory_order_relaxed));
+
+        for (auto& slot : pool_state.slots[cls]) {
+            char* expected = nullptr;
+            if (slot.load(std::memory_order_relaxed) == nullptr &&
+                slot.compare_exchange_strong(expected, ptr, std::memory_order_release)) {
+                pool_state.class_counts[cls].fetch_add(1, std::memory_order_relaxed);
+                notify_budget_waiters();
+                return;
+            }
+        }
+        pool_state.pooled_bytes.fetch_sub(capacity, std::memory_order_relaxed);
+    }
+
+    free_block(ptr, capacity);
+}
+
+// Allocate `count` blocks up front and keep them pooled
+void BufferPool::warm_up(size_t size, size_t count) {
+    // Hold every block at once so each one is distinct, then release them all to the pool
+    std::vector<Block> blocks;
+    blocks.reserve(count);
+    for (size_t i = 0; i < count; ++i) {
+        Block block = try_acquire(size, size);
+        if (!block.data()) {
+            break;
+        }
+        blocks.push_back(std::move(block));
+    }
+}
+
+// Choose how new storage is allocated
+void BufferPool::set_allocation_options(const BufferAllocationOptions& options) {
+    pool_state.huge_pages.store(options.huge_pages, std::memory_order_relaxed);
+    pool_state.prefault.store(options.prefault, std::memory_order_relaxed);
+}
+
+BufferAllocationOptions BufferPool::get_allocation_options() {
+    BufferAllocationOptions options;
+    options.huge_pages = pool_state.huge_pages.load(std::memory_order_relaxed);
+    options.prefault = pool_state.prefault.load(std::memory_order_relaxed);
+    return options;
+}
+
+// Limit how much released storage is kept for reuse
+void BufferPool::set_max_pooled_bytes(size_t max_bytes) {
+    pool_state.max_bytes.store(max_bytes, std::memory_order_relaxed);
+    if (pool_state.pooled_bytes.load(std::memory_order_relaxed) > max_bytes) {
+        trim();
+    }
+}
+
+size_t BufferPool::get_max_pooled_bytes() {
+    return pool_state.max_bytes.load(std::memory_order_relaxed);
+}
+
+// Cap all TeeStream buffer and queue memory, pooled or in use
+void BufferPool::set_memory_budget(size_t max_bytes, BudgetPolicy policy) {
+    pool_state.budget_policy.store(policy, std::memory_order_relaxed);
+    pool_state.budget.store(max_bytes, std::memory_order_relaxed);
+    if (max_bytes != 0 && pool_state.total_bytes.load(std::memory_order_relaxed) > max_bytes) {
+        trim();
+    }
+
+    // Waiters re-check against the new budget and policy
+    notify_budget_waiters();
+}
+
+size_t BufferPool::get_memory_budget() {
+    return pool_state.budget.load(std::memory_order_relaxed);
+}
+
+BudgetPolicy BufferPool::get_budget_policy() {
+    return pool_state.budget_policy.load(std::memory_order_relaxed);
+}
+
+// Bytes allocated by the pool, in use or pooled
+size_t BufferPool::memory_usage() {
+    return pool_state.total_bytes.load(std::memory_order_relaxed);
+}
+
+// Free everything currently pooled
+void BufferPool::trim() {
+    for (size_t cls = 0; cls < kPoolClasses; ++cls) {
+        size_t capacity = class_capacity(cls);
+        for (auto& slot : pool_state.slots[cls]) {
+            char* ptr = slot.exchange(nullptr, std::memory_order_acquire);
+            if (ptr) {
+                pool_state.class_counts[cls].fetch_sub(1, std::memory_order_relaxed);
+                pool_state.pooled_bytes.fetch_sub(capacity, std::memory_order_relaxed);
+                free_block(ptr, capacity);
+            }
+        }
+    }
+}
+
+BufferPoolStats BufferPool::stats() {
+    BufferPoolStats stats;
+    stats.pooled_bytes = pool_state.pooled_bytes.load(std::memory_order_relaxed);
+    stats.pooled_blocks = 0;
+    for (auto& count : pool_state.class_counts) {
+        stats.pooled_blocks += count.load(std::memory_order_relaxed);
+    }
+    stats.total_bytes = pool_state.total_bytes.load(std::memory_order_relaxed);
+    stats.reused = pool_state.reused.load(std::memory_order_relaxed);
+    stats.allocated = pool_state.allocated.load(std::memory_order_relaxed);
+    stats.denied = pool_state.denied.load(std::memory_order_relaxed);
+    return stats;
+}
+
+namespace {
+
+// Calendar part of the last timestamp this thread formatted, "[YYYY-MM-DD HH:MM:SS"
+struct TimestampCache {
+    int64_t second = INT64_MIN;
+    bool utc = false;
+    char text[20];
+};
+
+thread_local TimestampCache timestamp_cache;
+
+// Write `value` as exactly `count` decimal digits
+void put_digits(char* out, unsigned value, int count) {
+    for (int i = count - 1; i >= 0; --i) {
+        out[i] = static_cast<char>('0' + value % 10);
+        value /= 10;
+    }
+}
+
+} // namespace
+
+// Format the current time, reusing the calendar part while the second is unchanged
+size_t TimestampPrefix::format(char* out, const TimestampOptions& options) {
+    int64_t seconds;
+    uint32_t nanos;
+#if defined(__linux__)
+    // Both clocks are read through the vDSO without a syscall
+    timespec now;
+    clock_gettime(options.clock == TimestampClock::Coarse ? CLOCK_REALTIME_COARSE : CLOCK_REALTIME, &now);
+    seconds = now.tv_sec;
+    nanos = static_cast<uint32_t>(now.tv_nsec);
+#else
+    auto since_epoch = std::chrono::system_clock::now().time_since_epoch();
+    auto whole = std::chrono::floor<std::chrono::seconds>(since_epoch);
+    seconds = whole.count();
+    nanos = static_cast<uint32_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(since_epoch - whole).count());
+#endif
+
+    TimestampCache& cache = timestamp_cache;
+    if (cache.second != seconds || cache.utc != options.utc) {
+        time_t time = static_cast<time_t>(seconds);
+        std::tm tm;
+#if defined(_WIN32)
+        options.utc ? gmtime_s(&tm, &time) : localtime_s(&tm, &time);
+#else
+        options.utc ? gmtime_r(&time, &tm) : localtime_r(&time, &tm);
+#endif
+        char* text = cache.text;
+        text[0] = '[';
+        put_digits(text + 1, static_cast<unsigned>(tm.tm_year + 1900), 4);
+        text[5] = '-';
+        put_digits(text + 6, static_cast<unsigned>(tm.tm_mon + 1), 2);
+        text[8] = '-';
+        put_digits(text + 9, static_cast<unsigned>(tm.tm_mday), 2);
+        text[11] = ' ';
+        put_digits(text + 12, static_cast<unsigned>(tm.tm_hour), 2);
+        text[14] = ':';
+        put_digits(text + 15, static_cast<unsigned>(tm.tm_min), 2);
+        text[17] = ':';
+        put_digits(text + 18, static_cast<unsigned>(tm.tm_sec), 2);
+        cache.second = seconds;
+        cache.utc = options.utc;
+    }
+
+    memcpy(out, cache.text, sizeof(cache.text));
+    size_t length = sizeof(cache.text);
+
+    unsigned digits = std::min(options.fraction_digits, 9u);
+    if (digits > 0) {
+        uint32_t fraction = nanos;
+        for (unsigned i = digits; i < 9; ++i) {
+            fraction /= 10;
+        }
+        out[length++] = '.';
+        put_digits(out + length, fraction, static_cast<int>(digits));
+        length += digits;
+    }
+    out[length++] = ']';
+    out[length++] = ' ';
+    return length;
+}
+
+// Per-thread buffers, keyed by the registry of the TeeStreamBuf they belong to
+struct TeeStreamBuf::LocalBuffers {
+    struct Entry {
+        std::shared_ptr<Registry> registry;
+        std::shared_ptr<ThreadBuffer> buffer;
+    };
+
+    // Most threads write to a single tee, so remember the last lookup
+    Registry* last_registry = nullptr;
+    ThreadBuffer* last_buffer = nullptr;
+    std::vector<Entry> entries;
+
+    // Flush whatever the exiting thread still has buffered
+    ~LocalBuffers() {
+        // Flushing into a nested TeeStream may add entries, so drain until empty
+        while (!entries.empty()) {
+            Entry entry = std::move(entries.back());
+            entries.pop_back();
+            last_registry = nullptr;
+            last_buffer = nullptr;
+
+            // The tee's destructor flushes the buffer instead if it has started
+            std::shared_lock<std::shared_mutex> alive(entry.registry->alive);
+            auto owner = entry.registry->owner.load(std::memory_order_acquire);
+            if (owner) {
+                {
+                    std::lock_guard<std::mutex> lock(entry.registry->mutex);
+                    auto& buffers = entry.registry->buffers;
+                    buffers.erase(std::remove(buffers.begin(), buffers.end(), entry.buffer), buffers.end());
+                }
+                owner->flush_range(entry.buffer.get(), entry.buffer->used);
+            }
+        }
+    }
+};
+
+// Advance the epoch, waking the writer only if it is parked
+void TeeStreamBuf::WakeSignal::notify() {
+#if defined(__linux__)
+    value.fetch_add(1, std::memory_order_seq_cst);
+    if (sleepers.load(std::memory_order_seq_cst) > 0) {
+        futex_wake(&value);
+    }
+#else
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        value.fetch_add(1, std::memory_order_seq_cst);
+    }
+    if (sleepers.load(std::memory_order_seq_cst) > 0) {
+        cv.notify_all();
+    }
+#endif
+}
+
+// Return once the epoch differs from `seen`
+void TeeStreamBuf::WakeSignal::wait(uint32_t seen, WakeupMode mode, unsigned spin_iterations) {
+    if (mode != WakeupMode::Blocking) {
+        for (unsigned i = 0; mode == WakeupMode::BusyPoll || i < spin_iterations; ++i) {
+            if (value.load(std::memory_order_acquire) != seen) {
+                return;
+            }
+            cpu_relax();
+        }
+    }
+
+    // Announce the sleeper before the final check so notify() cannot miss it
+    sleepers.fetch_add(1, std::memory_order_seq_cst);
+#if defined(__linux__)
+    while (value.load(std::memory_order_seq_cst) == seen) {
+        futex_wait(&value, seen);
+    }
+#else
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [this, seen] { return value.load(std::memory_order_seq_cst) != seen; });
+    }
+#endif
+    sleepers.fetch_sub(1, std::memory_order_relaxed);
+}
 
 // Initialize thread-local storage
-thread_local std::unique_ptr<TeeStreamBuf::ThreadBuffer> TeeStreamBuf::local_buffer;
+thread_local TeeStreamBuf::LocalBuffers TeeStreamBuf::local_buffers;
+thread_local bool TeeStreamBuf::nonblocking = false;
+
+std::atomic<size_t> TeeStreamBuf::queued_blocks{0};
+std::mutex TeeStreamBuf::nesting_mutex;
+
+// ThreadBuffer implementation
+TeeStreamBuf::ThreadBuffer::ThreadBuffer(size_t buffer_size, size_t flush_threshold)
+    : buffer(BufferPool::try_acquire(buffer_size, kMinShrunkBufferSize)),
+      size(std::min(buffer_size, buffer.capacity())),  // Smaller, or 0 to write through, over the memory budget
+      used(0),
+      record_end(0),
+      record_open(false),
+      preferred_size(size),
+      threshold(size == buffer_size ? flush_threshold : size * 3 / 4),
+      deferred(false),
+      line_start(true),
+      thread(std::this_thread::get_id()),
+      stat_size(size),
+      stat_threshold(threshold),
+      stat_flushes(0),
+      stat_bytes(0) {
+    window.start = std::chrono::steady_clock::now();
+    marks.push_back(RecordMark{0, RecordInfo{0, nullptr, thread}});
+}
+
+// Change the preferred size and threshold and publish them
+void TeeStreamBuf::ThreadBuffer::set_size(size_t new_size, size_t new_threshold) {
+    preferred_size = new_size;
+    threshold = new_threshold;
+    stat_size.store(new_size, std::memory_order_relaxed);
+    stat_threshold.store(new_threshold, std::memory_order_relaxed);
+}
+
+// Get or create thread-local buffer
+TeeStreamBuf::ThreadBuffer* TeeStreamBuf::get_thread_buffer() {
+    LocalBuffers& local = local_buffers;
+    if (local.last_registry == registry.get()) {
+        return local.last_buffer;
+    }
+
+    for (auto& entry : local.entries) {
+        if (entry.registry == registry) {
+            local.last_registry = entry.registry.get();
+            local.last_buffer = entry.buffer.get();
+            return local.last_buffer;
+        }
+    }
+
+    // Drop buffers whose TeeStreamBuf has been destroyed, without locking other tees
+    local.entries.erase(
+        std::remove_if(local.entries.begin(), local.entries.end(),
+            [](const LocalBuffers::Entry& entry) {
+                return entry.registry->owner.load(std::memory_order_acquire) == nullptr;
+            }
+        ),
+        local.entries.end()
+    );
+
+    auto tb = std::make_shared<ThreadBuffer>(buffer_size, flush_threshold);
+    {
+        std::lock_guard<std::mutex> lock(registry->mutex);
+        registry->buffers.push_back(tb);
+    }
+    local.entries.push_back({registry, tb});
+    local.last_registry = registry.get();
+    local.last_buffer = tb.get();
+    return local.last_buffer;
+}
+
+// Constructor
+TeeStreamBuf::basic_TeeStreamBuf(size_t buffer_size, size_t flush_threshold)
+    : registry(std::make_shared<Registry>(this)), tombstones(0), level_streams(), filtered_streams(0),
+      write_level(kNoStreams), level(LogLevel::Trace),
+      buffer_size(buffer_size), flush_threshold(flush_threshold), record_atomic(false),
+      adaptive_sizing(false), sample_flushes(AdaptiveSizingPolicy().sample_flushes),
+      async_enabled(false), queue_capacity(0), wakeup_mode(WakeupMode::SpinThenPark),
+      spin_iterations(4000), full_queues(0), dropped(0), timestamps(false), timestamp_digits(6),
+      timestamp_utc(false), timestamp_clock(TimestampClock::Realtime) {
+    // Validate parameters
+    if (flush_threshold >= buffer_size) {
+        this->flush_threshold = buffer_size * 3 / 4; // Default to 75% if invalid
+    }
+}
+
+// Destructor
+TeeStreamBuf::~basic_TeeStreamBuf() {
+    // Wait for exiting threads and stream handles using the tee, and keep them out.
+    // Threads must not write to a tee while it is being destroyed.
+    std::vector<std::shared_ptr<ThreadBuffer>> buffers;
+    {
+        std::unique_lock<std::shared_mutex> alive(registry->alive);
+        registry->owner.store(nullptr, std::memory_order_release);
+        std::lock_guard<std::mutex> lock(registry->mutex);
+        buffers.swap(registry->buffers);
+    }
+
+    // Flush every thread's remaining data, including partial records, with no lock held
+    for (auto& tb : buffers) {
+        flush_range(tb.get(), tb->used);
+
+        // Threads may hold on to the ThreadBuffer for a while, but not its storage
+        tb->buffer = BufferPool::Block();
+        tb->size = 0;
+    }
+
+    // Let background writers finish what is queued
+    disable_async();
+    sync_streams();
+}
+
+// Add a stream to write to
+TeeStreamBuf::SinkHandle TeeStreamBuf::add_stream(std::ostream& stream, SinkFormat format) {
+    SinkOptions options;
+    options.format = format;
+    return add_stream(stream, options);
+}
+
+// Add a stream with a format and a record filter
+TeeStreamBuf::SinkHandle TeeStreamBuf::add_stream(std::ostream& stream, const SinkOptions& options) {
+    auto sink = std::make_shared<Sink>(stream, options);
+    auto nested = dynamic_cast<basic_TeeStreamBuf*>(stream.rdbuf());
+    if (nested) {
+        sink->stream_registry = nested->registry;
+    }
+    link_nested(*sink);
+
+    // Tees nest in one direction only, which is what orders their locks. The check and
+    // the insertion are one step, so two tees cannot be added to each other at once.
+    std::unique_lock<std::mutex> nesting_lock;
+    if (nested) {
+        nesting_lock = std::unique_lock<std::mutex>(nesting_mutex);
+        if (nested->reaches(this)) {
+            throw std::invalid_argument("TeeStream: a tee cannot be a stream of itself or of a tee nested in it");
+        }
+    }
+
+    std::unique_lock<std::shared_mutex> lock(streams_mutex);
+    compact_streams();
+    streams.push_back(sink);
+    sink->listed_level.store(static_cast<int>(sink->min_level));
+    recount_sink(*sink);
+    if (sink->filtered() || sink->nested) {
+        filtered_streams.fetch_add(1, std::memory_order_relaxed);
+    }
+    if (async_enabled) {
+        start_writer(*sink);
+    }
+    return SinkHandle(registry, std::move(sink));
+}
+
+// A plain text stream that is itself a tee is linked to its streams, skipping its buffers
+void TeeStreamBuf::link_nested(Sink& sink) {
+    bool plain = sink.format == SinkFormat::Text && !sink.filtered();
+    sink.nested = plain && sink.stream_registry ? sink.stream_registry->owner.load(std::memory_order_acquire) : nullptr;
+}
+
+// A tee may be destroyed while it is still a stream of another; from then on the other
+// tee skips it
+bool TeeStreamBuf::hold_stream(const Sink& sink, std::shared_lock<std::shared_mutex>& alive) {
+    if (!sink.stream_registry) {
+        return true;
+    }
+    alive = std::shared_lock<std::shared_mutex>(sink.stream_registry->alive);
+    return sink.stream_registry->owner.load(std::memory_order_acquire) != nullptr;
+}
+
+// Whether `tee` is this tee or nested in it, linked or not; locks in nesting order
+bool TeeStreamBuf::reaches(const basic_TeeStreamBuf* tee) const {
+    if (tee == this) {
+        return true;
+    }
+    std::shared_lock<std::shared_mutex> lock(streams_mutex);
+    for (const auto& sink : streams) {
+        std::shared_lock<std::shared_mutex> alive;
+        if (sink->removed.load() || !sink->stream_registry || !hold_stream(*sink, alive)) {
+            continue;
+        }
+        if (sink->stream_registry->owner.load(std::memory_order_acquire)->reaches(tee)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Remove a stream
+void TeeStreamBuf::remove_stream(std::ostream& stream) {
+    std::vector<std::shared_ptr<Sink>> removed;
+    {
+        std::unique_lock<std::shared_mutex> lock(streams_mutex);
+        for (const auto& sink : streams) {
+            if (&sink->stream == &stream && tombstone_sink(*sink)) {
+                removed.push_back(sink);
+            }
+        }
+        compact_streams();
+    }
+    for (auto& sink : removed) {
+        retire_sink(*sink);
+    }
+}
+
+// Mark a stream removed. Flushers check the mark once they count themselves in as users
+// of the stream, so once its users are gone none will touch it; flushers busy with other
+// streams are not waited for.
+bool TeeStreamBuf::tombstone_sink(Sink& sink) {
+    if (sink.removed.exchange(true)) {
+        return false;
+    }
+    tombstones.fetch_add(1);
+
+    sink.listed_level.store(-1);
+    recount_sink(sink);
+    if (sink.filtered() || sink.nested) {
+        filtered_streams.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    for (;;) {
+        uint32_t seen = sink.released.epoch();
+        if (sink.users.load() == 0) {
+            break;
+        }
+        sink.released.wait(seen, WakeupMode::Blocking, 0);
+    }
+    return true;
+}
+
+// Each compaction is paid for by the removals that made half the list tombstones
+void TeeStreamBuf::compact_streams() {
+    size_t removed = tombstones.load();
+    if (removed * 2 <= streams.size()) {
+        return;
+    }
+    streams.erase(std::remove_if(streams.begin(), streams.end(), [](const std::shared_ptr<Sink>& sink) {
+        return sink->removed.load();
+    }), streams.end());
+    tombstones.fetch_sub(removed);
+}
+
+// Data already queued for a removed stream is still written. Flushers skip the stream
+// once it is removed, so no more is queued, and joining the writer holds up none of them.
+void TeeStreamBuf::retire_sink(Sink& sink) {
+    stop_writer(sink);
+    std::shared_lock<std::shared_mutex> stream_alive;
+    if (!hold_stream(sink, stream_alive)) {
+        return;
+    }
+    std::lock_guard<std::mutex> sink_lock(sink.mutex);
+    write_pending(sink);
+}
+
+// The tee a handle's stream was added to, if it still exists
+TeeStreamBuf* TeeStreamBuf::SinkHandle::lock_tee(std::shared_lock<std::shared_mutex>& lock) const {
+    auto shared = registry.lock();
+    if (!shared || !sink) {
+        return nullptr;
+    }
+    lock = std::shared_lock<std::shared_mutex>(shared->alive);
+    return shared->owner.load(std::memory_order_acquire);
+}
+
+// Remove a handle's stream without searching for it
+bool TeeStreamBuf::SinkHandle::remove() {
+    std::shared_lock<std::shared_mutex> alive;
+    basic_TeeStreamBuf* tee = lock_tee(alive);
+    if (!tee) {
+        return false;
+    }
+
+    // Only changes of the list and of async mode are locked out; flushers go on
+    {
+        std::shared_lock<std::shared_mutex> lock(tee->streams_mutex);
+        if (!tee->tombstone_sink(*sink)) {
+            return false;
+        }
+    }
+    tee->retire_sink(*sink);
+
+    // Compacting needs the lock exclusively, so while flushers hold it, it is left to the
+    // next change of the list
+    std::unique_lock<std::shared_mutex> lock(tee->streams_mutex, std::try_to_lock);
+    if (lock) {
+        tee->compact_streams();
+    }
+    return true;
+}
+
+// Mute or unmute a handle's stream. Flushers only load the flag, and the levels the tee
+// buffers are recounted without its lock, so a flusher waiting on a full queue holds up
+// neither this nor other flushers.
+void TeeStreamBuf::SinkHandle::set_enabled(bool enabled) {
+    if (!sink) {
+        return;
+    }
+    std::shared_lock<std::shared_mutex> alive;
+    basic_TeeStreamBuf* tee = lock_tee(alive);
+    sink->enabled.store(enabled);
+    if (tee) {
+        tee->recount_sink(*sink);
+    }
+}
+
+// Change the level filter of a handle's stream
+void TeeStreamBuf::SinkHandle::set_min_level(LogLevel level) {
+    std::shared_lock<std::shared_mutex> alive;
+    basic_TeeStreamBuf* tee = lock_tee(alive);
+    if (!tee) {
+        return;
+    }
+
+    // Whether the stream filters, or is linked to a nested tee, may change with it
+    std::unique_lock<std::shared_mutex> lock(tee->streams_mutex);
+    if (sink->removed.load()) {
+        return;
+    }
+    std::lock_guard<std::mutex> sink_lock(sink->mutex);
+    bool marked = sink->filtered() || sink->nested;
+    sink->min_level = level;
+    sink->listed_level.store(static_cast<int>(level));
+    tee->recount_sink(*sink);
+    tee->link_nested(*sink);
+    if (marked != (sink->filtered() || sink->nested)) {
+        if (marked) {
+            tee->filtered_streams.fetch_sub(1, std::memory_order_relaxed);
+        } else {
+            tee->filtered_streams.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+}
+
+// Whether a handle's stream is still in its tee
+TeeStreamBuf::SinkHandle::operator bool() const {
+    std::shared_lock<std::shared_mutex> alive;
+    basic_TeeStreamBuf* tee = lock_tee(alive);
+    return tee && !sink->removed.load();
+}
+
+// Write data to every stream
+bool TeeStreamBuf::write_to_streams(const char* data, size_t size, const std::vector<RecordMark>& marks,
+                                    ThreadBuffer* donor, const std::shared_ptr<const Chunk>& chunk,
+                                    bool deferred) {
+    // Take a shared lock to read the streams (allows multiple threads to flush simultaneously)
+    std::shared_lock<std::shared_mutex> lock(streams_mutex);
+
+    // In async mode every queue shares a single copy of the data
+    std::shared_ptr<const Chunk> shared_chunk = chunk;
+    bool out_of_memory = false;
+    bool write_through = false;
+
+    // Encodings other than the data itself are produced once, for the first stream needing them
+    std::string text;
+    std::string binary;
+
+    // The timestamp prefix of a borrowed payload
+    const std::string* head = chunk && !chunk->head.empty() ? &chunk->head : nullptr;
+
+    bool all_good = true;
+    for (auto& sink : streams) {
+        // A disabled stream is skipped without taking its lock
+        if (!sink->enabled.load(std::memory_order_relaxed)) {
+            continue;
+        }
+        SinkUse use(*sink);
+        if (!use) {
+            continue;
+        }
+
+        // A stream that picks records does so here, before anything is queued for it, so
+        // data it takes nothing of is neither queued nor copied for it
+        Admission admission;
+        bool picked = sink->picks();
+        if (picked) {
+            if (head) {
+                const std::string& joined = chunk->joined();
+                admit_records(*sink, joined.data(), joined.size(), false, marks, admission);
+            } else {
+                admit_records(*sink, data, size, deferred, marks, admission);
+            }
+            if (admission.records.empty()) {
+                continue;
+            }
+        }
+
+        if (sink->queue) {
+            if (!shared_chunk && !out_of_memory && !write_through) {
+                shared_chunk = make_chunk(data, size, marks, donor, deferred);
+                if (!shared_chunk && BufferPool::get_budget_policy() == BudgetPolicy::Drop) {
+                    out_of_memory = true;
+                    dropped.fetch_add(size, std::memory_order_relaxed);
+                } else if (!shared_chunk) {
+                    write_through = true;
+                }
+            }
+            if (shared_chunk) {
+                enqueue_chunk(*sink->queue, shared_chunk,
+                              picked ? std::make_unique<const Admission>(std::move(admission)) : nullptr);
+                continue;
+            }
+            if (out_of_memory) {
+                continue;
+            }
+            if (nonblocking) {
+                // Only reached by a nested tee's queues, as flush_range() got the chunk
+                // for this tee's; this thread must not wait for them to empty
+                dropped.fetch_add(size, std::memory_order_relaxed);
+                continue;
+            }
+
+            // No memory for a copy and none that will be released: write the data here,
+            // once what is queued before it has been written
+            SinkQueue& queue = *sink->queue;
+            std::unique_lock<std::mutex> queue_lock(queue.mutex);
+            queue.not_full.wait(queue_lock, [&queue] {
+                return queue.written == queue.enqueued;
+            });
+        }
+
+        // A tee behind the stream stays alive while it is written to
+        std::shared_lock<std::shared_mutex> stream_alive;
+        if (!hold_stream(*sink, stream_alive)) {
+            continue;
+        }
+
+        // A nested tee serializes writes to its own streams. With timestamps on, it has
+        // to see the data as written to it to prefix the lines.
+        if (sink->nested && !sink->nested->timestamps.load(std::memory_order_relaxed)) {
+            if (!write_nested(*sink->nested, data, size, marks, shared_chunk, deferred)) {
+                all_good = false;
+            }
+            continue;
+        }
+
+        // Writes to one stream are serialized so flushes never interleave. A head goes out
+        // under the same lock as the data; streams looking at whole records get a copy.
+        std::lock_guard<std::mutex> sink_lock(sink->mutex);
+        bool written;
+        if (head && !sink->filtered() && sink->format == SinkFormat::Text) {
+            written = sink->stream.write(head->data(), static_cast<std::streamsize>(head->size())) &&
+                      sink->stream.write(data, static_cast<std::streamsize>(size));
+        } else if (head) {
+            const std::string& joined = chunk->joined();
+            written = picked ? write_admitted(*sink, joined.data(), joined.size(), false, admission)
+                : sink->filtered() ? write_filtered(*sink, joined.data(), joined.size(), false, marks)
+                : write_to_sink(*sink, joined.data(), joined.size(), false, text, binary);
+        } else {
+            written = picked ? write_admitted(*sink, data, size, deferred, admission)
+                : sink->filtered() ? write_filtered(*sink, data, size, deferred, marks)
+                : write_to_sink(*sink, data, size, deferred, text, binary);
+        }
+        if (!written) {
+            all_good = false;
+        }
+    }
+
+    return all_good;
+}
+
+// Write flushed data straight to a nested tee's streams
+bool TeeStreamBuf::write_nested(basic_TeeStreamBuf& nested, const char* data, size_t size,
+                                const std::vector<RecordMark>& marks, const std::shared_ptr<const Chunk>& chunk,
+                                bool deferred) {
+    // What this thread wrote to the nested tee directly goes first
+    nested.flush_local_buffer();
+    return nested.write_to_streams(data, size, marks, nullptr, chunk, deferred);
+}
+
+// Flush the shared buffer, if there is one
+bool TeeStreamBuf::flush_shared_buffer() {
+    std::lock_guard<std::mutex> lock(shared_buffer_mutex);
+    if (!shared_buffer) {
+        return true;
+    }
+    ThreadBuffer* tb = shared_buffer.get();
+    return flush_range(tb, record_atomic.load(std::memory_order_relaxed) ? tb->record_end : tb->used);
+}
+
+// Flush this thread's buffer, if it has one
+void TeeStreamBuf::flush_local_buffer() {
+    for (auto& entry : local_buffers.entries) {
+        if (entry.registry == registry) {
+            ThreadBuffer* tb = entry.buffer.get();
+            flush_range(tb, record_atomic.load(std::memory_order_relaxed) ? tb->record_end : tb->used);
+            return;
+        }
+    }
+}
+
+namespace {
+
+// 64-bit multiply-fold hash in the style of xxh3 and wyhash, 16 bytes per step
+inline uint64_t hash_mix(uint64_t a, uint64_t b) {
+#if defined(__SIZEOF_INT128__)
+    __uint128_t product = static_cast<__uint128_t>(a) * b;
+    return static_cast<uint64_t>(product) ^ static_cast<uint64_t>(product >> 64);
+#else
+    uint64_t product = a * b;
+    return product ^ (product >> 29) ^ (b * 0x9E3779B97F4A7C15ull);
+#endif
+}
+
+uint64_t record_hash(const char* s, size_t n) {
+    constexpr uint64_t k0 = 0xa0761d6478bd642full;
+    constexpr uint64_t k1 = 0xe7037ed1a0b428dbull;
+    uint64_t h = k0 ^ n;
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        uint64_t a;
+        uint64_t b;
+        memcpy(&a, s + i, sizeof(a));
+        memcpy(&b, s + i + 8, sizeof(b));
+        h = hash_mix(a ^ k0 ^ h, b ^ k1);
+    }
+    if (i < n) {
+        uint64_t tail[2] = {0, 0};
+        memcpy(tail, s + i, n - i);
+        h = hash_mix(tail[0] ^ k0 ^ h, tail[1] ^ k1);
+    }
+    return hash_mix(h ^ k1, n ^ k0);
+}
+
+} // namespace
+
+// Finds the first occurrence of any of a few patterns. Candidate positions, where a
+// pattern's first two bytes match, are found 32 or 16 at a time before being compared.
+class TeeStreamBuf::PatternScanner {
+private:
+    const std::vector<std::string>& patterns;
+#if defined(__AVX2__)
+    struct Probe {
+        __m256i first;
+        __m256i second;
+    };
+    std::vector<Probe> probes;
+#elif defined(__SSE2__)
+    struct Probe {
+        __m128i first;
+        __m128i second;
+    };
+    std::vector<Probe> probes;
+#endif
+
+    // The pattern starting at `pos` and ending by `n`, if any
+    const std::string* match_at(const char* s, size_t n, size_t pos) const {
+        for (const auto& pattern : patterns) {
+            if (pattern.size() <= n - pos && memcmp(s + pos, pattern.data(), pattern.size()) == 0) {
+                return &pattern;
+            }
+        }
+        return nullptr;
+    }
+
+public:
+    // Patterns must not be empty; one-byte patterns match on their first byte alone
+    explicit PatternScanner(const std::vector<std::string>& patterns) : patterns(patterns) {
+#if defined(__AVX2__)
+        for (const auto& pattern : patterns) {
+            char second = pattern.size() > 1 ? pattern[1] : pattern[0];
+            probes.push_back({_mm256_set1_epi8(pattern[0]), _mm256_set1_epi8(second)});
+        }
+#elif defined(__SSE2__)
+        for (const auto& pattern : patterns) {
+            char second = pattern.size() > 1 ? pattern[1] : pattern[0];
+            probes.push_back({_mm_set1_epi8(pattern[0]), _mm_set1_epi8(second)});
+        }
+#endif
+    }
+
+    // Start of the first match at or after `from` that ends by `n`, or `n`; sets `length`
+    size_t find(const char* s, size_t n, size_t from, size_t& length) const {
+        size_t i = from;
+#if defined(__AVX2__)
+        for (; i + 33 <= n; i += 32) {
+            __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s + i));
+            __m256i next = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s + i + 1));
+            uint32_t mask = 0;
+            for (size_t p = 0; p < probes.size(); p++) {
+                __m256i hit = _mm256_cmpeq_epi8(block, probes[p].first);
+                if (patterns[p].size() > 1) {
+                    hit = _mm256_and_si256(hit, _mm256_cmpeq_epi8(next, probes[p].second));
+                }
+                mask |= static_cast<uint32_t>(_mm256_movemask_epi8(hit));
+            }
+            for (; mask != 0; mask &= mask - 1) {
+                size_t pos = i + static_cast<size_t>(__builtin_ctz(mask));
+                if (const std::string* pattern = match_at(s, n, pos)) {
+                    length = pattern->size();
+                    return pos;
+                }
+            }
+        }
+#elif defined(__SSE2__)
+        for (; i + 17 <= n; i += 16) {
+            __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i));
+            __m128i next = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i + 1));
+            uint32_t mask = 0;
+            for (size_t p = 0; p < probes.size(); p++) {
+                __m128i hit = _mm_cmpeq_epi8(block, probes[p].first);
+                if (patterns[p].size() > 1) {
+                    hit = _mm_and_si128(hit, _mm_cmpeq_epi8(next, probes[p].second));
+                }
+                mask |= static_cast<uint32_t>(_mm_movemask_epi8(hit));
+            }
+            for (; mask != 0; mask &= mask - 1) {
+                size_t pos = i + static_cast<size_t>(__builtin_ctz(mask));
+                if (const std::string* pattern = match_at(s, n, pos)) {
+                    length = pattern->size();
+                    return pos;
+                }
+            }
+        }
+#endif
+        for (; i < n; i++) {
+            if (const std::string* pattern = match_at(s, n, i)) {
+                length = pattern->size();
+                return i;
+            }
+        }
+        return n;
+    }
+};
+
+namespace {
+
+// Position of the first ASCII digit at or after `i`, or `n`, 32 or 16 bytes at a time
+size_t find_digit(const char* s, size_t n, size_t i) {
+#if defined(__AVX2__)
+    const __m256i zero = _mm256_set1_epi8('0');
+    const __m256i nine = _mm256_set1_epi8(9);
+    for (; i + 32 <= n; i += 32) {
+        __m256i offset = _mm256_sub_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(s + i)), zero);
+        __m256i digit = _mm256_cmpeq_epi8(_mm256_max_epu8(offset, nine), nine);
+        uint32_t mask = static_cast<uint32_t>(_mm256_movemask_epi8(digit));
+        if (mask != 0) {
+            return i + static_cast<size_t>(__builtin_ctz(mask));
+        }
+    }
+#endif
+#if defined(__SSE2__)
+    const __m128i zero16 = _mm_set1_epi8('0');
+    const __m128i nine16 = _mm_set1_epi8(9);
+    for (; i + 16 <= n; i += 16) {
+        __m128i offset = _mm_sub_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i)), zero16);
+        __m128i digit = _mm_cmpeq_epi8(_mm_max_epu8(offset, nine16), nine16);
+        uint32_t mask = static_cast<uint32_t>(_mm_movemask_epi8(digit));
+        if (mask != 0) {
+            return i + static_cast<size_t>(__builtin_ctz(mask));
+        }
+    }
+#endif
+    for (; i < n; i++) {
+        if (s[i] >= '0' && s[i] <= '9') {
+            return i;
+        }
+    }
+    return n;
+}
+
+// Whether a run of digits passes the Luhn check card numbers carry
+bool luhn_valid(const char* digits, size_t count) {
+    unsigned sum = 0;
+    for (size_t i = 0; i < count; i++) {
+        unsigned digit = static_cast<unsigned>(digits[count - 1 - i] - '0');
+        if (i % 2 == 1) {
+            digit = digit * 2 > 9 ? digit * 2 - 9 : digit * 2;
+        }
+        sum += digit;
+    }
+    return sum % 10 == 0;
+}
+
+// Ends a secret value that follows a prefix
+bool ends_value(char c) {
+    switch (c) {
+        case ' ': case '\t': case '\r': case '\n':
+        case '"': case '\'': case ',': case ';': case '&': case ')': case ']': case '}':
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Longest end of a flush held back because a secret may continue in the next one
+constexpr size_t kMaxHeldSecret = 4096;
+
+// Summary of the repeats of a record that a stream did not write
+std::string repeated_note(uint64_t repeats) {
+    return "repeated " + std::to_string(repeats) + (repeats == 1 ? " time\n" : " times\n");
+}
+
+// Summary of the records a stream's rate limit kept out
+std::string suppressed_note(uint64_t suppressed) {
+    return "suppressed " + std::to_string(suppressed) + (suppressed == 1 ? " record\n" : " records\n");
+}
+
+} // namespace
+
+// Mask the secrets in text: card numbers (13 to 19 digits passing the Luhn check, either
+// plain or in groups of 4 split by single spaces or dashes, one kind per number; the last
+// 4 digits stay visible) and values after any of the stream's prefixes. Unless `final`, an
+// end of the text that a secret may continue past is held back: the returned length is
+// how much of the text can be written now, with no secret crossing it. The masked spans
+// before that go to `spans`, in order and apart, and their masked bytes to `masked`; the
+// rest of the text is not copied.
+size_t TeeStreamBuf::redact(const Sink& sink, const char* s, size_t n, bool final,
+                            std::vector<MaskedSpan>& spans, std::string& masked) {
+    // What a secret covers, with the prefix or the character before it it depends on, and
+    // what of it is masked
+    struct Secret {
+        size_t begin;
+        size_t end;
+        size_t mask_begin;
+        size_t mask_end;
+        bool digits;
+    };
+    std::vector<Secret> secrets;
+    size_t done = n;
+    auto is_digit = [s](size_t i) { return s[i] >= '0' && s[i] <= '9'; };
+
+    if (sink.redact_cards) {
+        for (size_t i = find_digit(s, n, 0); i < n; i = find_digit(s, n, i)) {
+            // A run of digits, going on past a separator only after a group of 4 and only
+            // with the separator the run started with. Dates, times and IDs split
+            // irregularly therefore never join into one number.
+            size_t begin = i;
+            while (i < n && is_digit(i)) {
+                i++;
+            }
+            char separator = 0;
+            for (size_t group = i - begin; group == 4 && i + 1 < n && (s[i] == ' ' || s[i] == '-') &&
+                                           (separator == 0 || s[i] == separator) && is_digit(i + 1);) {
+                size_t next = i + 1;
+                size_t end = next;
+                while (end < n && is_digit(end) && end - next <= 4) {
+                    end++;
+                }
+                if (end - next > 4) {
+                    break;  // Starts a number of its own
+                }
+                separator = s[i];
+                group = end - next;
+                i = end;
+            }
+            size_t context = begin > 0 ? begin - 1 : 0;
+
+            size_t count = 0;
+            for (size_t k = begin; k < i; k++) {
+                count += is_digit(k);
+            }
+            bool too_long = count > 19;
+
+            // A run at the end, or a separator after it, may go on in the next flush
+            bool open = i == n || (i + 1 == n && (s[i] == ' ' || s[i] == '-'));
+            if (open && !final && !too_long) {
+                done = std::min(done, context);
+                break;
+            }
+            bool preceded = begin > 0 && ((s[begin - 1] >= 'A' && s[begin - 1] <= 'Z') ||
+                                          (s[begin - 1] >= 'a' && s[begin - 1] <= 'z'));
+            if (too_long || preceded || count < 13) {
+                continue;
+            }
+            char digits[19];
+            size_t mask_end = begin;
+            for (size_t k = begin, d = 0; k < i; k++) {
+                if (is_digit(k)) {
+                    if (d == count - 4) {
+                        mask_end = k;
+                    }
+                    digits[d++] = s[k];
+                }
+            }
+            if (luhn_valid(digits, count)) {
+                secrets.push_back(Secret{context, i, begin, mask_end, true});
+            }
+        }
+    }
+
+    if (sink.prefix_scanner) {
+        const PatternScanner& scanner = *sink.prefix_scanner;
+        size_t length = 0;
+        for (size_t i = scanner.find(s, n, 0, length); i < n; i = scanner.find(s, n, i, length)) {
+            size_t begin = i + length;
+            size_t end = begin;
+            while (end < n && !ends_value(s[end])) {
+                end++;
+            }
+            if (end == n && !final) {
+                done = std::min(done, i);
+                break;
+            }
+            if (end > begin) {
+                secrets.push_back(Secret{i, end, begin, end, false});
+            }
+            i = std::max(end, i + 1);
+        }
+
+        // The start of a prefix at the end
+        if (!final) {
+            for (const auto& prefix : sink.redact_prefixes) {
+                for (size_t k = std::min(prefix.size() - 1, n); k > 0; k--) {
+                    if (memcmp(s + n - k, prefix.data(), k) == 0) {
+                        done = std::min(done, n - k);
+                        break;
+                    }
+                }
+            }
+        }
+    }
+
+    // No secret may cross the end of what is written; moving it back may make another cross
+    for (bool moved = done < n; moved;) {
+        moved = false;
+        for (const auto& secret : secrets) {
+            if (secret.begin < done && done < secret.end) {
+                done = secret.begin;
+                moved = true;
+            }
+        }
+    }
+    if (n - done > kMaxHeldSecret) {
+        // Not worth holding; a secret open this long is masked up to here
+        spans.clear();
+        masked.clear();
+        return redact(sink, s, n, true, spans, masked);
+    }
+
+    // Overlapping secrets, such as a card number after a prefix, share one span
+    secrets.erase(std::remove_if(secrets.begin(), secrets.end(), [done](const Secret& secret) {
+        return secret.end > done || secret.mask_begin == secret.mask_end;
+    }), secrets.end());
+    std::sort(secrets.begin(), secrets.end(), [](const Secret& a, const Secret& b) {
+        return a.mask_begin < b.mask_begin;
+    });
+    for (size_t first = 0; first < secrets.size();) {
+        MaskedSpan span{secrets[first].mask_begin, secrets[first].mask_end};
+        size_t last = first + 1;
+        while (last < secrets.size() && secrets[last].mask_begin < span.end) {
+            span.end = std::max(span.end, secrets[last].mask_end);
+            last++;
+        }
+        size_t at = masked.size();
+        masked.append(s + span.begin, span.end - span.begin);
+        for (size_t k = first; k < last; k++) {
+            for (size_t i = secrets[k].mask_begin; i < secrets[k].mask_end; i++) {
+                // Card separators stay, so the masked number keeps its grouping
+                char& c = masked[at + i - span.begin];
+                if (!secrets[k].digits || (c >= '0' && c <= '9')) {
+                    c = '*';
+                }
+            }
+        }
+        spans.push_back(span);
+        first = last;
+    }
+    return done;
+}
+
+// Write text with its masked spans in place; what lies between them is written as it is
+bool TeeStreamBuf::write_masked(Sink& sink, const char* data, size_t size,
+                                const std::vector<MaskedSpan>& spans, const std::string& masked) {
+    size_t at = 0;
+    size_t from = 0;
+    for (const auto& span : spans) {
+        sink.stream.write(data + at, static_cast<std::streamsize>(span.begin - at));
+        sink.stream.write(masked.data() + from, static_cast<std::streamsize>(span.end - span.begin));
+        from += span.end - span.begin;
+        at = span.end;
+    }
+    return static_cast<bool>(sink.stream.write(data + at, static_cast<std::streamsize>(size - at)));
+}
+
+// Write flushed data to one stream in its format
+bool TeeStreamBuf::write_to_sink(Sink& sink, const char* data, size_t size, bool deferred,
+                                 std::string& text, std::string& binary, bool final) {
+    // Redacting streams see deferred records as text, and keep their encodings to
+    // themselves. Text is still written straight from `data`, but for the masked spans.
+    std::string formatted;
+    std::string joined;
+    std::vector<MaskedSpan> spans;
+    std::string masked;
+    std::string own_text;
+    std::string own_binary;
+    if (sink.redacting()) {
+        if (deferred) {
+            format_deferred(data, size, formatted);
+            data = formatted.data();
+            size = formatted.size();
+            deferred = false;
+        }
+
+        // A secret cut by the last flush is completed by this one
+        if (!sink.redact_held.empty()) {
+            sink.redact_held.append(data, size);
+            joined.swap(sink.redact_held);
+            data = joined.data();
+            size = joined.size();
+        }
+        size_t done = redact(sink, data, size, final, spans, masked);
+        sink.redact_held.assign(data + done, size - done);
+        size = done;
+        if (size == 0) {
+            return true;
+        }
+        if (!spans.empty() && sink.format == SinkFormat::Text) {
+            return write_masked(sink, data, size, spans, masked);
+        }
+
+        // The binary encoding takes the text in one piece
+        if (!spans.empty()) {
+            if (data != joined.data()) {
+                joined.assign(data, size);
+            }
+            size_t from = 0;
+            for (const auto& span : spans) {
+                joined.replace(span.begin, span.end - span.begin, masked, from, span.end - span.begin);
+                from += span.end - span.begin;
+            }
+            data = joined.data();
+        }
+        own_text.swap(text);
+        own_binary.swap(binary);
+    }
+
+    if (sink.format == SinkFormat::Binary) {
+        if (binary.empty()) {
+            encode_binary(data, size, deferred, binary);
+        }
+        data = binary.data();
+        size = binary.size();
+    } else if (deferred) {
+        if (text.empty()) {
+            format_deferred(data, size, text);
+        }
+        data = text.data();
+        size = text.size();
+    }
+    bool written = static_cast<bool>(sink.stream.write(data, static_cast<std::streamsize>(size)));
+
+    if (sink.redacting()) {
+        text.swap(own_text);
+        binary.swap(own_binary);
+    }
+    return written;
+}
+
+// Write what a stream still owes: the end of the last flush that a redacting stream
+// held back, then the summaries of records suppressed and repeated since the last
+// record it wrote, in the order they would have come before the next one
+bool TeeStreamBuf::write_pending(Sink& sink) {
+    bool all_good = true;
+    std::string text;
+    std::string binary;
+    if (!sink.redact_held.empty()) {
+        all_good = write_to_sink(sink, nullptr, 0, false, text, binary, true);
+    }
+    std::string notes;
+    if (uint64_t suppressed = take_suppressed(sink)) {
+        notes += suppressed_note(suppressed);
+    }
+    if (sink.repeats > 0) {
+        notes += repeated_note(sink.repeats);
+        sink.repeats = 0;
+    }
+    if (!notes.empty()) {
+        text.clear();
+        binary.clear();
+        all_good = write_to_sink(sink, notes.data(), notes.size(), false, text, binary, true) && all_good;
+    }
+    return all_good;
+}
+
+// Stream options; a rate-limited stream starts with a full bucket
+TeeStreamBuf::Sink::Sink(std::ostream& stream, const SinkOptions& options)
+    : stream(stream), format(options.format), min_level(options.min_level), filter(options.filter),
+      sample_every(std::max<uint64_t>(options.sample_every, 1)), rate_limit(options.rate_limit),
+      started(std::chrono::steady_clock::now()), full_at(0), suppressed_any(false), dedup_window(options.dedup_window),
+      last_hash(0), repeats(0), redact_cards(false), nested(nullptr), enabled(true),
+      listed_level(-1), counted_level(-1), removed(false), users(0) {
+    if (rate_limit.burst <= 0) {
+        rate_limit.burst = rate_limit.per_second;
+    }
+    if (rate_limit.unit == RateUnit::Records) {
+        rate_limit.burst = std::max(rate_limit.burst, 1.0);
+    }
+    if (sample_every > 1 || rate_limit.per_second > 0) {
+        shards = std::make_unique<AdmitShard[]>(kAdmitShards);
+    }
+
+    // An empty pattern would match everything
+    for (const auto& pattern : options.match) {
+        if (!pattern.empty()) {
+            patterns.push_back(pattern);
+        }
+    }
+    for (const auto& rule : options.redact) {
+        if (rule.kind == RedactionKind::CardNumbers) {
+            redact_cards = true;
+        } else if (!rule.prefix.empty()) {
+            redact_prefixes.push_back(rule.prefix);
+        }
+    }
+    if (!patterns.empty()) {
+        scanner = std::make_unique<PatternScanner>(patterns);
+    }
+    if (!redact_prefixes.empty()) {
+        prefix_scanner = std::make_unique<PatternScanner>(redact_prefixes);
+    }
+}
+
+TeeStreamBuf::Sink::~Sink() = default;
+
+namespace {
+
+// The shard of a stream's admission counters the calling thread updates
+size_t admit_shard() {
+    static std::atomic<size_t> next_shard{0};
+    static thread_local size_t shard = next_shard.fetch_add(1, std::memory_order_relaxed);
+    return shard;
+}
+
+} // namespace
+
+// Sample, then rate-limit, the records a stream would otherwise take. Each step is one
+// atomic update for the whole flush. The bucket is a virtual schedule: it is next full at
+// `full_at`, and a record costing c moves that c / per_second later, which it may only
+// do while it stays within `burst` / per_second of now. Records keep their order; the
+// suppressed count of a record is the run the rate limit kept out just before it in this
+// flush, plus what earlier flushes left to report once anything is reported.
+void TeeStreamBuf::limit_records(Sink& sink, Admission& admission, const std::vector<size_t>& costs) {
+    AdmitShard& shard = sink.shards[admit_shard() % kAdmitShards];
+    auto& records = admission.records;
+    std::vector<size_t> kept(records.size());
+    for (size_t i = 0; i < kept.size(); i++) {
+        kept[i] = i;
+    }
+
+    if (sink.sample_every > 1) {
+        uint64_t sampled = shard.sampled.fetch_add(kept.size(), std::memory_order_relaxed);
+        size_t taken = 0;
+        for (size_t i = 0; i < kept.size(); i++) {
+            if ((sampled + i) % sink.sample_every == 0) {
+                kept[taken++] = kept[i];
+            }
+        }
+        kept.resize(taken);
+    }
+
+    // The record indices the bucket lets through, decided again if another flush moved it
+    std::vector<size_t> passed;
+    passed.reserve(kept.size());
+    if (sink.rate_limit.per_second > 0 && !kept.empty()) {
+        const double per_second = sink.rate_limit.per_second;
+        const double burst = sink.rate_limit.burst;
+        const double tolerance = burst * (1 + 1e-9) / per_second;
+        double now = std::chrono::duration<double>(std::chrono::steady_clock::now() - sink.started).count();
+        double full_at = sink.full_at.load(std::memory_order_relaxed);
+        double next;
+        do {
+            passed.clear();
+            next = std::max(full_at, now);
+            for (size_t i : kept) {
+                // A record larger than the bucket gets through once the bucket is full
+                double cost = sink.rate_limit.unit == RateUnit::Bytes
+                    ? std::min(static_cast<double>(costs[i]), burst) : 1.0;
+                if (next + cost / per_second - now <= tolerance) {
+                    next += cost / per_second;
+                    passed.push_back(i);
+                }
+            }
+        } while (!passed.empty() &&
+                 !sink.full_at.compare_exchange_weak(full_at, next, std::memory_order_relaxed));
+    } else {
+        passed.swap(kept);
+    }
+
+    // Compact in place, counting the records the bucket kept out ahead of each one
+    const bool limited = sink.rate_limit.per_second > 0;
+    uint64_t suppressed = 0;
+    size_t taken = 0;
+    size_t at = 0;
+    for (size_t i : passed) {
+        if (limited) {
+            for (; at < kept.size() && kept[at] != i; at++) {
+                suppressed++;
+            }
+            at++;
+        }
+        if (taken == 0 && sink.suppressed_any.load(std::memory_order_relaxed)) {
+            suppressed += take_suppressed(sink);
+        }
+        records[taken] = records[i];
+        records[taken].suppressed = suppressed;
+        suppressed = 0;
+        taken++;
+    }
+    if (limited) {
+        suppressed += kept.size() - std::min(at, kept.size());
+    }
+    records.resize(taken);
+
+    // What is left over is reported with a later record, or by write_pending()
+    if (suppressed > 0) {
+        shard.suppressed.fetch_add(suppressed, std::memory_order_relaxed);
+        sink.suppressed_any.store(true, std::memory_order_release);
+    }
+}
+
+// Sum up the suppressed counts of all shards. The flag is cleared first, so a count added
+// meanwhile is either summed here or flagged again.
+uint64_t TeeStreamBuf::take_suppressed(Sink& sink) {
+    if (!sink.shards || !sink.suppressed_any.exchange(false, std::memory_order_acquire)) {
+        return 0;
+    }
+    uint64_t suppressed = 0;
+    for (size_t i = 0; i < kAdmitShards; i++) {
+        suppressed += sink.shards[i].suppressed.exchange(0, std::memory_order_relaxed);
+    }
+    return suppressed;
+}
+
+// Decide which records of flushed data a stream takes. Text is split into records at
+// newlines as well as at marks (see RecordMark); the level and the filter, which only see
+// a mark's metadata, decide for all of a mark's lines at once. Sampling and the rate
+// limit then thin out what those take; see limit_records().
+void TeeStreamBuf::admit_records(Sink& sink, const char* data, size_t size, bool deferred,
+                                 const std::vector<RecordMark>& marks, Admission& admission) {
+    admission.records.clear();
+
+    // Data flushed while the filter was being added may have no marks; it is one record
+    RecordMark whole{0, RecordInfo()};
+    const RecordMark* first = marks.empty() ? &whole : marks.data();
+    size_t count = marks.empty() ? 1 : marks.size();
+
+    // Content rules match deferred records by their text, as redaction does, and byte
+    // limits count the text rather than the encoding
+    bool by_bytes = sink.rate_limit.per_second > 0 && sink.rate_limit.unit == RateUnit::Bytes;
+    std::string formatted;
+    std::vector<size_t> formatted_at;  // Where each record's text starts, then the end
+    if (deferred && (!sink.patterns.empty() || by_bytes)) {
+        for (size_t i = 0; i < count && first[i].offset < size; i++) {
+            size_t end = i + 1 < count ? std::min(first[i + 1].offset, size) : size;
+            formatted_at.push_back(formatted.size());
+            format_deferred(data + first[i].offset, end - first[i].offset, formatted);
+        }
+        formatted_at.push_back(formatted.size());
+    }
+    const char* scan = formatted_at.empty() ? data : formatted.data();
+    size_t scan_size = formatted_at.empty() ? size : formatted.size();
+
+    std::vector<size_t> costs;  // Each record's size, for a byte limit
+
+    // Content rules scan the data once, front to back, finding the next match as records need it
+    const PatternScanner* scanner = sink.scanner.get();
+    size_t hit = scan_size;
+    size_t hit_length = 0;
+    if (scanner) {
+        hit = scanner->find(scan, scan_size, 0, hit_length);
+    }
+
+    for (size_t i = 0; i < count && first[i].offset < size; i++) {
+        if (!sink.accepts(first[i].info)) {
+            continue;
+        }
+
+        // A mark's text holds a record per line; its deferred records are one line
+        size_t mark_end = i + 1 < count ? std::min(first[i + 1].offset, size) : size;
+        for (size_t begin = first[i].offset, end; begin < mark_end; begin = end) {
+            end = mark_end;
+            if (!deferred) {
+                const char* newline = static_cast<const char*>(memchr(data + begin, '\n', mark_end - begin));
+                if (newline) {
+                    end = static_cast<size_t>(newline - data) + 1;
+                }
+            }
+            size_t scan_begin = formatted_at.empty() ? begin : formatted_at[i];
+            size_t scan_end = formatted_at.empty() ? end : formatted_at[i + 1];
+
+            // A record matches if a pattern lies entirely within it
+            bool matched = true;
+            if (scanner) {
+                if (hit < scan_begin) {
+                    hit = scanner->find(scan, scan_size, scan_begin, hit_length);
+                }
+                if (hit < scan_end && hit + hit_length > scan_end) {
+                    // The next match runs past the record; look for one inside it, then beyond
+                    hit = scanner->find(scan, scan_end, hit, hit_length);
+                    if (hit == scan_end) {
+                        hit = scanner->find(scan, scan_size, scan_end, hit_length);
+                    }
+                }
+                matched = hit < scan_end;
+            }
+
+            if (!matched) {
+                continue;
+            }
+            uint16_t prefix = begin == first[i].offset ? first[i].prefix : 0;
+            admission.records.push_back(Admission::Record{begin, end, prefix, 0});
+            if (by_bytes) {
+                costs.push_back(scan_end - scan_begin);
+            }
+        }
+    }
+
+    if (sink.shards && !admission.records.empty()) {
+        limit_records(sink, admission, costs);
+    }
+}
+
+// Write the records a stream takes
+bool TeeStreamBuf::write_filtered(Sink& sink, const char* data, size_t size, bool deferred,
+                                  const std::vector<RecordMark>& marks) {
+    Admission admission;
+    admit_records(sink, data, size, deferred, marks, admission);
+    return write_admitted(sink, data, size, deferred, admission);
+}
+
+// Write the records a stream took. Adjacent records are written together, straight from
+// the flushed data; only deferred and binary runs are encoded. Runs of records suppressed
+// by the rate limit, and of repeats, are summed up before the next record written.
+bool TeeStreamBuf::write_admitted(Sink& sink, const char* data, size_t size, bool deferred,
+                                  const Admission& admission) {
+    bool all_good = true;
+    size_t run_begin = 0;
+    size_t run_end = 0;
+    auto write_run = [&]() {
+        if (run_end > run_begin) {
+            std::string text;
+            std::string binary;
+            if (!write_to_sink(sink, data + run_begin, run_end - run_begin, deferred, text, binary)) {
+                all_good = false;
+            }
+        }
+    };
+
+    // Summaries of suppressed and repeated records go out between the records
+    auto write_note = [&](const std::string& note, size_t next) {
+        write_run();
+        std::string text;
+        std::string binary;
+        if (!write_to_sink(sink, note.data(), note.size(), false, text, binary)) {
+            all_good = false;
+        }
+        run_begin = run_end = next;
+    };
+
+    // The clock is read once per write rather than once per record
+    std::chrono::steady_clock::time_point now;
+    if (sink.dedup_window.count() > 0) {
+        now = std::chrono::steady_clock::now();
+    }
+
+    for (const auto& admitted : admission.records) {
+        size_t begin = admitted.begin;
+        size_t end = std::min(admitted.end, size);
+        if (admitted.suppressed > 0) {
+            write_note(suppressed_note(admitted.suppressed), begin);
+        }
+
+        // A record identical to the last one written, within the window, is only counted.
+        // Records are compared without their timestamp prefixes. The last record is kept
+        // in a buffer that is reused, not reallocated per record.
+        if (sink.dedup_window.count() > 0) {
+            size_t prefix = std::min<size_t>(admitted.prefix, end - begin);
+            const char* record = data + begin + prefix;
+            size_t length = end - begin - prefix;
+            uint64_t hash = record_hash(record, length);
+            if (hash == sink.last_hash && length == sink.last_record.size() &&
+                now - sink.last_written < sink.dedup_window &&
+                memcmp(record, sink.last_record.data(), length) == 0) {
+                sink.repeats++;
+                continue;
+            }
+            if (sink.repeats > 0) {
+                write_note(repeated_note(sink.repeats), begin);
+                sink.repeats = 0;
+            }
+            sink.last_hash = hash;
+            sink.last_record.assign(record, length);
+            sink.last_written = now;
+        }
+
+        if (begin != run_end) {
+            write_run();
+            run_begin = begin;
+        }
+        run_end = end;
+    }
+    write_run();
+    return all_good;
+}
+
+// Wrap flushed data in a chunk for the stream queues
+std::shared_ptr<const TeeStreamBuf::Chunk> TeeStreamBuf::make_chunk(const char* data, size_t size,
+                                                                    const std::vector<RecordMark>& marks,
+                                                                    ThreadBuffer* donor, bool deferred) {
+    // A well-filled thread buffer hands its storage over and takes a fresh block, so the
+    // data is not copied; small flushes are cheaper to copy than to pin a whole buffer
+    if (donor && size * 2 >= donor->size) {
+        BufferPool::Block fresh = BufferPool::try_acquire(donor->size, donor->size);
+        if (fresh.data()) {
+            memcpy(fresh.data(), donor->buffer.data() + size, donor->used - size);
+            std::swap(fresh, donor->buffer);
+            auto chunk = std::make_shared<Chunk>(std::move(fresh), size, deferred);
+            attach_marks(*chunk, marks, size);
+            return chunk;
+        }
+    }
+
+    // Charged to the memory budget. Over it, waiting only helps while queued chunks hold
+    // storage their writers will release; thread buffers may hold the rest for good. A
+    // thread that must not wait gets no chunk instead.
+    BufferPool::Block block = nonblocking ? BufferPool::try_acquire(size, size) : acquire_waiting(size, [] {
+        return queued_blocks.load(std::memory_order_seq_cst) > 0;
+    });
+    if (!block.data()) {
+        return nullptr;
+    }
+    memcpy(block.data(), data, size);
+    auto chunk = std::make_shared<Chunk>(std::move(block), size, deferred);
+    attach_marks(*chunk, marks, size);
+    return chunk;
+}
+
+// Copy the marks of the records in a chunk, if any stream filters records
+void TeeStreamBuf::attach_marks(Chunk& chunk, const std::vector<RecordMark>& marks, size_t size) const {
+    if (filtered_streams.load(std::memory_order_relaxed) == 0) {
+        return;
+    }
+    for (const auto& mark : marks) {
+        if (mark.offset >= size) {
+            break;
+        }
+        chunk.marks.push_back(mark);
+    }
+}
+
+// Queue a chunk for a stream, waiting while its queue is full unless the thread must not wait
+void TeeStreamBuf::enqueue_chunk(SinkQueue& queue, const std::shared_ptr<const Chunk>& chunk,
+                                 std::unique_ptr<const Admission> admission) {
+    {
+        std::unique_lock<std::mutex> lock(queue.mutex);
+        if (!nonblocking) {
+            queue.not_full.wait(lock, [&queue] {
+                return queue.queued_bytes < queue.capacity;
+            });
+        }
+
+        bool was_full = queue.queued_bytes >= queue.capacity;
+        queue.chunks.push_back(QueuedChunk{chunk, std::move(admission)});
+        queue.queued_bytes += chunk->size();
+        queue.enqueued++;
+        if (!was_full && queue.queued_bytes >= queue.capacity) {
+            full_queues.fetch_add(1, std::memory_order_acq_rel);
+        }
+    }
+
+    // Signal outside the lock so a woken writer does not block on it
+    queue.not_empty.notify();
+}
+
+// Start the background writer for a stream
+void TeeStreamBuf::start_writer(Sink& sink) {
+    sink.queue = std::make_unique<SinkQueue>(queue_capacity);
+    sink.queue->writer = std::thread(&TeeStreamBuf::run_writer, this, &sink);
+}
+
+// Stop the background writer for a stream once its queue is empty
+void TeeStreamBuf::stop_writer(Sink& sink) {
+    if (!sink.queue) {
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(sink.queue->mutex);
+        sink.queue->stop = true;
+    }
+    sink.queue->not_empty.notify();
+    sink.queue->writer.join();
+    sink.queue.reset();
+}
+
+// Background writer loop for one stream
+void TeeStreamBuf::run_writer(Sink* sink) {
+    SinkQueue& queue = *sink->queue;
+    std::unique_lock<std::mutex> lock(queue.mutex);
+
+    for (;;) {
+        if (queue.chunks.empty() && !queue.sync_requested && !queue.stop) {
+            // Anything queued after this point changes the epoch
+            uint32_t seen = queue.not_empty.epoch();
+            lock.unlock();
+            queue.not_empty.wait(seen, wakeup_mode.load(std::memory_order_relaxed),
+                                 spin_iterations.load(std::memory_order_relaxed));
+            lock.lock();
+            continue;
+        }
+
+        if (!queue.chunks.empty()) {
+            QueuedChunk queued = std::move(queue.chunks.front());
+            queue.chunks.pop_front();
+            lock.unlock();
+            const std::shared_ptr<const Chunk>& chunk = queued.chunk;
+
+            std::shared_lock<std::shared_mutex> stream_alive;
+            if (hold_stream(*sink, stream_alive)) {
+                std::lock_guard<std::mutex> sink_lock(sink->mutex);
+                if (sink->nested && !sink->nested->timestamps.load(std::memory_order_relaxed)) {
+                    write_nested(*sink->nested, chunk->data(), chunk->size(), chunk->marks, chunk, chunk->deferred);
+                } else if (queued.admission && !chunk->head.empty()) {
+                    const std::string& joined = chunk->joined();
+                    write_admitted(*sink, joined.data(), joined.size(), false, *queued.admission);
+                } else if (queued.admission) {
+                    write_admitted(*sink, chunk->data(), chunk->size(), chunk->deferred, *queued.admission);
+                } else if (sink->filtered() && !chunk->head.empty()) {
+                    const std::string& joined = chunk->joined();
+                    write_filtered(*sink, joined.data(), joined.size(), false, chunk->marks);
+                } else if (sink->filtered()) {
+                    write_filtered(*sink, chunk->data(), chunk->size(), chunk->deferred, chunk->marks);
+                } else if (sink->format == SinkFormat::Binary) {
+                    const std::string& binary = chunk->encoded();
+                    sink->stream.write(binary.data(), static_cast<std::streamsize>(binary.size()));
+                } else if (chunk->deferred) {
+                    const std::string& text = chunk->formatted();
+                    sink->stream.write(text.data(), static_cast<std::streamsize>(text.size()));
+                } else {
+                    sink->stream.write(chunk->head.data(), static_cast<std::streamsize>(chunk->head.size()));
+                    sink->stream.write(chunk->data(), static_cast<std::streamsize>(chunk->size()));
+                }
+            }
+            stream_alive = std::shared_lock<std::shared_mutex>();
+
+            lock.lock();
+            bool was_full = queue.queued_bytes >= queue.capacity;
+            queue.queued_bytes -= chunk->size();
+            queue.written++;
+            queue.not_full.notify_all();
+
+            if (was_full && queue.queued_bytes < queue.capacity &&
+                full_queues.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+                lock.unlock();
+                fire_writable_callbacks();
+                lock.lock();
+            }
+        }
+
+        // Collect drain waiters whose data has been written
+        std::vector<std::function<void()>> drained;
+        auto& waiters = queue.drain_waiters;
+        for (auto it = waiters.begin(); it != waiters.end();) {
+            if (it->first <= queue.written) {
+                drained.push_back(std::move(it->second));
+                it = waiters.erase(it);
+            } else {
+                ++it;
+            }
+        }
+
+        if (!drained.empty() || (queue.sync_requested && queue.chunks.empty())) {
+            queue.sync_requested = false;
+            queue.syncing = true;
+            lock.unlock();
+
+            std::shared_lock<std::shared_mutex> stream_alive;
+            if (hold_stream(*sink, stream_alive)) {
+                std::lock_guard<std::mutex> sink_lock(sink->mutex);
+                write_pending(*sink);
+                sink->stream.rdbuf()->pubsync();
+            }
+            stream_alive = std::shared_lock<std::shared_mutex>();
+            for (auto& callback : drained) {
+                callback();
+            }
+
+            lock.lock();
+            queue.syncing = false;
+        }
+
+        if (queue.stop && queue.chunks.empty()) {
+            break;
+        }
+    }
+}
+
+// Run writable callbacks once no queue is full
+void TeeStreamBuf::fire_writable_callbacks() {
+    std::vector<std::function<void()>> callbacks;
+    {
+        std::lock_guard<std::mutex> lock(callbacks_mutex);
+        if (full_queues.load(std::memory_order_acquire) > 0) {
+            return;
+        }
+        callbacks.swap(writable_callbacks);
+    }
+
+    for (auto& callback : callbacks) {
+        callback();
+    }
+}
+
+// Enable async mode
+void TeeStreamBuf::enable_async(size_t queue_capacity) {
+    std::unique_lock<std::shared_mutex> lock(streams_mutex);
+    if (async_enabled) {
+        return;
+    }
+
+    async_enabled = true;
+    this->queue_capacity = queue_capacity > 0 ? queue_capacity : 1;
+    for (auto& sink : streams) {
+        if (!sink->removed.load()) {
+            start_writer(*sink);
+        }
+    }
+}
+
+// Disable async mode once everything queued has been written
+void TeeStreamBuf::disable_async() {
+    std::unique_lock<std::shared_mutex> lock(streams_mutex);
+    if (!async_enabled) {
+        return;
+    }
+
+    // A removed stream's writer is stopped by whoever removed it
+    async_enabled = false;
+    for (auto& sink : streams) {
+        if (!sink->removed.load()) {
+            stop_writer(*sink);
+        }
+    }
+}
+
+bool TeeStreamBuf::is_async() const {
+    std::shared_lock<std::shared_mutex> lock(streams_mutex);
+    return async_enabled;
+}
+
+// True while any stream queue is full
+bool TeeStreamBuf::backpressured() const {
+    return full_queues.load(std::memory_order_acquire) > 0;
+}
+
+// Call back once no stream queue is full
+bool TeeStreamBuf::notify_when_writable(std::function<void()> callback) {
+    std::lock_guard<std::mutex> lock(callbacks_mutex);
+    if (full_queues.load(std::memory_order_acquire) == 0) {
+        return false;
+    }
+
+    writable_callbacks.push_back(std::move(callback));
+    return true;
+}
+
+// Flush and call back once every stream has written everything queued so far
+bool TeeStreamBuf::notify_when_drained(std::function<void()> callback) {
+    {
+        NonblockingScope scope;
+        flush_thread_buffer();
+        flush_shared_buffer();
+    }
+
+    std::shared_lock<std::shared_mutex> lock(streams_mutex);
+
+    // One count per pending stream, plus one held until registration is done
+    auto pending = std::make_shared<std::atomic<size_t>>(1);
+    auto shared_callback = std::make_shared<std::function<void()>>(std::move(callback));
+    auto release = [pending, shared_callback]() {
+        if (pending->fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            (*shared_callback)();
+        }
+    };
+
+    bool registered = false;
+    for (auto& sink : streams) {
+        SinkUse use(*sink);
+        if (!use || !sink->queue) {
+            continue;
+        }
+
+        // A sync still to run or running may write pending summaries, so wait for another
+        {
+            std::lock_guard<std::mutex> queue_lock(sink->queue->mutex);
+            SinkQueue& queue = *sink->queue;
+            if (queue.written == queue.enqueued && !queue.sync_requested && !queue.syncing) {
+                continue;
+            }
+            pending->fetch_add(1, std::memory_order_relaxed);
+            queue.drain_waiters.emplace_back(queue.enqueued, release);
+            queue.sync_requested = true;
+            registered = true;
+        }
+        sink->queue->not_empty.notify();
+    }
+
+    if (!registered) {
+        return false;
+    }
+
+    release();
+    return true;
+}
+
+// Choose how background writers wait for data
+void TeeStreamBuf::set_wakeup_mode(WakeupMode mode, unsigned spin_iterations) {
+    this->spin_iterations.store(spin_iterations, std::memory_order_relaxed);
+    wakeup_mode.store(mode, std::memory_order_relaxed);
+}
+
+WakeupMode TeeStreamBuf::get_wakeup_mode() const {
+    return wakeup_mode.load(std::memory_order_relaxed);
+}
+
+// Bytes dropped because the memory budget was reached
+uint64_t TeeStreamBuf::dropped_bytes() const {
+    return dropped.load(std::memory_order_relaxed);
+}
+
+// Block until everything queued so far has been written
+void TeeStreamBuf::drain() {
+    std::promise<void> drained;
+    auto done = drained.get_future();
+    if (notify_when_drained([&drained]() { drained.set_value(); })) {
+        done.wait();
+    }
+}
+
+// Flush the first `end` bytes of a buffer and keep the rest
+bool TeeStreamBuf::flush_range(ThreadBuffer* tb, size_t end) {
+    // Nothing to flush
+    if (end == 0) {
+        return true;
+    }
+
+    // Flush cost is only measured when adaptive sizing needs it
+    bool measure = adaptive_sizing.load(std::memory_order_relaxed);
+    std::chrono::steady_clock::time_point start;
+    if (measure) {
+        start = std::chrono::steady_clock::now();
+    }
+
+    // Streams are written straight from the buffer. Queued streams may take the
+    // buffer's storage, in which case the rest of it is already in a fresh block.
+    // A buffer holding both text and deferred records is written a run of each at a time.
+    const char* data = tb->buffer.data();
+    auto& marks = tb->marks;
+    size_t run = 1;
+    while (run < marks.size() && marks[run].offset < end && marks[run].deferred == marks[0].deferred) {
+        run++;
+    }
+
+    // A thread that must not wait gets the chunks for the queues up front, without waiting
+    // for the budget; if they do not fit, nothing is flushed
+    bool precopy = nonblocking && BufferPool::get_memory_budget() != 0;
+    if (run == marks.size() || marks[run].offset >= end) {
+        std::shared_ptr<const Chunk> chunk;
+        if (precopy) {
+            chunk = make_chunk(data, end, marks, tb, marks[0].deferred);
+            if (!chunk) {
+                return false;
+            }
+        }
+        write_to_streams(data, end, marks, tb, chunk, marks[0].deferred);
+    } else {
+        struct Run {
+            size_t begin;
+            size_t end;
+            std::vector<RecordMark> marks;
+            std::shared_ptr<const Chunk> chunk;
+        };
+        std::vector<Run> runs;
+        size_t first = 0;
+        while (first < marks.size() && marks[first].offset < end) {
+            size_t begin = marks[first].offset;
+            size_t last = first + 1;
+            while (last < marks.size() && marks[last].offset < end && marks[last].deferred == marks[first].deferred) {
+                last++;
+            }
+            size_t run_end = last < marks.size() ? std::min(marks[last].offset, end) : end;
+            std::vector<RecordMark> run_marks(marks.begin() + static_cast<std::ptrdiff_t>(first),
+                                              marks.begin() + static_cast<std::ptrdiff_t>(last));
+            for (auto& mark : run_marks) {
+                mark.offset -= begin;
+            }
+            std::shared_ptr<const Chunk> chunk;
+            if (precopy) {
+                chunk = make_chunk(data + begin, run_end - begin, run_marks, nullptr, run_marks[0].deferred);
+                if (!chunk) {
+                    return false;
+                }
+            }
+            runs.push_back(Run{begin, run_end, std::move(run_marks), std::move(chunk)});
+            first = last;
+        }
+        for (const auto& each : runs) {
+            write_to_streams(data + each.begin, each.end - each.begin, each.marks, nullptr, each.chunk,
+                             each.marks[0].deferred);
+        }
+    }
+
+    // Move any trailing partial record to the front
+    size_t remaining = tb->used - end;
+    if (remaining > 0 && tb->buffer.data() == data) {
+        memmove(tb->buffer.data(), tb->buffer.data() + end, remaining);
+    }
+
+    // The record open at `end` now starts the buffer
+    size_t open = 0;
+    while (open + 1 < marks.size() && marks[open + 1].offset <= end) {
+        open++;
+    }
+    marks.erase(marks.begin(), marks.begin() + static_cast<std::ptrdiff_t>(open));
+    for (auto& mark : marks) {
+        if (mark.offset < end) {
+            mark.offset = 0;
+            mark.prefix = 0;  // Flushed with the start of the record
+        } else {
+            mark.offset -= end;
+        }
+    }
+    tb->used = remaining;
+    tb->record_end = tb->record_end > end ? tb->record_end - end : 0;
+
+    tb->stat_flushes.fetch_add(1, std::memory_order_relaxed);
+    tb->stat_bytes.fetch_add(end, std::memory_order_relaxed);
+
+    if (measure) {
+        auto& window = tb->window;
+        window.flushes++;
+        window.bytes += end;
+        window.flush_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start).count();
+        window.peak_used = std::max(window.peak_used, end + remaining);
+
+        if (window.flushes >= sample_flushes.load(std::memory_order_relaxed)) {
+            adapt_buffer(tb);
+        }
+    }
+    return true;
+}
+
+// Re-evaluate a buffer's size from the last measurement window
+void TeeStreamBuf::adapt_buffer(ThreadBuffer* tb) {
+    AdaptiveSizingPolicy policy;
+    {
+        std::lock_guard<std::mutex> lock(adaptive_mutex);
+        policy = adaptive_policy;
+    }
+
+    auto& window = tb->window;
+    auto now = std::chrono::steady_clock::now();
+    double window_ns = std::max<double>(1.0,
+        std::chrono::duration_cast<std::chrono::nanoseconds>(now - window.start).count());
+    double overhead = window.flush_ns / window_ns;
+    double cost_per_byte = window.bytes > 0 ? static_cast<double>(window.flush_ns) / window.bytes : 0.0;
+
+    size_t size = tb->preferred_size;
+    size_t new_size = size;
+
+    if (window.grew && cost_per_byte > window.last_cost_per_byte * (1.0 - policy.min_improvement)) {
+        // The last growth did not pay for itself, so go back and hold off for a while
+        new_size = size / 2;
+        window.growth_backoff = 8;
+    } else if (window.growth_backoff == 0 && overhead > policy.target_flush_overhead &&
+               window.peak_used * 2 >= tb->threshold) {
+        // Flushes of a well-filled buffer are taking too much of the thread's time
+        new_size = size * 2;
+    } else if (window.peak_used < size / 4) {
+        // Most of the buffer is never used
+        new_size = size / 2;
+    }
+
+    if (window.growth_backoff > 0) {
+        window.growth_backoff--;
+    }
+
+    new_size = std::min(std::max(new_size, policy.min_buffer_size), policy.max_buffer_size);
+    size_t new_threshold = std::max<size_t>(1, static_cast<size_t>(new_size * policy.threshold_ratio));
+
+    window.grew = new_size > size;
+    window.last_cost_per_byte = cost_per_byte;
+    window.start = now;
+    window.flushes = 0;
+    window.bytes = 0;
+    window.flush_ns = 0;
+    window.peak_used = 0;
+
+    if (new_size != size || new_threshold != tb->threshold) {
+        size_t threshold = tb->threshold;
+        tb->set_size(new_size, new_threshold);
+
+        // A buffer still holding an oversized record shrinks once it is flushed
+        if (tb->used <= new_size && tb->size != new_size && !resize_buffer(tb, new_size)) {
+            // Over the memory budget, so stay as we are
+            tb->set_size(size, threshold);
+        }
+    }
+}
+
+// Reallocate a buffer, preserving its contents; false if the memory budget does not allow it
+bool TeeStreamBuf::resize_buffer(ThreadBuffer* tb, size_t new_size) {
+    if (new_size == 0) {
+        tb->buffer = BufferPool::Block();
+        tb->size = 0;
+        return true;
+    }
+
+    BufferPool::Block new_buffer = BufferPool::try_acquire(new_size, new_size);
+    if (!new_buffer.data()) {
+        return false;
+    }
+    memcpy(new_buffer.data(), tb->buffer.data(), tb->used);
+    tb->buffer = std::move(new_buffer);
+    tb->size = new_size;
+    return true;
+}
+
+// Make room for `n` more bytes, flushing and then growing the buffer if needed;
+// false if the memory budget does not allow it
+bool TeeStreamBuf::make_room(ThreadBuffer* tb, size_t n, bool records) {
+    if (tb->used + n <= tb->size) {
+        return true;
+    }
+
+    // In record-atomic mode only complete records are emitted, then the buffer grows for the open one
+    flush_range(tb, records ? tb->record_end : tb->used);
+    if (tb->used + n <= tb->size) {
+        return true;
+    }
+    return resize_buffer(tb, std::max(tb->used + n, tb->size * 2)) || resize_buffer(tb, tb->used + n);
+}
+
+// Append data in record-atomic mode
+bool TeeStreamBuf::append_record_data(ThreadBuffer* tb, const char* s, size_t n) {
+    if (!make_room(tb, n, true)) {
+        // Over the memory budget: the open record is written through unbuffered, unless
+        // that would make the thread wait
+        if (nonblocking) {
+            return false;
+        }
+        flush_range(tb, tb->used);
+        write_to_streams(s, n, tb->marks);
+        return true;
+    }
+
+    memcpy(tb->buffer.data() + tb->used, s, n);
+    records_appended(tb, n);
+    return true;
+}
+
+// Account for `n` bytes just placed after the used part of the buffer in record-atomic mode
+void TeeStreamBuf::records_appended(ThreadBuffer* tb, size_t n) {
+    const char* s = tb->buffer.data() + tb->used;
+
+    // A newline closes every record up to and including it
+    for (size_t i = n; i > 0; --i) {
+        if (s[i - 1] == '\n') {
+            tb->record_end = tb->used + i;
+            break;
+        }
+    }
+    tb->used += n;
+    flush_complete_records(tb);
+}
+
+// Flush the complete records of a buffer once it is above its threshold
+void TeeStreamBuf::flush_complete_records(ThreadBuffer* tb) {
+    if (tb->used >= tb->threshold && tb->record_end > 0) {
+        flush_range(tb, tb->record_end);
+
+        // Give back memory grown for an oversized record
+        if (tb->size > tb->preferred_size && tb->used <= tb->preferred_size) {
+            resize_buffer(tb, tb->preferred_size);
+        }
+    }
+}
+
+// Get space for `n` bytes at the end of the calling thread's buffer
+char* TeeStreamBuf::reserve(size_t n) {
+    if (!has_enabled_streams()) {
+        return nullptr;
+    }
+    auto tb = get_thread_buffer();
+    begin_text(tb);
+
+    // A reservation that starts a line gets the line's timestamp in front of it
+    char prefix[TimestampPrefix::kMaxSize];
+    size_t prefix_size = 0;
+    if (timestamps.load(std::memory_order_relaxed) && tb->line_start) {
+        prefix_size = format_prefix(prefix);
+    }
+
+    if (!make_room(tb, n + prefix_size, record_atomic.load(std::memory_order_relaxed))) {
+        return nullptr;
+    }
+    if (prefix_size > 0) {
+        begin_prefixed_line(tb, prefix_size);
+        memcpy(tb->buffer.data() + tb->used, prefix, prefix_size);
+        tb->used += prefix_size;
+        tb->line_start = false;
+    }
+    return tb->buffer.data() + tb->used;
+}
+
+// Commit `n` bytes written into the space from reserve()
+void TeeStreamBuf::commit(size_t n) {
+    auto tb = get_thread_buffer();
+    n = std::min(n, tb->size - tb->used);
+
+    // Lines after the first one in the committed text still need their timestamps
+    std::string rest;
+    if (timestamps.load(std::memory_order_relaxed) && n > 0) {
+        const char* s = tb->buffer.data() + tb->used;
+        const char* newline = static_cast<const char*>(memchr(s, '\n', n));
+        if (newline && newline + 1 < s + n) {
+            rest.assign(newline + 1, s + n);
+            n = static_cast<size_t>(newline + 1 - s);
+        }
+        tb->line_start = newline != nullptr;
+    }
+    if (n > 0) {
+        tb->record_open = tb->buffer.data()[tb->used + n - 1] != '\n';
+    }
+
+    if (record_atomic.load(std::memory_order_relaxed)) {
+        records_appended(tb, n);
+    } else {
+        bytes_appended(tb, n);
+    }
+
+    if (!rest.empty()) {
+        append_prefixed(tb, rest.data(), rest.size());
+    }
+}
+
+// Account for `n` bytes just placed after the used part of the buffer
+void TeeStreamBuf::bytes_appended(ThreadBuffer* tb, size_t n) {
+    tb->used += n;
+
+    // Auto-flush if we're above the threshold
+    if (tb->used >= tb->threshold) {
+        flush_range(tb, tb->used);
+
+        // Give back memory grown for an oversized reservation
+        if (tb->size > tb->preferred_size) {
+            resize_buffer(tb, tb->preferred_size);
+        }
+    }
+}
+
+// Text and deferred records share a buffer, told apart by their marks, so switching
+// between them flushes nothing
+void TeeStreamBuf::begin_buffer_kind(ThreadBuffer* tb, bool deferred) {
+    auto& last = tb->marks.back();
+    if (last.offset == tb->used) {
+        last.deferred = deferred;
+    } else {
+        tb->marks.push_back(RecordMark{tb->used, last.info, deferred});
+    }
+    tb->deferred = deferred;
+}
+
+// Start a record for a line with a timestamp prefix, so readers can tell the prefix apart
+void TeeStreamBuf::begin_prefixed_line(ThreadBuffer* tb, size_t prefix_size) {
+    begin_buffer_kind(tb, tb->deferred);
+    tb->marks.back().prefix = static_cast<uint16_t>(prefix_size);
+}
+
+// Make the end of a buffer take text. The last mark of a deferred line left open holds
+// just that line, which is formatted and put back as the start of a text record.
+void TeeStreamBuf::begin_text(ThreadBuffer* tb) {
+    if (!tb->deferred) {
+        return;
+    }
+    if (!tb->record_open) {
+        begin_buffer_kind(tb, false);
+        return;
+    }
+
+    auto& last = tb->marks.back();
+    std::string text;
+    format_deferred(tb->buffer.data() + last.offset, tb->used - last.offset, text);
+    tb->used = last.offset;
+    last.deferred = false;
+    tb->deferred = false;
+    append_text(tb, text.data(), text.size());
+}
+
+// Get space for a deferred print record in the calling thread's buffer. A deferred record
+// that starts a record gets a mark, with the metadata of the statement it is part of. If
+// it also starts a line, the line's timestamp goes in front of it as a deferred record of
+// its own text. One that goes on in an open line stays in that line's record (see
+// commit_deferred()).
+char* TeeStreamBuf::reserve_deferred(size_t n) {
+    auto tb = get_thread_buffer();
+    bool atomic = record_atomic.load(std::memory_order_relaxed);
+    if (tb->record_open) {
+        return make_room(tb, n, atomic) ? tb->buffer.data() + tb->used : nullptr;
+    }
+
+    char prefix[TimestampPrefix::kMaxSize];
+    size_t prefix_size = 0;
+    if (timestamps.load(std::memory_order_relaxed) && tb->line_start) {
+        prefix_size = format_prefix(prefix);
+    }
+    size_t prefix_record = prefix_size > 0 ? sizeof(TeeDeferredHeader) + sizeof(uint32_t) + prefix_size : 0;
+
+    if (!make_room(tb, n + prefix_record, atomic)) {
+        return nullptr;
+    }
+    begin_buffer_kind(tb, true);
+    if (prefix_record > 0) {
+        static constexpr char kPrefixFormat[] = "{}";
+        TeeDeferredHeader header{&TeeDeferredCodec::args<std::string_view>, kPrefixFormat,
+                                 sizeof(uint32_t) + prefix_size};
+        char* out = tb->buffer.data() + tb->used;
+        memcpy(out, &header, sizeof(header));
+        TeeDeferredCodec::encode<std::string_view>(out + sizeof(header), std::string_view(prefix, prefix_size));
+        tb->marks.back().prefix = static_cast<uint16_t>(prefix_record);
+        tb->used += prefix_record;
+        tb->line_start = false;
+        tb->record_open = true;
+    }
+    return tb->buffer.data() + tb->used;
+}
+
+// Commit a deferred print record. A record whose format ends with a newline ends its line
+// and record. One placed in an open text line is formatted into it right away.
+void TeeStreamBuf::commit_deferred(size_t n) {
+    auto tb = get_thread_buffer();
+    TeeDeferredHeader header;
+    memcpy(&header, tb->buffer.data() + tb->used, sizeof(header));
+    size_t length = strlen(header.text);
+    bool ends_line = length > 0 && header.text[length - 1] == '\n';
+
+    if (!tb->deferred) {
+        std::string text;
+        format_deferred(tb->buffer.data() + tb->used, n, text);
+        append_text(tb, text.data(), text.size());
+        tb->line_start = ends_line;
+        return;
+    }
+
+    tb->line_start = ends_line;
+    tb->record_open = !ends_line;
+    if (ends_line) {
+        tb->record_end = tb->used + n;
+    }
+    if (record_atomic.load(std::memory_order_relaxed)) {
+        tb->used += n;
+        flush_complete_records(tb);
+    } else {
+        bytes_appended(tb, n);
+    }
+}
+
+// Format a run of deferred print records
+void TeeStreamBuf::format_deferred(const char* data, size_t size, std::string& out) {
+    const char* end = data + size;
+    while (data < end) {
+        TeeDeferredHeader header;
+        memcpy(&header, data, sizeof(header));
+        data += sizeof(header);
+
+        try {
+            header.args->format(header.text, data, out);
+        } catch (const std::invalid_argument& e) {
+            // Format strings are only checked here when the compiler lacks consteval
+            out += "[";
+            out += e.what();
+            out += ": ";
+            out += header.text;
+            out += "]\n";
+        }
+        data += header.payload_size;
+    }
+}
+
+namespace {
+
+// Append one SinkFormat::Binary frame: type, 32-bit payload length, payload
+void append_frame(std::string& out, char type, const char* payload, size_t size,
+                  const char* extra = nullptr, size_t extra_size = 0) {
+    uint32_t length = static_cast<uint32_t>(size + extra_size);
+    out += type;
+    out.append(reinterpret_cast<const char*>(&length), sizeof(length));
+    out.append(payload, size);
+    if (extra_size > 0) {
+        out.append(extra, extra_size);
+    }
+}
+
+} // namespace
+
+// Encode flushed data as binary frames. Text becomes a 'T' frame. Each deferred record
+// becomes an 'R' frame (32-bit format id, then the raw arguments), preceded the first
+// time its format appears in this data by an 'F' frame (id, 32-bit signature length,
+// signature, format text), so every flushed block can be decoded on its own.
+void TeeStreamBuf::encode_binary(const char* data, size_t size, bool deferred, std::string& out) {
+    if (!deferred) {
+        append_frame(out, 'T', data, size);
+        return;
+    }
+
+    // Formats seen so far in this block, by id; a block rarely has more than a few
+    std::vector<std::pair<const char*, const TeeDeferredArgs*>> formats;
+
+    const char* end = data + size;
+    while (data < end) {
+        TeeDeferredHeader header;
+        memcpy(&header, data, sizeof(header));
+        data += sizeof(header);
+
+        auto found = std::find(formats.begin(), formats.end(), std::make_pair(header.text, header.args));
+        uint32_t id = static_cast<uint32_t>(found - formats.begin());
+        if (found == formats.end()) {
+            formats.emplace_back(header.text, header.args);
+
+            std::string definition(reinterpret_cast<const char*>(&id), sizeof(id));
+            uint32_t signature_size = static_cast<uint32_t>(strlen(header.args->signature));
+            definition.append(reinterpret_cast<const char*>(&signature_size), sizeof(signature_size));
+            definition += header.args->signature;
+            definition += header.text;
+            append_frame(out, 'F', definition.data(), definition.size());
+        }
+
+        append_frame(out, 'R', reinterpret_cast<const char*>(&id), sizeof(id), data, header.payload_size);
+        data += header.payload_size;
+    }
+}
 
-// ThreadBuffer implementation
-TeeStreamBuf::ThreadBuffer::ThreadBuffer(size_t buffer_size)
-    : buffer(std::make_unique<char[]>(buffer_size)),
-      size(buffer_size),
-      used(0) {}
+// Binary encoding of a chunk, produced by whichever writer gets to it first
+const std::string& TeeStreamBuf::Chunk::encoded() const {
+    std::call_once(encode_once, [this]() {
+        if (head.empty()) {
+            encode_binary(ptr, length, deferred, binary);
+        } else {
+            encode_binary(joined().data(), joined().size(), deferred, binary);
+        }
+    });
+    return binary;
+}
 
-// Get or create thread-local buffer
-TeeStreamBuf::ThreadBuffer* TeeStreamBuf::get_thread_buffer() {
-    if (!local_buffer) {
-        local_buffer = std::make_unique<ThreadBuffer>(buffer_size);
-    }
-    return local_buffer.get();
+// Head and data of a chunk together, copied by whichever writer needs it first
+const std::string& TeeStreamBuf::Chunk::joined() const {
+    std::call_once(join_once, [this]() {
+        whole.reserve(head.size() + length);
+        whole.append(head).append(ptr, length);
+    });
+    return whole;
 }
 
-// Constructor
-TeeStreamBuf::TeeStreamBuf(size_t buffer_size, size_t flush_threshold)
-    : buffer_size(buffer_size), flush_threshold(flush_threshold) {
-    // Validate parameters
-    if (flush_threshold >= buffer_size) {
-        this->flush_threshold = buffer_size * 3 / 4; // Default to 75% if invalid
+// Text of a deferred chunk, formatted by whichever writer gets to it first
+const std::string& TeeStreamBuf::Chunk::formatted() const {
+    std::call_once(format_once, [this]() {
+        format_deferred(ptr, length, text);
+    });
+    return text;
+}
+
+// Flush the thread-local buffer
+void TeeStreamBuf::flush_thread_buffer() {
+    auto tb = get_thread_buffer();
+
+    // In record-atomic mode an unfinished record stays buffered
+    flush_range(tb, record_atomic.load(std::memory_order_relaxed) ? tb->record_end : tb->used);
+}
+
+// Start a record with metadata for stream filters
+void TeeStreamBuf::begin_record(int level, const char* tag) {
+    auto tb = get_thread_buffer();
+    RecordMark mark{tb->used, RecordInfo{level, tag, tb->thread}, tb->deferred};
+    if (tb->marks.back().offset == tb->used) {
+        tb->marks.back() = mark;  // The previous record is empty
+    } else {
+        tb->marks.push_back(mark);
+    }
+
+    // A statement that left its line open is not complete: record-atomic flushing waits
+    // for the newline, so no other thread's output lands in the middle of the line.
+    // Deferred lines move record_end themselves when they end.
+    if (!tb->deferred && (tb->used == 0 || tb->buffer.data()[tb->used - 1] == '\n')) {
+        tb->record_end = tb->used;
     }
+    tb->record_open = false;
 }
 
-// Destructor
-TeeStreamBuf::~TeeStreamBuf() {
-    sync(); // Flush any remaining data
+// Set the level below which leveled statements are skipped
+void TeeStreamBuf::set_level(LogLevel new_level) {
+    level.store(new_level);
+    update_write_level();
 }
 
-// Add a stream to write to
-void TeeStreamBuf::add_stream(std::ostream& stream) {
-    std::unique_lock<std::shared_mutex> lock(streams_mutex);
-    streams.emplace_back(stream);
+LogLevel TeeStreamBuf::get_level() const {
+    return level.load();
 }
 
-// Remove a stream
-void TeeStreamBuf::remove_stream(std::ostream& stream) {
-    std::unique_lock<std::shared_mutex> lock(streams_mutex);
-    streams.erase(
-        std::remove_if(streams.begin(), streams.end(),
-            [&stream](const std::reference_wrapper<std::ostream>& ref) {
-                return &ref.get() == &stream;
+// Enabling, removal and level changes race without a common lock, so a stream's count
+// moves by compare-and-swap: whichever thread changed an input last leaves the stream
+// counted where its inputs say
+void TeeStreamBuf::recount_sink(Sink& sink) {
+    for (;;) {
+        int counted = sink.counted_level.load();
+        int wanted = sink.enabled.load() ? sink.listed_level.load() : -1;
+        if (counted == wanted) {
+            break;
+        }
+        if (sink.counted_level.compare_exchange_weak(counted, wanted)) {
+            if (counted >= 0) {
+                level_streams[static_cast<size_t>(counted)].fetch_sub(1);
             }
-        ),
-        streams.end()
-    );
+            if (wanted >= 0) {
+                level_streams[static_cast<size_t>(wanted)].fetch_add(1);
+            }
+        }
+    }
+    update_write_level();
 }
 
-// Flush the thread-local buffer
-void TeeStreamBuf::flush_thread_buffer() {
+// Recompute the lowest level a statement is written at. A thread storing a level computed
+// from counts another thread has since changed sees the change when it checks again.
+void TeeStreamBuf::update_write_level() {
+    auto compute = [this]() {
+        int lowest = kNoStreams;
+        for (size_t i = 0; i < level_streams.size(); i++) {
+            if (level_streams[i].load() > 0) {
+                lowest = static_cast<int>(i);
+                break;
+            }
+        }
+        return std::max(lowest, static_cast<int>(level.load()));
+    };
+    for (int wanted = compute(), now;; wanted = now) {
+        write_level.store(wanted);
+        now = compute();
+        if (now == wanted) {
+            break;
+        }
+    }
+}
+
+// Pre-allocate pooled buffers for `thread_count` threads
+void TeeStreamBuf::warm_up(size_t thread_count) {
+    BufferPool::warm_up(buffer_size, thread_count);
+}
+
+// Write a payload without copying it, releasing it once every stream is done
+bool TeeStreamBuf::write_borrowed(const char* data, size_t size, std::function<void()> on_release) {
+    // With no enabled stream the payload goes nowhere, and is released right away
+    if (!has_enabled_streams()) {
+        if (on_release) {
+            on_release();
+        }
+        return true;
+    }
+
     auto tb = get_thread_buffer();
-    
-    // Nothing to flush
-    if (tb->used == 0) {
-        return;
+    begin_text(tb);
+    bool prefixed = timestamps.load(std::memory_order_relaxed) && size > 0;
+
+    // An open record is completed by copying, so records are still never torn
+    if (record_atomic.load(std::memory_order_relaxed) && tb->used > tb->record_end) {
+        if (prefixed) {
+            append_prefixed(tb, data, size);
+        } else {
+            append_record_data(tb, data, size);
+        }
+        if (on_release) {
+            on_release();
+        }
+        return true;
+    }
+
+    // A payload that starts a line gets a timestamp, which goes out with it as the head of
+    // its chunk, so no other write comes between them; lines inside it get none
+    std::string head;
+    if (prefixed) {
+        if (tb->line_start) {
+            char prefix[TimestampPrefix::kMaxSize];
+            head.assign(prefix, format_prefix(prefix));
+        }
+        tb->line_start = data[size - 1] == '\n';
     }
 
-    // Make a copy of the buffer data to avoid holding the lock while writing
-    std::unique_ptr<char[]> buffer_copy = std::make_unique<char[]>(tb->used);
-    size_t buffer_size = tb->used;
-    
-    // Copy the data
-    memcpy(buffer_copy.get(), tb->buffer.get(), buffer_size);
-    
-    // Reset the buffer before we start writing to streams
-    tb->used = 0;
+    // Everything written earlier goes first
+    flush_range(tb, tb->used);
 
-    // Take a shared lock to read the streams (allows multiple threads to flush simultaneously)
-    std::shared_lock<std::shared_mutex> lock(streams_mutex);
+    // The payload continues the record open in the buffer, or starts one with the head
+    std::vector<RecordMark> marks{tb->marks.back()};
+    marks[0].prefix = static_cast<uint16_t>(head.size());
+    if (size > 0) {
+        tb->record_open = data[size - 1] != '\n';
+    }
+
+    // The chunk releases the payload when the last queue drops it, or right here
+    // if no stream queues it
+    size_t head_size = head.size();
+    auto chunk = std::make_shared<Chunk>(data, size, std::move(on_release), std::move(head));
+    attach_marks(*chunk, marks, head_size + size);
+    return write_to_streams(data, size, marks, nullptr, chunk);
+}
+
+bool TeeStreamBuf::write_borrowed(std::string&& data) {
+    auto owned = std::make_shared<std::string>(std::move(data));
+    return write_borrowed(owned->data(), owned->size(), [owned]() {});
+}
+
+bool TeeStreamBuf::write_borrowed(std::vector<char>&& data) {
+    auto owned = std::make_shared<std::vector<char>>(std::move(data));
+    return write_borrowed(owned->data(), owned->size(), [owned]() {});
+}
+
+// Enable or disable record-atomic mode
+void TeeStreamBuf::set_record_atomic(bool enabled) {
+    record_atomic.store(enabled, std::memory_order_relaxed);
+}
+
+bool TeeStreamBuf::is_record_atomic() const {
+    return record_atomic.load(std::memory_order_relaxed);
+}
+
+// Mark the end of a logical record
+void TeeStreamBuf::end_record() {
+    auto tb = get_thread_buffer();
+    tb->record_end = tb->used;
+    tb->record_open = false;
+    begin_buffer_kind(tb, tb->deferred);
+
+    if (tb->used >= tb->threshold) {
+        flush_range(tb, tb->record_end);
+    }
+}
 
-    // Make sure there are streams to write to
-    if (!streams.empty()) {
-        // Write to each stream
-        for (auto& stream_ref : streams) {
-            std::ostream& stream = stream_ref.get();
-            stream.write(buffer_copy.get(), buffer_size);
+// Enable adaptive buffer sizing
+void TeeStreamBuf::enable_adaptive_sizing(const AdaptiveSizingPolicy& policy) {
+    {
+        std::lock_guard<std::mutex> lock(adaptive_mutex);
+        adaptive_policy = policy;
+
+        // Validate parameters
+        if (adaptive_policy.min_buffer_size == 0) {
+            adaptive_policy.min_buffer_size = 1;
+        }
+        if (adaptive_policy.max_buffer_size < adaptive_policy.min_buffer_size) {
+            adaptive_policy.max_buffer_size = adaptive_policy.min_buffer_size;
+        }
+        if (adaptive_policy.threshold_ratio <= 0.0 || adaptive_policy.threshold_ratio > 1.0) {
+            adaptive_policy.threshold_ratio = 0.75;
+        }
+        if (adaptive_policy.sample_flushes == 0) {
+            adaptive_policy.sample_flushes = 1;
         }
+        sample_flushes.store(adaptive_policy.sample_flushes, std::memory_order_relaxed);
+    }
+    adaptive_sizing.store(true, std::memory_order_relaxed);
+}
+
+// Disable adaptive buffer sizing; buffers keep their current sizes
+void TeeStreamBuf::disable_adaptive_sizing() {
+    adaptive_sizing.store(false, std::memory_order_relaxed);
+}
+
+bool TeeStreamBuf::is_adaptive_sizing() const {
+    return adaptive_sizing.load(std::memory_order_relaxed);
+}
+
+// Buffer sizes and counters for every thread with a buffer
+std::vector<ThreadBufferStats> TeeStreamBuf::thread_buffer_stats() const {
+    std::vector<ThreadBufferStats> stats;
+
+    std::lock_guard<std::mutex> lock(registry->mutex);
+    stats.reserve(registry->buffers.size());
+    for (auto& tb : registry->buffers) {
+        stats.push_back({
+            tb->thread,
+            tb->stat_size.load(std::memory_order_relaxed),
+            tb->stat_threshold.load(std::memory_order_relaxed),
+            tb->stat_flushes.load(std::memory_order_relaxed),
+            tb->stat_bytes.load(std::memory_order_relaxed)
+        });
     }
+
+    return stats;
 }
 
 // Handle single character overflow
@@ -98,69 +2999,222 @@ std::streamsize TeeStreamBuf::xsputn(const char* s, std::streamsize n) {
         return 0;
     }
 
+    // With no enabled stream, text goes nowhere; it is dropped before it is buffered
+    if (write_level.load(std::memory_order_relaxed) == kNoStreams) {
+        return n;
+    }
+
     auto tb = get_thread_buffer();
+    begin_text(tb);
+
+    bool written = timestamps.load(std::memory_order_relaxed)
+        ? append_prefixed(tb, s, static_cast<size_t>(n))
+        : append_text(tb, s, static_cast<size_t>(n));
+    return written ? n : 0;
+}
 
-    // If n is larger than our buffer, write directly to streams
-    if (static_cast<size_t>(n) >= tb->size) {
-        // Take a shared lock to read the streams
-        std::shared_lock<std::shared_mutex> lock(streams_mutex);
+// Buffer text for a writer that must not wait
+bool TeeStreamBuf::try_write(const char* s, size_t n) {
+    return try_write_to(get_thread_buffer(), s, n);
+}
 
-        bool all_good = true;
-        for (auto& stream_ref : streams) {
-            std::ostream& stream = stream_ref.get();
-            if (!stream.write(s, n)) {
-                all_good = false;
-            }
+// Buffer text for a writer that must not wait and may go on from another thread
+bool TeeStreamBuf::try_write_shared(const char* s, size_t n) {
+    std::lock_guard<std::mutex> lock(shared_buffer_mutex);
+    if (!shared_buffer) {
+        shared_buffer = std::make_shared<ThreadBuffer>(buffer_size, flush_threshold);
+        std::lock_guard<std::mutex> registry_lock(registry->mutex);
+        registry->buffers.push_back(shared_buffer);
+    }
+    return try_write_to(shared_buffer.get(), s, n);
+}
+
+// Flush the shared buffer without waiting
+bool TeeStreamBuf::try_flush_shared() {
+    NonblockingScope scope;
+    return flush_shared_buffer();
+}
+
+// Buffer text in a given buffer without waiting
+bool TeeStreamBuf::try_write_to(ThreadBuffer* tb, const char* s, size_t n) {
+    NonblockingScope scope;
+
+    // Filling the buffer flushes it, and a full queue would make this thread wait for
+    // room. Whatever is flushed here is queued over the capacity instead.
+    if (tb->used + n >= tb->threshold && backpressured()) {
+        flush_range(tb, tb->record_end);
+        return false;
+    }
+
+    // Room for all of the text, with a timestamp per line, is made first, so the budget
+    // refuses it whole rather than after part of it is buffered
+    bool prefixed = timestamps.load(std::memory_order_relaxed);
+    size_t needed = n;
+    if (prefixed) {
+        size_t lines = 1;
+        const char* end = s + n;
+        for (const char* at = s; (at = static_cast<const char*>(memchr(at, '\n', static_cast<size_t>(end - at))));) {
+            lines++;
+            at++;
         }
-        
-        return all_good ? n : 0;
+        needed += lines * TimestampPrefix::kMaxSize;
+    }
+    if (!make_room(tb, needed, true)) {
+        return false;
+    }
+
+    begin_text(tb);
+    return prefixed ? append_prefixed(tb, s, n) : append_text(tb, s, n);
+}
+
+// Append text to a buffer
+bool TeeStreamBuf::append_text(ThreadBuffer* tb, const char* s, size_t n) {
+    if (n > 0) {
+        tb->record_open = s[n - 1] != '\n';
+    }
+
+    // Records are never split, so they are buffered whole regardless of size
+    if (record_atomic.load(std::memory_order_relaxed) || nonblocking) {
+        return append_record_data(tb, s, n);
     }
 
     // If adding n would overflow the buffer, flush first
     if (tb->used + n > tb->size) {
-        flush_thread_buffer();
+        flush_range(tb, tb->used);
+    }
+
+    // If n is larger than our buffer, write directly to streams (the buffer is empty by now)
+    if (n >= tb->size) {
+        return write_to_streams(s, n, tb->marks);
     }
 
     // Copy to the thread-local buffer
-    memcpy(tb->buffer.get() + tb->used, s, static_cast<size_t>(n));
+    memcpy(tb->buffer.data() + tb->used, s, n);
     tb->used += n;
 
     // Auto-flush if we're above the threshold
-    if (tb->used >= flush_threshold) {
-        flush_thread_buffer();
+    if (tb->used >= tb->threshold) {
+        flush_range(tb, tb->used);
     }
 
-    return n;
+    return true;
 }
 
-// Sync/flush the buffer
-int TeeStreamBuf::sync() {
-    flush_thread_buffer();
-    
+// Append text with a timestamp before every line
+bool TeeStreamBuf::append_prefixed(ThreadBuffer* tb, const char* s, size_t n) {
+    bool all_good = true;
+    while (n > 0) {
+        if (tb->line_start) {
+            char prefix[TimestampPrefix::kMaxSize];
+            size_t prefix_size = format_prefix(prefix);
+            begin_prefixed_line(tb, prefix_size);
+
+            // The threshold is checked after the line, so no flush separates it from its prefix
+            if (record_atomic.load(std::memory_order_relaxed) || nonblocking || prefix_size >= tb->size) {
+                all_good = append_text(tb, prefix, prefix_size) && all_good;
+            } else {
+                if (tb->used + prefix_size > tb->size) {
+                    flush_range(tb, tb->used);
+                }
+                memcpy(tb->buffer.data() + tb->used, prefix, prefix_size);
+                tb->used += prefix_size;
+                tb->record_open = true;
+            }
+            tb->line_start = false;
+        }
+
+        const char* newline = static_cast<const char*>(memchr(s, '\n', n));
+        size_t line = newline ? static_cast<size_t>(newline - s) + 1 : n;
+        all_good = append_text(tb, s, line) && all_good;
+        tb->line_start = newline != nullptr;
+        s += line;
+        n -= line;
+    }
+    return all_good;
+}
+
+// Format this tee's timestamp prefix
+size_t TeeStreamBuf::format_prefix(char* out) const {
+    TimestampOptions options;
+    options.fraction_digits = timestamp_digits.load(std::memory_order_relaxed);
+    options.utc = timestamp_utc.load(std::memory_order_relaxed);
+    options.clock = timestamp_clock.load(std::memory_order_relaxed);
+    return TimestampPrefix::format(out, options);
+}
+
+// Start every line of text with a timestamp
+void TeeStreamBuf::enable_timestamps(const TimestampOptions& options) {
+    timestamp_digits.store(options.fraction_digits, std::memory_order_relaxed);
+    timestamp_utc.store(options.utc, std::memory_order_relaxed);
+    timestamp_clock.store(options.clock, std::memory_order_relaxed);
+    timestamps.store(true, std::memory_order_relaxed);
+}
+
+void TeeStreamBuf::disable_timestamps() {
+    timestamps.store(false, std::memory_order_relaxed);
+}
+
+bool TeeStreamBuf::has_timestamps() const {
+    return timestamps.load(std::memory_order_relaxed);
+}
+
+// Sync every stream
+int TeeStreamBuf::sync_streams() {
     // Take a shared lock to read the streams
     std::shared_lock<std::shared_mutex> lock(streams_mutex);
-    
+
     bool all_good = true;
-    for (auto& stream_ref : streams) {
-        std::ostream& stream = stream_ref.get();
-        if (stream.rdbuf()->pubsync() == -1) {
+    for (auto& sink : streams) {
+        SinkUse use(*sink);
+        if (!use) {
+            continue;
+        }
+
+        // Queued streams are synced by their writer once the queue is written
+        if (sink->queue) {
+            {
+                std::lock_guard<std::mutex> queue_lock(sink->queue->mutex);
+                sink->queue->sync_requested = true;
+            }
+            sink->queue->not_empty.notify();
+            continue;
+        }
+
+        std::shared_lock<std::shared_mutex> stream_alive;
+        if (!hold_stream(*sink, stream_alive)) {
+            continue;
+        }
+        std::lock_guard<std::mutex> sink_lock(sink->mutex);
+        if (!write_pending(*sink) || sink->stream.rdbuf()->pubsync() == -1) {
             all_good = false;
         }
     }
-    
+
     return all_good ? 0 : -1;
 }
 
+// Sync/flush the buffer
+int TeeStreamBuf::sync() {
+    flush_thread_buffer();
+    flush_shared_buffer();
+    return sync_streams();
+}
+
 // TeeStream implementation
 
 // Constructor
-TeeStream::TeeStream(size_t buffer_size, size_t flush_threshold)
+TeeStream::basic_TeeStream(size_t buffer_size, size_t flush_threshold)
     : std::ostream(&buffer), buffer(buffer_size, flush_threshold) {
 }
 
 // Add a stream
-void TeeStream::add_stream(std::ostream& stream) {
-    buffer.add_stream(stream);
+SinkHandle TeeStream::add_stream(std::ostream& stream, SinkFormat format) {
+    return buffer.add_stream(stream, format);
+}
+
+// Add a stream with options
+SinkHandle TeeStream::add_stream(std::ostream& stream, const SinkOptions& options) {
+    return buffer.add_stream(stream, options);
 }
 
 // Remove a stream
@@ -171,4 +3225,314 @@ void TeeStream::remove_stream(std::ostream& stream) {
 // Flush the thread-local buffer
 void TeeStream::flush_thread_buffer() {
     buffer.flush_thread_buffer();
-} 
\ No newline at end of file
+}
+
+// Start a record with metadata
+void TeeStream::begin_record(int level, const char* tag) {
+    buffer.begin_record(level, tag);
+}
+
+// Set the level for leveled statements
+void TeeStream::set_level(LogLevel level) {
+    buffer.set_level(level);
+}
+
+LogLevel TeeStream::get_level() const {
+    return buffer.get_level();
+}
+
+// Pre-allocate pooled buffers for `thread_count` threads
+void TeeStream::warm_up(size_t thread_count) {
+    buffer.warm_up(thread_count);
+}
+
+// Get space for `n` bytes in the calling thread's buffer
+char* TeeStream::reserve(size_t n) {
+    return buffer.reserve(n);
+}
+
+// Commit bytes written into the reserved space
+void TeeStream::commit(size_t n) {
+    buffer.commit(n);
+}
+
+// Write a payload without copying it
+void TeeStream::write_borrowed(const char* data, size_t size, std::function<void()> on_release) {
+    if (!buffer.write_borrowed(data, size, std::move(on_release))) {
+        setstate(std::ios::badbit);
+    }
+}
+
+void TeeStream::write_borrowed(std::string&& data) {
+    if (!buffer.write_borrowed(std::move(data))) {
+        setstate(std::ios::badbit);
+    }
+}
+
+void TeeStream::write_borrowed(std::vector<char>&& data) {
+    if (!buffer.write_borrowed(std::move(data))) {
+        setstate(std::ios::badbit);
+    }
+}
+
+// Enable or disable record-atomic mode
+void TeeStream::set_record_atomic(bool enabled) {
+    buffer.set_record_atomic(enabled);
+}
+
+bool TeeStream::is_record_atomic() const {
+    return buffer.is_record_atomic();
+}
+
+// Mark the end of a logical record
+void TeeStream::end_record() {
+    buffer.end_record();
+}
+
+// Enable adaptive buffer sizing
+void TeeStream::enable_adaptive_sizing(const AdaptiveSizingPolicy& policy) {
+    buffer.enable_adaptive_sizing(policy);
+}
+
+// Disable adaptive buffer sizing
+void TeeStream::disable_adaptive_sizing() {
+    buffer.disable_adaptive_sizing();
+}
+
+bool TeeStream::is_adaptive_sizing() const {
+    return buffer.is_adaptive_sizing();
+}
+
+// Buffer sizes and counters for every thread with a buffer
+std::vector<ThreadBufferStats> TeeStream::thread_buffer_stats() const {
+    return buffer.thread_buffer_stats();
+}
+
+// Enable async mode
+void TeeStream::enable_async(size_t queue_capacity) {
+    buffer.enable_async(queue_capacity);
+}
+
+// Disable async mode
+void TeeStream::disable_async() {
+    buffer.disable_async();
+}
+
+bool TeeStream::is_async() const {
+    return buffer.is_async();
+}
+
+// True while any stream queue is full
+bool TeeStream::backpressured() const {
+    return buffer.backpressured();
+}
+
+// Call back once no stream queue is full
+bool TeeStream::notify_when_writable(std::function<void()> callback) {
+    return buffer.notify_when_writable(std::move(callback));
+}
+
+// Call back once everything queued so far has been written
+bool TeeStream::notify_when_drained(std::function<void()> callback) {
+    return buffer.notify_when_drained(std::move(callback));
+}
+
+bool TeeStream::try_write(const char* s, std::streamsize n) {
+    return n <= 0 || buffer.try_write(s, static_cast<size_t>(n));
+}
+
+bool TeeStream::try_write_shared(const char* s, std::streamsize n) {
+    return n <= 0 || buffer.try_write_shared(s, static_cast<size_t>(n));
+}
+
+bool TeeStream::try_flush_shared() {
+    return buffer.try_flush_shared();
+}
+
+// Block until everything queued so far has been written
+void TeeStream::drain() {
+    buffer.drain();
+}
+
+// Choose how background writers wait for data
+void TeeStream::set_wakeup_mode(WakeupMode mode, unsigned spin_iterations) {
+    buffer.set_wakeup_mode(mode, spin_iterations);
+}
+
+WakeupMode TeeStream::get_wakeup_mode() const {
+    return buffer.get_wakeup_mode();
+}
+
+// Bytes dropped because the memory budget was reached
+uint64_t TeeStream::dropped_bytes() const {
+    return buffer.dropped_bytes();
+}
+
+void TeeStream::enable_timestamps(const TimestampOptions& options) {
+    buffer.enable_timestamps(options);
+}
+
+void TeeStream::disable_timestamps() {
+    buffer.disable_timestamps();
+}
+
+bool TeeStream::has_timestamps() const {
+    return buffer.has_timestamps();
+}
+
+// Instantiations for the other character types
+
+template class basic_TeeStreamBuf<wchar_t>;
+template class basic_TeeStream<wchar_t>;
+
+#if defined(__cpp_char8_t)
+template class basic_TeeStreamBuf<char8_t>;
+template class basic_TeeStream<char8_t>;
+#endif
+
+// TeeJsonRecord implementation
+
+TeeJsonRecord::TeeJsonRecord(TeeStream& tee) : writer(tee, 256), muted(!tee.has_enabled_streams()) {
+    if (!muted) {
+        writer.append("{", 1);
+    }
+}
+
+// Close the object and the line
+TeeJsonRecord::~TeeJsonRecord() {
+    if (!muted) {
+        writer.append("}\n", 2);
+    }
+}
+
+// Write the separator and the quoted key
+void TeeJsonRecord::key(std::string_view name) {
+    if (!first) {
+        writer.append(",", 1);
+    }
+    first = false;
+    string(name);
+    writer.append(":", 1);
+}
+
+// Write a quoted, escaped string
+void TeeJsonRecord::string(std::string_view value) {
+    static const char hex[] = "0123456789abcdef";
+
+    writer.append("\"", 1);
+    const char* s = value.data();
+    size_t n = value.size();
+    while (n > 0) {
+        size_t plain = plain_length(s, n);
+        writer.append(s, plain);
+        s += plain;
+        n -= plain;
+        if (n == 0) {
+            break;
+        }
+
+        char escape[6] = {'\\', 0, 0, 0, 0, 0};
+        size_t size = 2;
+        unsigned char c = static_cast<unsigned char>(*s);
+        switch (c) {
+            case '"': escape[1] = '"'; break;
+            case '\\': escape[1] = '\\'; break;
+            case '\n': escape[1] = 'n'; break;
+            case '\r': escape[1] = 'r'; break;
+            case '\t': escape[1] = 't'; break;
+            case '\b': escape[1] = 'b'; break;
+            case '\f': escape[1] = 'f'; break;
+            default:
+                memcpy(escape + 1, "u00", 3);
+                escape[4] = hex[c >> 4];
+                escape[5] = hex[c & 0xF];
+                size = 6;
+                break;
+        }
+        writer.append(escape, size);
+        s++;
+        n--;
+    }
+    writer.append("\"", 1);
+}
+
+TeeJsonRecord& TeeJsonRecord::field(std::string_view name, std::string_view value) {
+    if (muted) {
+        return *this;
+    }
+    key(name);
+    string(value);
+    return *this;
+}
+
+TeeJsonRecord& TeeJsonRecord::field(std::string_view name, const char* value) {
+    if (!value) {
+        return field(name, nullptr);
+    }
+    return field(name, std::string_view(value));
+}
+
+TeeJsonRecord& TeeJsonRecord::field(std::string_view name, char value) {
+    return field(name, std::string_view(&value, 1));
+}
+
+TeeJsonRecord& TeeJsonRecord::field(std::string_view name, bool value) {
+    if (muted) {
+        return *this;
+    }
+    key(name);
+    writer.append(value ? "true" : "false", value ? 4 : 5);
+    return *this;
+}
+
+TeeJsonRecord& TeeJsonRecord::field(std::string_view name, std::nullptr_t) {
+    if (muted) {
+        return *this;
+    }
+    key(name);
+    writer.append("null", 4);
+    return *this;
+}
+
+// Find the first quote, backslash or control character, 32 or 16 bytes at a time
+size_t TeeJsonRecord::plain_length(const char* s, size_t n) {
+    size_t i = 0;
+#if defined(__AVX2__)
+    const __m256i quote32 = _mm256_set1_epi8('"');
+    const __m256i backslash32 = _mm256_set1_epi8('\\');
+    const __m256i control32 = _mm256_set1_epi8(0x1F);
+    for (; i + 32 <= n; i += 32) {
+        __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s + i));
+        // max(c, 0x1F) == 0x1F exactly for the control characters, as an unsigned compare
+        __m256i special = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(chunk, quote32), _mm256_cmpeq_epi8(chunk, backslash32)),
+            _mm256_cmpeq_epi8(_mm256_max_epu8(chunk, control32), control32));
+        uint32_t mask = static_cast<uint32_t>(_mm256_movemask_epi8(special));
+        if (mask != 0) {
+            return i + static_cast<size_t>(__builtin_ctz(mask));
+        }
+    }
+#endif
+#if defined(__SSE2__)
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i control = _mm_set1_epi8(0x1F);
+    for (; i + 16 <= n; i += 16) {
+        __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i));
+        __m128i special = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(chunk, quote), _mm_cmpeq_epi8(chunk, backslash)),
+            _mm_cmpeq_epi8(_mm_max_epu8(chunk, control), control));
+        uint32_t mask = static_cast<uint32_t>(_mm_movemask_epi8(special));
+        if (mask != 0) {
+            return i + static_cast<size_t>(__builtin_ctz(mask));
+        }
+    }
+#endif
+    for (; i < n; i++) {
+        unsigned char c = static_cast<unsigned char>(s[i]);
+        if (c < 0x20 || c == '"' || c == '\\') {
+            break;
+        }
+    }
+    return i;
+}
@@ -1,11 +1,14 @@
 #include "TeeStream.h"
 
 #include <chrono>
+#include <condition_variable>
+#include <cstdio>
 #include <cstring>
 #include <future>
 #include <iomanip>
 #include <limits>
 #include <random>
+#include <regex>
 #include <sstream>
 #include <thread>
 #include <vector>
@@ -215,13 +218,48 @@ TEST(TeeStreamTest, FileStreams) {
 
 // Test empty stream list
 TEST(TeeStreamTest, EmptyStreamList) {
+    std::ostringstream stream;  // Outlives the tee, which syncs it when destroyed
     TeeStream tee;
     
+    // Leveled statements with no streams are skipped before anything is buffered, and
+    // so is plain text
+    TEE_INFO(tee) << "Not buffered" << std::endl;
+    tee << "Not buffered either " << 42 << '\n';
+    tee.write("raw", 3);
+    EXPECT_TRUE(tee.thread_buffer_stats().empty());
+
+    // So is what the formatting extensions and zero-copy writes produce
+    auto write_everything = [&tee]() {
+        tee.print(TEE_FMT("{} and {}\n"), 1, 2);
+        tee.print_deferred("{}\n", 3);
+        tee.fast() << 4 << ' ' << 5.5 << '\n';
+        tee.record().field("six", 6).field("seven", "7");
+        EXPECT_EQ(nullptr, tee.reserve(16));
+        bool released = false;
+        tee.write_borrowed("eight\n", 6, [&released]() { released = true; });
+        EXPECT_TRUE(released);
+        tee.write_borrowed(std::string("nine\n"));
+    };
+    write_everything();
+    EXPECT_TRUE(tee.thread_buffer_stats().empty());
+
     // Writing to a TeeStream with no streams should not crash
     EXPECT_NO_THROW({
         tee << "This should not crash" << std::endl;
         tee.flush_thread_buffer();
     });
+
+    // The same holds while every stream is disabled
+    SinkHandle handle = tee.add_stream(stream);
+    handle.disable();
+    tee << "muted\n";
+    write_everything();
+    tee.flush();
+    EXPECT_EQ(0u, tee.thread_buffer_stats()[0].bytes_flushed);
+    handle.enable();
+    tee << "written\n";
+    tee.flush();
+    EXPECT_EQ("written\n", stream.str());
 }
 
 // Test with very large data
@@ -463,6 +501,140 @@ TEST(TeeStreamTest, DynamicStreamManagement) {
     EXPECT_EQ("First line\nSecond line\n", stream1.str());
     EXPECT_EQ("Second line\nThird line\n", stream2.str());
     EXPECT_EQ("Third line\n", stream3.str());
+
+    // A handle pauses and removes its stream
+    std::ostringstream stream4;
+    SinkHandle handle = tee.add_stream(stream4);
+    handle.disable();
+    tee << "Muted line" << std::endl;
+    EXPECT_FALSE(handle.is_enabled());
+    handle.enable();
+    tee << "Fourth line" << std::endl;
+    EXPECT_TRUE(handle);
+    EXPECT_TRUE(handle.remove());
+    EXPECT_FALSE(handle);
+    EXPECT_FALSE(handle.remove());
+    tee << "Fifth line" << std::endl;
+    EXPECT_EQ("Fourth line\n", stream4.str());
+    EXPECT_EQ("Second line\nThird line\nMuted line\nFourth line\nFifth line\n", stream2.str());
+
+    // Removing a stream keeps the others in order, by handle or by reference
+    {
+        // Each stream notes its name in a shared log when it is written to
+        struct NamedBuf : std::streambuf {
+            std::string& log;
+            char name;
+            NamedBuf(std::string& log, char name) : log(log), name(name) {}
+            std::streamsize xsputn(const char*, std::streamsize n) override {
+                log += name;
+                return n;
+            }
+        };
+        std::string log;
+        NamedBuf buf_a(log, 'a'), buf_b(log, 'b'), buf_c(log, 'c'), buf_d(log, 'd');
+        std::ostream a(&buf_a), b(&buf_b), c(&buf_c), d(&buf_d);
+        TeeStream ordered;
+        ordered.add_stream(a);
+        SinkHandle b_handle = ordered.add_stream(b);
+        ordered.add_stream(c);
+        ordered.add_stream(d);
+        ordered << "x" << std::flush;
+        EXPECT_EQ("abcd", log);
+        b_handle.remove();
+        ordered << "x" << std::flush;
+        EXPECT_EQ("abcdacd", log);
+        ordered.remove_stream(a);
+        ordered << "x" << std::flush;
+        EXPECT_EQ("abcdacdcd", log);
+
+        // Emptied slots are compacted away without reordering what is left
+        std::ostringstream extra;
+        for (int i = 0; i < 8; i++) {
+            ordered.add_stream(extra).remove();
+        }
+        ordered.add_stream(b);
+        ordered.remove_stream(c);
+        ordered << "x" << std::flush;
+        EXPECT_EQ("abcdacdcddb", log);
+    }
+
+    // A level that only disabled streams take is skipped at the call site
+    {
+        std::ostringstream all_stream, warn_stream;
+        TeeStream leveled;
+        SinkHandle all_handle = leveled.add_stream(all_stream);
+        SinkOptions warn;
+        warn.min_level = LogLevel::Warn;
+        leveled.add_stream(warn_stream, warn);
+        EXPECT_TRUE(leveled.is_level_enabled(LogLevel::Debug));
+        all_handle.disable();
+        EXPECT_FALSE(leveled.is_level_enabled(LogLevel::Debug));
+        EXPECT_TRUE(leveled.is_level_enabled(LogLevel::Warn));
+        all_handle.set_min_level(LogLevel::Info);
+        EXPECT_FALSE(leveled.is_level_enabled(LogLevel::Info));
+        all_handle.enable();
+        EXPECT_TRUE(leveled.is_level_enabled(LogLevel::Info));
+        EXPECT_FALSE(leveled.is_level_enabled(LogLevel::Debug));
+        all_handle.disable();
+        EXPECT_TRUE(all_handle.remove());
+        all_handle.enable();
+        EXPECT_FALSE(leveled.is_level_enabled(LogLevel::Info));
+    }
+
+    // Streams are muted, re-leveled, added and removed while threads write to the tee
+    std::ostringstream always, toggled;
+    {
+        TeeStream loaded(64, 32);
+        loaded.set_record_atomic(true);
+        loaded.add_stream(always);
+        SinkHandle toggled_handle = loaded.add_stream(toggled);
+
+        const int num_threads = 4;
+        const int iterations = 2000;
+        std::atomic<int> running(num_threads);
+        std::vector<std::thread> threads;
+        for (int t = 0; t < num_threads; t++) {
+            threads.emplace_back([&loaded, &running, t]() {
+                for (int i = 0; i < iterations; i++) {
+                    TEE_INFO(loaded) << "Thread " << t << " line " << i << '\n';
+                }
+                running--;
+            });
+        }
+
+        for (int round = 0; running > 0; round++) {
+            toggled_handle.disable();
+            toggled_handle.enable();
+            toggled_handle.set_min_level(round % 2 ? LogLevel::Warn : LogLevel::Trace);
+
+            std::ostringstream scratch;
+            SinkHandle scratch_handle = loaded.add_stream(scratch);
+            scratch_handle.remove();
+        }
+        for (auto& t : threads) {
+            t.join();
+        }
+        toggled_handle.set_min_level(LogLevel::Trace);
+        loaded << "done\n";
+        EXPECT_TRUE(toggled_handle);
+    }
+
+    auto count_lines = [](const std::string& text) {
+        std::istringstream lines(text);
+        std::string line;
+        int count = 0;
+        while (std::getline(lines, line)) {
+            int thread_id = -1, iteration = -1;
+            if (line != "done") {
+                EXPECT_EQ(2, std::sscanf(line.c_str(), "Thread %d line %d", &thread_id, &iteration)) << line;
+            }
+            count++;
+        }
+        return count;
+    };
+    EXPECT_EQ(4 * 2000 + 1, count_lines(always.str()));
+    EXPECT_LE(count_lines(toggled.str()), 4 * 2000 + 1);
+    EXPECT_EQ("done\n", toggled.str().substr(toggled.str().size() - 5));
 }
 
 // Test with a failing stream
@@ -498,6 +670,1791 @@ TEST(TeeStreamTest, FailingStream) {
     EXPECT_EQ("This should not crash\n", good_stream.str());
 }
 
+// Test that record-atomic mode never tears lines between threads
+TEST(TeeStreamTest, RecordAtomicMultithreaded) {
+    std::ostringstream stream1, stream2;
+
+    // Small buffer so threshold flushes happen in the middle of lines
+    TeeStream tee(64, 32);
+    tee.set_record_atomic(true);
+    EXPECT_TRUE(tee.is_record_atomic());
+
+    tee.add_stream(stream1);
+    tee.add_stream(stream2);
+
+    const int num_threads = 8;
+    const int iterations = 200;
+
+    // No external mutex: each line is written in several pieces
+    auto thread_func = [&tee](int thread_id) {
+        for (int i = 0; i < iterations; i++) {
+            tee << "Thread " << thread_id << " iteration " << i << " payload " << std::string(20, 'x') << '\n';
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (int i = 0; i < num_threads; i++) {
+        threads.emplace_back(thread_func, i);
+    }
+
+    for (auto& t : threads) {
+        t.join();
+    }
+
+    // Every line must be complete
+    std::istringstream lines(stream1.str());
+    std::string line;
+    int line_count = 0;
+    while (std::getline(lines, line)) {
+        int thread_id = -1, iteration = -1;
+        char payload[32] = {};
+        ASSERT_EQ(3, std::sscanf(line.c_str(), "Thread %d iteration %d payload %31s", &thread_id, &iteration, payload)) << line;
+        EXPECT_EQ(std::string(20, 'x'), payload);
+        line_count++;
+    }
+
+    EXPECT_EQ(num_threads * iterations, line_count);
+    EXPECT_EQ(stream1.str().size(), stream2.str().size());
+}
+
+// Test that partial records stay buffered until they are completed
+TEST(TeeStreamTest, RecordAtomicPartialRecords) {
+    std::ostringstream stream;
+    TeeStream tee(16, 8);
+    tee.set_record_atomic(true);
+    tee.add_stream(stream);
+
+    // A record larger than the buffer is not split
+    tee << "This string is longer than 16 bytes";
+    tee.flush_thread_buffer();
+    EXPECT_EQ("", stream.str());
+
+    tee << " and ends here" << std::endl;
+    EXPECT_EQ("This string is longer than 16 bytes and ends here\n", stream.str());
+
+    // Only complete records are flushed
+    tee << "one\ntw";
+    tee.flush();
+    EXPECT_EQ("This string is longer than 16 bytes and ends here\none\n", stream.str());
+
+    // end_record() closes a record without a newline
+    tee << "o|three|";
+    tee.end_record();
+    tee.flush_thread_buffer();
+    EXPECT_EQ("This string is longer than 16 bytes and ends here\none\ntwo|three|", stream.str());
+
+    // The start of the next record does not cut the line it goes on in
+    tee << "four|";
+    tee.begin_record(0);
+    tee << "fi";
+    tee.flush();
+    EXPECT_EQ("This string is longer than 16 bytes and ends here\none\ntwo|three|", stream.str());
+    tee << "ve\n";
+    tee.flush();
+    EXPECT_EQ("This string is longer than 16 bytes and ends here\none\ntwo|three|four|five\n", stream.str());
+
+    // Neither does the end of a leveled statement, so other threads' lines go around it
+    std::ostringstream lines;
+    {
+        TeeStream leveled;
+        leveled.set_record_atomic(true);
+        leveled.add_stream(lines);
+        TEE_INFO(leveled) << "start of a line, ";
+        leveled.flush_thread_buffer();
+        std::thread([&leveled]() {
+            leveled << "other thread\n";
+            leveled.flush_thread_buffer();
+        }).join();
+        TEE_INFO(leveled) << "end of it\n";
+        leveled.flush_thread_buffer();
+    }
+    EXPECT_EQ("other thread\nstart of a line, end of it\n", lines.str());
+
+    // Stream filters go by the same boundaries, and text and deferred records sharing a
+    // line are one record
+    std::ostringstream all, headers;
+    {
+        TeeStream records;
+        records.set_record_atomic(true);
+        records.add_stream(all);
+        SinkOptions header_only;
+        header_only.match = {"HDR"};
+        records.add_stream(headers, header_only);
+
+        records << "HDR|a|";
+        records.end_record();
+        records << "b|c|";
+        records.end_record();
+        records << "HDR ";
+        records.print_deferred("{} of {}\n", 3, 4);
+        records.print_deferred("{} of {}\n", 4, 4);
+        records.print_deferred("{} ", "HDR");
+        records << "5 of 5\n";
+    }
+    EXPECT_EQ("HDR|a|b|c|HDR 3 of 4\n4 of 4\nHDR 5 of 5\n", all.str());
+    EXPECT_EQ("HDR|a|HDR 3 of 4\nHDR 5 of 5\n", headers.str());
+}
+
+// Test that each TeeStream has its own thread buffer
+TEST(TeeStreamTest, SeparateBuffersPerTee) {
+    std::ostringstream stream1, stream2;
+    TeeStream tee1, tee2;
+
+    tee1.add_stream(stream1);
+    tee2.add_stream(stream2);
+
+    tee1 << "first";
+    tee2 << "second";
+    tee2.flush_thread_buffer();
+
+    EXPECT_EQ("", stream1.str());
+    EXPECT_EQ("second", stream2.str());
+
+    tee1.flush_thread_buffer();
+    EXPECT_EQ("first", stream1.str());
+}
+
+// Test that data buffered by a thread is flushed when the thread exits
+TEST(TeeStreamTest, ThreadExitFlushesBuffer) {
+    std::ostringstream stream;
+    TeeStream tee;
+    tee.set_record_atomic(true);
+    tee.add_stream(stream);
+
+    std::thread writer([&tee]() {
+        tee << "written without a flush";
+    });
+    writer.join();
+
+    EXPECT_EQ("written without a flush", stream.str());
+}
+
+// Test that adaptive sizing grows chatty threads with costly flushes and shrinks idle ones
+TEST(TeeStreamTest, AdaptiveSizing) {
+    // A sink with a fixed cost per write, like a syscall per flush
+    class SlowBuf : public std::streambuf {
+    public:
+        size_t bytes = 0;
+    protected:
+        virtual int overflow(int c) override { bytes++; return c; }
+        virtual std::streamsize xsputn(const char*, std::streamsize n) override {
+            auto until = std::chrono::steady_clock::now() + std::chrono::microseconds(20);
+            while (std::chrono::steady_clock::now() < until) {}
+            bytes += n;
+            return n;
+        }
+    };
+
+    AdaptiveSizingPolicy policy;
+    policy.min_buffer_size = 256;
+    policy.max_buffer_size = 64 * 1024;
+    policy.sample_flushes = 4;
+
+    // Chatty thread: many small writes, every flush costs the same
+    {
+        SlowBuf slow_buf;
+        std::ostream slow_stream(&slow_buf);
+        TeeStream tee(1024, 768);
+        tee.enable_adaptive_sizing(policy);
+        EXPECT_TRUE(tee.is_adaptive_sizing());
+        tee.add_stream(slow_stream);
+
+        std::string data(100, 'c');
+        for (int i = 0; i < 20000; i++) {
+            tee.write(data.data(), data.size());
+        }
+        tee.flush_thread_buffer();
+
+        auto stats = tee.thread_buffer_stats();
+        ASSERT_EQ(1u, stats.size());
+        EXPECT_EQ(std::this_thread::get_id(), stats[0].thread);
+        EXPECT_GT(stats[0].buffer_size, 1024u);
+        EXPECT_LE(stats[0].buffer_size, policy.max_buffer_size);
+        EXPECT_LT(stats[0].flush_threshold, stats[0].buffer_size);
+        EXPECT_EQ(20000u * 100u, stats[0].bytes_flushed);
+        EXPECT_EQ(20000u * 100u, slow_buf.bytes);
+    }
+
+    // Quiet thread: short lines flushed by std::endl never fill the buffer
+    {
+        std::ostringstream stream;
+        TeeStream tee(8192, 6144);
+        tee.enable_adaptive_sizing(policy);
+        tee.add_stream(stream);
+
+        for (int i = 0; i < 100; i++) {
+            tee << "line " << i << std::endl;
+        }
+
+        auto stats = tee.thread_buffer_stats();
+        ASSERT_EQ(1u, stats.size());
+        EXPECT_EQ(policy.min_buffer_size, stats[0].buffer_size);
+        EXPECT_EQ(100u, stats[0].flushes);
+    }
+}
+
+// A sink that blocks every write until it is opened
+class GatedBuf : public std::streambuf {
+public:
+    void open() {
+        std::lock_guard<std::mutex> lock(mutex);
+        is_open = true;
+        cv.notify_all();
+    }
+
+    std::string str() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return data;
+    }
+
+protected:
+    virtual int overflow(int c) override {
+        char ch = static_cast<char>(c);
+        return xsputn(&ch, 1) == 1 ? c : traits_type::eof();
+    }
+
+    virtual std::streamsize xsputn(const char* s, std::streamsize n) override {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [this] { return is_open; });
+        data.append(s, static_cast<size_t>(n));
+        return n;
+    }
+
+private:
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool is_open = false;
+    std::string data;
+};
+
+// Test async mode with several writer threads
+TEST(TeeStreamTest, AsyncMode) {
+    std::ostringstream stream1, stream2;
+    TeeStream tee(64, 48);
+    tee.set_record_atomic(true);
+    tee.enable_async(256);
+    EXPECT_TRUE(tee.is_async());
+
+    tee.add_stream(stream1);
+    tee.add_stream(stream2);
+
+    const int num_threads = 4;
+    const int iterations = 200;
+
+    std::vector<std::thread> threads;
+    for (int t = 0; t < num_threads; t++) {
+        threads.emplace_back([&tee, t]() {
+            for (int i = 0; i < iterations; i++) {
+                tee << "Thread " << t << " iteration " << i << std::endl;
+            }
+        });
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+
+    tee.drain();
+
+    int line_count = 0;
+    for (char c : stream1.str()) {
+        if (c == '\n') line_count++;
+    }
+    EXPECT_EQ(num_threads * iterations, line_count);
+    EXPECT_EQ(stream1.str().size(), stream2.str().size());
+
+    // Switching back to synchronous writes keeps everything in order
+    tee << "sync" << std::endl;
+    tee.disable_async();
+    tee << "after" << std::endl;
+    EXPECT_FALSE(tee.is_async());
+    EXPECT_EQ("sync\nafter\n", stream1.str().substr(stream1.str().size() - 11));
+}
+
+// Test backpressure and the writable/drained notifications
+TEST(TeeStreamTest, AsyncBackpressure) {
+    GatedBuf gated_buf;
+    std::ostream gated_stream(&gated_buf);
+
+    TeeStream tee;
+    tee.enable_async(16);
+    tee.add_stream(gated_stream);
+
+    // Nothing queued: no backpressure and nothing to drain
+    EXPECT_FALSE(tee.backpressured());
+    EXPECT_FALSE(tee.notify_when_writable([]() {}));
+    EXPECT_FALSE(tee.notify_when_drained([]() {}));
+
+    // The writer blocks on the first chunk, the second one fills the queue
+    tee << "0123456789\n";
+    tee.flush_thread_buffer();
+    tee << "abcdefghij\n";
+    tee.flush_thread_buffer();
+    EXPECT_TRUE(tee.backpressured());
+
+    std::promise<void> writable, drained;
+    EXPECT_TRUE(tee.notify_when_writable([&writable]() { writable.set_value(); }));
+    EXPECT_TRUE(tee.notify_when_drained([&drained]() { drained.set_value(); }));
+
+    gated_buf.open();
+    EXPECT_EQ(std::future_status::ready, writable.get_future().wait_for(std::chrono::seconds(10)));
+    EXPECT_EQ(std::future_status::ready, drained.get_future().wait_for(std::chrono::seconds(10)));
+    EXPECT_FALSE(tee.backpressured());
+    EXPECT_EQ("0123456789\nabcdefghij\n", gated_buf.str());
+
+    // Muting a stream does not wait for a flusher stuck on its full queue, and removing
+    // another stream does not either
+    GatedBuf stuck_buf;
+    std::ostream stuck_stream(&stuck_buf);
+    std::ostringstream other_stream;
+    TeeStream stuck_tee;
+    stuck_tee.enable_async(16);
+    SinkHandle stuck = stuck_tee.add_stream(stuck_stream);
+    SinkHandle other = stuck_tee.add_stream(other_stream);
+    stuck_tee << "0123456789\n";
+    stuck_tee.flush_thread_buffer();
+    stuck_tee << "abcdefghij\n";
+    stuck_tee.flush_thread_buffer();
+    std::thread flusher([&stuck_tee]() {
+        stuck_tee << "ABCDEFGHIJ\n";
+        stuck_tee.flush_thread_buffer();
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    auto disabled = std::async(std::launch::async, [&stuck]() { stuck.disable(); });
+    EXPECT_EQ(std::future_status::ready, disabled.wait_for(std::chrono::seconds(10)));
+    auto removed = std::async(std::launch::async, [&other]() { return other.remove(); });
+    EXPECT_EQ(std::future_status::ready, removed.wait_for(std::chrono::seconds(10)));
+    EXPECT_FALSE(other);
+    EXPECT_FALSE(stuck_tee.is_level_enabled(LogLevel::Info));
+    stuck_buf.open();
+    flusher.join();
+    disabled.wait();
+    EXPECT_TRUE(removed.get());
+    stuck_tee.drain();
+    EXPECT_EQ(0u, stuck_buf.str().find("0123456789\nabcdefghij\n"));
+    EXPECT_EQ("0123456789\nabcdefghij\n", other_stream.str());
+}
+
+// Test that every wakeup mode delivers data written after the writer went idle
+TEST(TeeStreamTest, AsyncWakeupModes) {
+    for (WakeupMode mode : {WakeupMode::Blocking, WakeupMode::SpinThenPark, WakeupMode::BusyPoll}) {
+        GatedBuf sink_buf;
+        sink_buf.open();
+        std::ostream sink_stream(&sink_buf);
+
+        TeeStream tee;
+        tee.set_wakeup_mode(mode, 100);
+        EXPECT_EQ(mode, tee.get_wakeup_mode());
+        tee.enable_async();
+        tee.add_stream(sink_stream);
+
+        std::string expected;
+        for (int i = 0; i < 5; i++) {
+            // Give the writer time to spin out and park
+            std::this_thread::sleep_for(std::chrono::milliseconds(2));
+            tee << "message " << i << std::endl;
+            expected += "message " + std::to_string(i) + "\n";
+
+            // Each message arrives without any further prodding
+            auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+            while (sink_buf.str() != expected && std::chrono::steady_clock::now() < deadline) {
+                std::this_thread::yield();
+            }
+            EXPECT_EQ(expected, sink_buf.str());
+        }
+    }
+}
+
+// Test that buffers of exited threads are handed to new threads
+TEST(TeeStreamTest, BufferPoolRecycling) {
+    size_t max_pooled = BufferPool::get_max_pooled_bytes();
+    BufferPool::trim();
+    EXPECT_EQ(0u, BufferPool::stats().pooled_bytes);
+
+    std::ostringstream stream;
+    {
+        TeeStream tee(8192, 6144);
+        tee.add_stream(stream);
+
+        std::thread([&tee]() { tee << "first\n"; }).join();
+        auto after_first = BufferPool::stats();
+        EXPECT_GE(after_first.pooled_bytes, 8192u);
+        EXPECT_EQ(1u, after_first.pooled_blocks);
+
+        std::thread([&tee]() { tee << "second\n"; }).join();
+        auto after_second = BufferPool::stats();
+        EXPECT_EQ(after_first.reused + 1, after_second.reused);
+        EXPECT_EQ(after_first.allocated, after_second.allocated);
+
+        // With pooling disabled, released buffers are freed
+        BufferPool::set_max_pooled_bytes(0);
+        EXPECT_EQ(0u, BufferPool::stats().pooled_bytes);
+        std::thread([&tee]() { tee << "third\n"; }).join();
+        EXPECT_EQ(0u, BufferPool::stats().pooled_bytes);
+    }
+    EXPECT_EQ("first\nsecond\nthird\n", stream.str());
+
+    BufferPool::set_max_pooled_bytes(max_pooled);
+}
+
+// Test that warm_up pre-fills the pool and huge pages round large buffers to whole huge pages
+TEST(TeeStreamTest, WarmUpAndHugePages) {
+    BufferAllocationOptions options = BufferPool::get_allocation_options();
+    BufferPool::trim();
+
+    BufferAllocationOptions huge;
+    huge.huge_pages = true;
+    huge.prefault = true;
+    BufferPool::set_allocation_options(huge);
+    EXPECT_TRUE(BufferPool::get_allocation_options().huge_pages);
+    EXPECT_TRUE(BufferPool::get_allocation_options().prefault);
+
+    std::ostringstream stream;
+    {
+        TeeStream tee(1024 * 1024, 768 * 1024);
+        tee.add_stream(stream);
+
+        auto before = BufferPool::stats();
+        tee.warm_up(4);
+        auto warmed = BufferPool::stats();
+        EXPECT_EQ(before.allocated + 4, warmed.allocated);
+        EXPECT_EQ(4u, warmed.pooled_blocks);
+        EXPECT_EQ(4u * 2 * 1024 * 1024, warmed.pooled_bytes);
+
+        // Threads starting now take their buffers from the pool
+        std::vector<std::thread> threads;
+        for (int i = 0; i < 4; i++) {
+            threads.emplace_back([&tee, i]() {
+                tee << "thread " << i << std::endl;
+            });
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        auto after = BufferPool::stats();
+        EXPECT_EQ(warmed.allocated, after.allocated);
+        EXPECT_EQ(warmed.reused + 4, after.reused);
+    }
+
+    for (int i = 0; i < 4; i++) {
+        EXPECT_NE(std::string::npos, stream.str().find("thread " + std::to_string(i) + "\n"));
+    }
+
+    BufferPool::set_allocation_options(options);
+    BufferPool::trim();
+}
+
+// Test the memory budget policies
+TEST(TeeStreamTest, MemoryBudget) {
+    BufferPool::trim();
+    size_t base = BufferPool::memory_usage();
+
+    // Shrink: a new thread gets the largest buffer that fits
+    {
+        BufferPool::set_memory_budget(base + 64 * 1024, BudgetPolicy::Shrink);
+        EXPECT_EQ(BudgetPolicy::Shrink, BufferPool::get_budget_policy());
+        std::ostringstream stream;
+        TeeStream tee(256 * 1024, 192 * 1024);
+        tee.add_stream(stream);
+
+        size_t buffer_size = 0;
+        std::thread([&tee, &buffer_size]() {
+            tee << "shrunk" << std::endl;
+            buffer_size = tee.thread_buffer_stats()[0].buffer_size;
+        }).join();
+        EXPECT_EQ(64u * 1024, buffer_size);
+        EXPECT_EQ("shrunk\n", stream.str());
+    }
+    BufferPool::trim();
+
+    // Block: a thread that gets no buffer writes straight through
+    {
+        BufferPool::set_memory_budget(base + 4 * 1024, BudgetPolicy::Block);
+        std::ostringstream stream;
+        TeeStream tee(8192, 6144);
+        tee.add_stream(stream);
+
+        size_t buffer_size = 1;
+        std::thread([&tee, &buffer_size]() {
+            tee << "unbuffered ";
+            tee << "write" << std::endl;
+            buffer_size = tee.thread_buffer_stats()[0].buffer_size;
+        }).join();
+        EXPECT_EQ(0u, buffer_size);
+        EXPECT_EQ("unbuffered write\n", stream.str());
+    }
+    BufferPool::trim();
+
+    // Block: queued data waits for the writer to free memory
+    {
+        BufferPool::set_memory_budget(base + 8 * 1024, BudgetPolicy::Block);
+        GatedBuf gated_buf;
+        std::ostream gated_stream(&gated_buf);
+        TeeStream tee(1024, 512);
+        tee.enable_async();
+        tee.add_stream(gated_stream);
+
+        std::string line(99, 'b');
+        line += '\n';
+        auto producer = std::async(std::launch::async, [&tee, &line]() {
+            for (int i = 0; i < 100; i++) {
+                tee << line;
+                tee.flush_thread_buffer();
+            }
+        });
+
+        EXPECT_EQ(std::future_status::timeout, producer.wait_for(std::chrono::milliseconds(50)));
+        EXPECT_LE(BufferPool::memory_usage(), base + 8 * 1024);
+
+        gated_buf.open();
+        ASSERT_EQ(std::future_status::ready, producer.wait_for(std::chrono::seconds(10)));
+        tee.drain();
+        EXPECT_EQ(100u * line.size(), gated_buf.str().size());
+        EXPECT_EQ(0u, tee.dropped_bytes());
+    }
+    BufferPool::trim();
+
+    // Drop: queued data over the budget is discarded
+    {
+        BufferPool::set_memory_budget(base + 8 * 1024, BudgetPolicy::Drop);
+        GatedBuf gated_buf;
+        std::ostream gated_stream(&gated_buf);
+        TeeStream tee(1024, 512);
+        tee.enable_async();
+        tee.add_stream(gated_stream);
+
+        std::string line(99, 'd');
+        line += '\n';
+        std::thread([&tee, &line]() {
+            for (int i = 0; i < 100; i++) {
+                tee << line;
+                tee.flush_thread_buffer();
+            }
+        }).join();
+        EXPECT_LE(BufferPool::memory_usage(), base + 8 * 1024);
+        EXPECT_GT(tee.dropped_bytes(), 0u);
+
+        gated_buf.open();
+        tee.drain();
+        EXPECT_EQ(100u * line.size(), gated_buf.str().size() + tee.dropped_bytes());
+    }
+    BufferPool::trim();
+
+    // Block: with thread buffers holding the whole budget and nothing queued, no memory
+    // will be released, so a flush is written through instead of waiting
+    {
+        BufferPool::set_memory_budget(base + 4 * 1024, BudgetPolicy::Block);
+        std::ostringstream stream;
+        TeeStream tee(4 * 1024, 3 * 1024);
+        tee.enable_async();
+        tee.add_stream(stream);
+
+        auto producer = std::async(std::launch::async, [&tee]() {
+            tee << "written through\n";
+            tee.flush_thread_buffer();
+            return tee.thread_buffer_stats()[0].buffer_size;
+        });
+        ASSERT_EQ(std::future_status::ready, producer.wait_for(std::chrono::seconds(10)));
+        EXPECT_EQ(4u * 1024, producer.get());
+        tee.drain();
+        EXPECT_EQ("written through\n", stream.str());
+        EXPECT_EQ(0u, tee.dropped_bytes());
+    }
+
+    BufferPool::trim();
+
+    // Block: try_write() never waits for the budget; text it has no room for is refused
+    {
+        BufferPool::set_memory_budget(base + 8 * 1024, BudgetPolicy::Block);
+        GatedBuf gated_buf;
+        std::ostream gated_stream(&gated_buf);
+        TeeStream tee(1024, 512);
+        tee.enable_async();
+        tee.add_stream(gated_stream);
+
+        std::string line(99, 'n');
+        line += '\n';
+        // The thread's exit flush may wait, so the writer is let go before it exits
+        std::promise<size_t> result;
+        std::thread producer([&tee, &line, &result]() {
+            size_t written = 0;
+            for (int i = 0; i < 100; i++) {
+                written += tee.try_write(line.data(), static_cast<std::streamsize>(line.size()));
+            }
+            result.set_value(written);
+        });
+        auto accepted_future = result.get_future();
+        bool returned = accepted_future.wait_for(std::chrono::seconds(10)) == std::future_status::ready;
+        EXPECT_TRUE(returned);
+        EXPECT_LE(BufferPool::memory_usage(), base + 8 * 1024);
+        gated_buf.open();
+        producer.join();
+        size_t accepted = accepted_future.get();
+        EXPECT_GT(accepted, 0u);
+        EXPECT_LT(accepted, 100u);
+        tee.drain();
+        EXPECT_EQ(accepted * line.size(), gated_buf.str().size());
+        EXPECT_EQ(0u, tee.dropped_bytes());
+    }
+
+    BufferPool::set_memory_budget(0);
+    BufferPool::trim();
+    EXPECT_EQ(base, BufferPool::memory_usage());
+}
+
+// Test that queued data is shared by every stream and full buffers are handed over, not copied
+TEST(TeeStreamTest, AsyncChunkSharing) {
+    auto queued_memory = [](size_t sink_count) {
+        BufferPool::trim();
+        size_t base = BufferPool::memory_usage();
+
+        std::vector<std::unique_ptr<GatedBuf>> sink_bufs;
+        std::vector<std::unique_ptr<std::ostream>> sink_streams;
+        TeeStream tee(1024, 768);
+        tee.enable_async();
+        for (size_t i = 0; i < sink_count; i++) {
+            sink_bufs.push_back(std::make_unique<GatedBuf>());
+            sink_streams.push_back(std::make_unique<std::ostream>(sink_bufs.back().get()));
+            tee.add_stream(*sink_streams.back());
+        }
+
+        // Five flushes of 800 bytes, all held in the queues while the sinks are closed
+        std::string line(99, 'x');
+        line += '\n';
+        for (int i = 0; i < 40; i++) {
+            tee << line;
+        }
+        size_t usage = BufferPool::memory_usage() - base;
+
+        for (auto& sink_buf : sink_bufs) {
+            sink_buf->open();
+        }
+        tee.drain();
+        for (auto& sink_buf : sink_bufs) {
+            EXPECT_EQ(40u * line.size(), sink_buf->str().size());
+        }
+        return usage;
+    };
+
+    size_t one_sink = queued_memory(1);
+    EXPECT_EQ(one_sink, queued_memory(4));
+
+    // The five handed-over buffers plus the thread's current one
+    EXPECT_EQ(6u * 1024, one_sink);
+}
+
+// Test writing in place with reserve and commit
+TEST(TeeStreamTest, ReserveCommit) {
+    std::ostringstream stream;
+    TeeStream tee(64, 48);
+    tee.add_stream(stream);
+
+    char* space = tee.reserve(16);
+    ASSERT_NE(nullptr, space);
+    memcpy(space, "hello, world", 5);
+    tee.commit(5);
+    tee << " and ";
+
+    // Larger than the buffer: it grows for the reservation, then shrinks back
+    space = tee.reserve(200);
+    ASSERT_NE(nullptr, space);
+    memset(space, 'z', 200);
+    tee.commit(200);
+    EXPECT_EQ(64u, tee.thread_buffer_stats()[0].buffer_size);
+    tee.flush_thread_buffer();
+    EXPECT_EQ("hello and " + std::string(200, 'z'), stream.str());
+
+    // In record-atomic mode committed bytes form records like any other write
+    stream.str("");
+    tee.set_record_atomic(true);
+    space = tee.reserve(8);
+    memcpy(space, "partial", 7);
+    tee.commit(7);
+    tee.flush_thread_buffer();
+    EXPECT_EQ("", stream.str());
+
+    space = tee.reserve(8);
+    memcpy(space, " line\n", 6);
+    tee.commit(6);
+    tee.flush_thread_buffer();
+    EXPECT_EQ("partial line\n", stream.str());
+}
+
+// Test that borrowed payloads are released only once every stream has written them
+TEST(TeeStreamTest, WriteBorrowed) {
+    // Without queues the payload is written and released before the call returns
+    {
+        std::ostringstream stream1, stream2;
+        TeeStream tee(stream1, stream2);
+        std::string payload(100000, 'p');
+        bool released = false;
+        tee << "header ";
+        tee.write_borrowed(payload.data(), payload.size(), [&released]() { released = true; });
+        EXPECT_TRUE(released);
+        tee.write_borrowed(std::string(" moved"));
+        tee.flush();
+        EXPECT_EQ("header " + payload + " moved", stream1.str());
+        EXPECT_EQ(stream1.str(), stream2.str());
+    }
+
+    // Queued streams hold on to it until the last one has written it
+    {
+        GatedBuf gated_buf1, gated_buf2;
+        std::ostream gated_stream1(&gated_buf1), gated_stream2(&gated_buf2);
+        TeeStream tee;
+        tee.enable_async();
+        tee.add_stream(gated_stream1);
+        tee.add_stream(gated_stream2);
+
+        std::vector<char> payload(100000, 'q');
+        std::atomic<int> releases(0);
+        tee.write_borrowed(payload.data(), payload.size(), [&releases]() { releases++; });
+        tee.write_borrowed(std::vector<char>{'!', '\n'});
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        EXPECT_EQ(0, releases.load());
+
+        std::string expected = std::string(100000, 'q') + "!\n";
+        gated_buf1.open();
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+        while (gated_buf1.str() != expected && std::chrono::steady_clock::now() < deadline) {
+            std::this_thread::yield();
+        }
+        EXPECT_EQ(0, releases.load());
+
+        gated_buf2.open();
+        tee.drain();
+        deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+        while (releases.load() == 0 && std::chrono::steady_clock::now() < deadline) {
+            std::this_thread::yield();
+        }
+        EXPECT_EQ(1, releases.load());
+
+        EXPECT_EQ(expected, gated_buf1.str());
+        EXPECT_EQ(expected, gated_buf2.str());
+    }
+
+    // A timestamp prefix goes out with its payload as one record
+    for (bool async : {false, true}) {
+        std::ostringstream plain, collapsed;
+        TeeStream tee;
+        if (async) {
+            tee.enable_async();
+        }
+        tee.enable_timestamps();
+        tee.add_stream(plain);
+        SinkOptions dedup;
+        dedup.dedup_window = std::chrono::minutes(1);
+        tee.add_stream(collapsed, dedup);
+
+        for (int i = 0; i < 3; i++) {
+            tee.write_borrowed(std::string("payload\n"));
+        }
+        tee.flush();
+        tee.drain();
+
+        std::regex prefix(R"(\[\d{4}-\d\d-\d\d \d\d:\d\d:\d\d\.\d{6}\] )");
+        EXPECT_EQ("payload\npayload\npayload\n", std::regex_replace(plain.str(), prefix, ""));
+        EXPECT_TRUE(std::regex_search(collapsed.str(), prefix));
+        EXPECT_EQ("payload\nrepeated 2 times\n", std::regex_replace(collapsed.str(), prefix, ""));
+    }
+}
+
+// Test that the fast inserter matches regular ostream formatting
+TEST(TeeStreamTest, FastFormatting) {
+    std::ostringstream stream;
+    std::ostringstream expected;
+    TeeStream tee;
+    tee.add_stream(stream);
+
+    auto both = [&](auto value) {
+        tee.fast() << value << ' ';
+        expected << value << ' ';
+    };
+    auto all_values = [&]() {
+        both(0);
+        both(-42);
+        both(std::numeric_limits<int>::min());
+        both(std::numeric_limits<unsigned long long>::max());
+        both(static_cast<short>(-7));
+        both(3.14159265359);
+        both(0.1f);
+        both(1e20);
+        both(-2.5e-7);
+        both(100.0);
+        both(std::numeric_limits<double>::infinity());
+        both(12.5L);
+        both(true);
+        both('c');
+        both(static_cast<unsigned char>('u'));
+        both(static_cast<signed char>('s'));
+        both("text");
+        both(std::string("string"));
+    };
+
+    all_values();
+
+    // Base, floatfield and precision are honored
+    tee << std::hex;
+    expected << std::hex;
+    all_values();
+    tee << std::dec << std::fixed << std::setprecision(3);
+    expected << std::dec << std::fixed << std::setprecision(3);
+    all_values();
+    tee << std::scientific;
+    expected << std::scientific;
+    all_values();
+
+    // Other formatting state falls back to the regular path
+    tee.fast() << std::defaultfloat << std::showpos << 42 << std::noshowpos << std::boolalpha << true
+               << std::setw(6) << std::setfill('*') << 7 << std::setw(3) << uint8_t{'8'}
+               << std::setw(3) << int8_t{'9'} << std::endl;
+    expected << std::defaultfloat << std::showpos << 42 << std::noshowpos << std::boolalpha << true
+             << std::setw(6) << std::setfill('*') << 7 << std::setw(3) << uint8_t{'8'}
+             << std::setw(3) << int8_t{'9'} << std::endl;
+
+    EXPECT_EQ(expected.str(), stream.str());
+}
+
+// Test format-string output against the equivalent ostream formatting
+TEST(TeeStreamTest, PrintFormatting) {
+    std::ostringstream stream;
+    TeeStream tee;
+    tee.add_stream(stream);
+
+    std::string name = "parse";
+    tee.print(TEE_FMT("{} took {}us\n"), name, 125);
+    tee.print(TEE_FMT("{{braces}} {} {:x} {:X} {:o} {:b}\n"), -42, 255, 255, 8, 5);
+    tee.print(TEE_FMT("{} {} {:.3f} {:e} {:.2g}\n"), 0.1, 1e20, 3.14159, 1234.5, 0.000123);
+    tee.print(TEE_FMT("{} {} {}{}\n"), true, 'c', "literal", std::string_view("view"));
+    tee.print(TEE_FMT("{}\n"), std::numeric_limits<long long>::min());
+    tee.print(TEE_FMT("no arguments\n"));
+    tee.flush();
+
+    std::string expected = "parse took 125us\n"
+                           "{braces} -42 ff FF 10 101\n"
+                           "0.1 1e+20 3.142 1.234500e+03 0.00012\n"
+                           "true c literalview\n" +
+                           std::to_string(std::numeric_limits<long long>::min()) + "\n"
+                           "no arguments\n";
+    EXPECT_EQ(expected, stream.str());
+
+    // Output longer than the buffer is rendered in pieces
+    std::ostringstream small_stream;
+    TeeStream small_tee(64, 48);
+    small_tee.add_stream(small_stream);
+    std::string long_value(200, 'x');
+    small_tee.print(TEE_FMT("{} {} {:.2f}\n"), long_value, long_value, 1e100);
+    small_tee.flush();
+    std::ostringstream long_expected;
+    long_expected << long_value << ' ' << long_value << ' ' << std::fixed << std::setprecision(2) << 1e100 << '\n';
+    EXPECT_EQ(long_expected.str(), small_stream.str());
+
+    // A format string only known at run time is parsed, and rejected, before print() is called
+    std::string bad_format = "{} {}";
+    EXPECT_THROW((TeeFormatString<int>(TeeFormatRuntime(), bad_format)), std::invalid_argument);
+    EXPECT_THROW((TeeFormatString<int>(TeeFormatRuntime(), "{:f}")), std::invalid_argument);
+    stream.str("");
+    tee.print(TeeFormatString<int>(TeeFormatRuntime(), std::string("{:x}\n")), 255);
+    tee.flush();
+    EXPECT_EQ("ff\n", stream.str());
+}
+
+// Test that deferred records are formatted on flush, in order with text writes
+TEST(TeeStreamTest, PrintDeferred) {
+    {
+        std::ostringstream stream;
+        TeeStream tee;
+        tee.add_stream(stream);
+
+        tee << "text first\n";
+        tee.print_deferred("{} took {:.1f}us\n", std::string("parse"), 12.25);
+        tee.print_deferred(TEE_FMT("{{id}} {:x} {} {}\n"), 255u, 'c', true);
+        EXPECT_EQ("", stream.str());  // Text and deferred records share the buffer
+        tee << "text last\n";
+        tee.flush();
+
+        EXPECT_EQ("text first\nparse took 12.2us\n{id} ff c true\ntext last\n", stream.str());
+
+#if !defined(__cpp_consteval)
+        // Without consteval a bad format string shows up in the output
+        stream.str("");
+        tee.print_deferred("{} {}\n", 1);
+        tee.flush();
+        EXPECT_NE(std::string::npos, stream.str().find("{} {}"));
+#endif
+    }
+
+    // In record-atomic mode a deferred record ending a line completes the text before it
+    {
+        std::ostringstream stream;
+        TeeStream tee;
+        tee.set_record_atomic(true);
+        tee.add_stream(stream);
+
+        tee << "status: ";
+        tee.print_deferred("{} of {}\n", 3, 4);
+        tee << "next: ";
+        tee.print_deferred("{}", 5);
+        tee.flush();
+        EXPECT_EQ("status: 3 of 4\n", stream.str());
+        tee << "\n";
+        tee.flush();
+        EXPECT_EQ("status: 3 of 4\nnext: 5\n", stream.str());
+    }
+
+    // In async mode the background writers format the records
+    {
+        std::ostringstream stream1, stream2;
+        std::string expected;
+        {
+            TeeStream tee(256, 192);
+            tee.enable_async();
+            tee.add_stream(stream1);
+            tee.add_stream(stream2);
+            for (int i = 0; i < 100; i++) {
+                tee.print_deferred("line {} of {}\n", i, "many");
+                expected += "line " + std::to_string(i) + " of many\n";
+            }
+        }
+        EXPECT_EQ(expected, stream1.str());
+        EXPECT_EQ(expected, stream2.str());
+    }
+}
+
+// Test that every line gets a timestamp, however it was written
+TEST(TeeStreamTest, TimestampPrefixes) {
+    char prefix[TimestampPrefix::kMaxSize];
+    TimestampOptions options;
+    options.utc = true;
+    options.fraction_digits = 3;
+    std::string formatted(prefix, TimestampPrefix::format(prefix, options));
+    EXPECT_TRUE(std::regex_match(formatted, std::regex(R"(\[\d{4}-\d\d-\d\d \d\d:\d\d:\d\d\.\d{3}\] )")));
+
+    // The calendar part matches the C library's formatting of the same second
+    time_t now = time(nullptr);
+    options.fraction_digits = 0;
+    options.clock = TimestampClock::Coarse;
+    formatted.assign(prefix, TimestampPrefix::format(prefix, options));
+    char expected[32];
+    strftime(expected, sizeof(expected), "[%Y-%m-%d %H:%M:%S] ", gmtime(&now));
+    if (time(nullptr) == now) {
+        EXPECT_EQ(expected, formatted);
+    }
+
+    std::ostringstream stream;
+    TeeStream tee;
+    tee.add_stream(stream);
+    tee.enable_timestamps();
+    EXPECT_TRUE(tee.has_timestamps());
+
+    tee << "first " << 1 << "\nsecond\n";
+    tee.fast() << 3 << '\n';
+    tee.print(TEE_FMT("{}\n{}\n"), "fourth", "fifth");
+    tee.write_borrowed(std::string("sixth\n"));
+    tee.print_deferred("{}\n", std::string("seventh"));
+    tee << "eighth, ";
+    tee.print_deferred("{} line\n", "a deferred");
+    tee.disable_timestamps();
+    tee << "plain\n";
+    tee.flush();
+
+    std::regex line(R"(\[\d{4}-\d\d-\d\d \d\d:\d\d:\d\d\.\d{6}\] (.*))");
+    std::vector<std::string> contents;
+    std::istringstream lines(stream.str());
+    std::string text;
+    while (std::getline(lines, text)) {
+        std::smatch match;
+        contents.push_back(std::regex_match(text, match, line) ? match[1].str() : "unprefixed: " + text);
+    }
+    std::vector<std::string> expected_contents = {
+        "first 1", "second", "3", "fourth", "fifth", "sixth", "seventh", "eighth, a deferred line", "unprefixed: plain"
+    };
+    EXPECT_EQ(expected_contents, contents);
+}
+
+// Test JSON-lines records and the escape scan behind them
+TEST(TeeStreamTest, JsonRecords) {
+    std::ostringstream stream;
+    TeeStream tee;
+    tee.add_stream(stream);
+
+    tee.record()
+        .field("event", "login")
+        .field("user", std::string("a \"quoted\" \\ name\n\x01"))
+        .field("id", -42)
+        .field("ratio", 0.5)
+        .field("ok", true)
+        .field("missing", nullptr)
+        .field("nan", std::numeric_limits<double>::quiet_NaN())
+        .field("utf8", "caf\xc3\xa9")
+        .field("grade", 'A');
+    tee.record();
+    tee.flush();
+
+    EXPECT_EQ("{\"event\":\"login\",\"user\":\"a \\\"quoted\\\" \\\\ name\\n\\u0001\","
+              "\"id\":-42,\"ratio\":0.5,\"ok\":true,\"missing\":null,\"nan\":null,"
+              "\"utf8\":\"caf\xc3\xa9\",\"grade\":\"A\"}\n{}\n",
+              stream.str());
+
+    // The vectorized scan agrees with a byte-by-byte one wherever the special character falls
+    std::mt19937 gen(7);
+    for (int round = 0; round < 1000; round++) {
+        std::string text(gen() % 100, 'x');
+        for (auto& c : text) {
+            c = static_cast<char>(0x20 + gen() % 0xE0);   // Printable ASCII and UTF-8 bytes
+            if (c == '"' || c == '\\') {
+                c = 'y';
+            }
+        }
+        size_t expected = text.size();
+        if (!text.empty() && gen() % 4 != 0) {
+            expected = gen() % text.size();
+            const char specials[] = {'"', '\\', '\n', '\0', '\x1f'};
+            text[expected] = specials[gen() % sizeof(specials)];
+        }
+        EXPECT_EQ(expected, TeeJsonRecord::plain_length(text.data(), text.size()));
+    }
+}
+
+// Test that text and binary streams each get their own encoding of the same writes
+TEST(TeeStreamTest, SinkFormats) {
+    // Frames of a SinkFormat::Binary stream: type, 32-bit length, payload
+    auto frames = [](const std::string& data) {
+        std::vector<std::pair<char, std::string>> result;
+        size_t pos = 0;
+        while (pos + 5 <= data.size()) {
+            uint32_t length;
+            memcpy(&length, data.data() + pos + 1, sizeof(length));
+            result.emplace_back(data[pos], data.substr(pos + 5, length));
+            pos += 5 + length;
+        }
+        EXPECT_EQ(data.size(), pos);
+        return result;
+    };
+    auto u32 = [](const std::string& s, size_t pos) {
+        uint32_t value;
+        memcpy(&value, s.data() + pos, sizeof(value));
+        return value;
+    };
+
+    for (bool async : {false, true}) {
+        std::ostringstream console, file;
+        {
+            TeeStream tee;
+            if (async) {
+                tee.enable_async();
+            }
+            tee.add_stream(console);
+            tee.add_stream(file, SinkFormat::Binary);
+
+            tee << "started\n";
+            tee.flush();
+            tee.print_deferred("{} took {}us\n", std::string("parse"), 12);
+            tee.print_deferred("{} took {}us\n", std::string("load"), 7);
+            tee.flush();
+        }
+        EXPECT_EQ("started\nparse took 12us\nload took 7us\n", console.str());
+
+        auto binary = frames(file.str());
+        ASSERT_EQ(4u, binary.size());
+        EXPECT_EQ('T', binary[0].first);
+        EXPECT_EQ("started\n", binary[0].second);
+
+        // The format is defined once, then referenced by id from each record
+        EXPECT_EQ('F', binary[1].first);
+        const std::string& definition = binary[1].second;
+        EXPECT_EQ(0u, u32(definition, 0));
+        EXPECT_EQ(2u, u32(definition, 4));
+        EXPECT_EQ(std::string("si") + "{} took {}us\n", definition.substr(8));
+
+        EXPECT_EQ('R', binary[2].first);
+        EXPECT_EQ(0u, u32(binary[2].second, 0));
+        EXPECT_EQ(5u, u32(binary[2].second, 4));
+        EXPECT_EQ("parse", binary[2].second.substr(8, 5));
+        int value;
+        memcpy(&value, binary[2].second.data() + 13, sizeof(value));
+        EXPECT_EQ(12, value);
+        EXPECT_EQ('R', binary[3].first);
+        EXPECT_EQ("load", binary[3].second.substr(8, 4));
+    }
+}
+
+// Test wide character tees, which buffer through the char engine
+TEST(TeeStreamTest, WideCharacters) {
+    static_assert(std::is_same_v<TeeStream, basic_TeeStream<char>>);
+    static_assert(std::is_same_v<TeeStreamBuf, basic_TeeStreamBuf<char>>);
+
+    {
+        std::wostringstream stream1, stream2;
+        WTeeStream tee(16, 12);
+        tee.add_stream(stream1);
+        tee.add_stream(stream2);
+
+        tee << L"Wide: " << 42 << L' ' << 2.5 << std::endl;
+        tee << std::wstring(100, L'\u00e9') << L'\n';
+        tee.flush();
+
+        std::wstring expected = L"Wide: 42 2.5\n" + std::wstring(100, L'\u00e9') + L"\n";
+        EXPECT_EQ(expected, stream1.str());
+        EXPECT_EQ(expected, stream2.str());
+
+        tee.remove_stream(stream2);
+        tee << L"only one" << std::endl;
+        EXPECT_EQ(expected + L"only one\n", stream1.str());
+        EXPECT_EQ(expected, stream2.str());
+    }
+
+    // Threads and async writers never split a character
+    {
+        std::wostringstream stream;
+        {
+            WTeeStream tee(stream);
+            tee.enable_async();
+            std::vector<std::thread> threads;
+            for (int t = 0; t < 4; t++) {
+                threads.emplace_back([&tee]() {
+                    for (int i = 0; i < 500; i++) {
+                        tee << L"\u03bb line " << i << L'\n';
+                    }
+                });
+            }
+            for (auto& thread : threads) {
+                thread.join();
+            }
+        }
+
+        std::wistringstream lines(stream.str());
+        std::wstring line;
+        int count = 0;
+        while (std::getline(lines, line)) {
+            EXPECT_EQ(0u, line.find(L"\u03bb line "));
+            count++;
+        }
+        EXPECT_EQ(2000, count);
+    }
+}
+
+// Test that filtered streams receive only the records that pass their filter
+TEST(TeeStreamTest, SinkFilters) {
+    for (bool async : {false, true}) {
+        std::ostringstream file, console, tagged;
+        std::atomic<int> evaluations{0};
+        std::string expected_all, expected_warnings;
+        {
+            TeeStream tee(64, 48);
+            if (async) {
+                tee.enable_async();
+            }
+            tee.add_stream(file);
+
+            SinkOptions warnings;
+            warnings.filter = [&evaluations](const RecordInfo& info) {
+                evaluations++;
+                return info.level >= 2;
+            };
+            tee.add_stream(console, warnings);
+
+            SinkOptions net;
+            net.filter = [](const RecordInfo& info) {
+                return info.tag != nullptr && std::string(info.tag) == "net" &&
+                       info.thread == std::this_thread::get_id();
+            };
+            tee.add_stream(tagged, net);
+
+            tee << "untagged\n";
+            expected_all += "untagged\n";
+            for (int i = 0; i < 30; i++) {
+                int level = i % 3;
+                tee.begin_record(level, i % 2 ? "net" : "disk");
+                tee << "record " << i << " level " << level << "\n";
+                std::string line = "record " + std::to_string(i) + " level " + std::to_string(level) + "\n";
+                expected_all += line;
+                if (level >= 2) {
+                    expected_warnings += line;
+                }
+            }
+
+            // Large writes bypass the buffer and keep the open record's metadata
+            tee.begin_record(2);
+            std::string large(200, 'x');
+            tee << large << "\n";
+            expected_all += large + "\n";
+            expected_warnings += large + "\n";
+        }
+
+        EXPECT_EQ(expected_all, file.str());
+        EXPECT_EQ(expected_warnings, console.str());
+        if (!async) {
+            // Each filter runs once per record in each flush it spans
+            EXPECT_LT(evaluations.load(), 62);
+            EXPECT_NE(std::string::npos, tagged.str().find("record 1 level 1\n"));
+            EXPECT_EQ(std::string::npos, tagged.str().find("record 2 "));
+        }
+    }
+
+    // A record of several lines is kept or dropped whole, on one evaluation of the filter
+    for (bool async : {false, true}) {
+        std::ostringstream stream;
+        int evaluations = 0;
+        {
+            TeeStream tee;
+            if (async) {
+                tee.enable_async();
+            }
+            SinkOptions every_other;
+            every_other.filter = [&evaluations](const RecordInfo&) {
+                return evaluations++ % 2 == 0;
+            };
+            tee.add_stream(stream, every_other);
+
+            tee.begin_record(1);
+            tee << "first\nsecond\nthird\n";
+            tee.begin_record(1);
+            tee << "dropped\nwhole\n";
+            tee.begin_record(1);
+            tee << "kept\n";
+        }
+        EXPECT_EQ(3, evaluations);
+        EXPECT_EQ("first\nsecond\nthird\nkept\n", stream.str());
+    }
+}
+
+// Test leveled statements against the tee's level and the streams' levels
+TEST(TeeStreamTest, SeverityLevels) {
+    std::ostringstream file, console;
+    TeeStream tee;
+    tee.add_stream(file);
+    SinkOptions warnings;
+    warnings.min_level = LogLevel::Warn;
+    tee.add_stream(console, warnings);
+
+    int evaluated = 0;
+    auto count = [&evaluated]() { return ++evaluated; };
+
+    tee.set_level(LogLevel::Debug);
+    EXPECT_EQ(LogLevel::Debug, tee.get_level());
+    EXPECT_FALSE(tee.is_level_enabled(LogLevel::Trace));
+    EXPECT_TRUE(tee.is_level_enabled(LogLevel::Debug));
+
+    TEE_TRACE(tee) << "trace " << count() << "\n";
+    EXPECT_EQ(0, evaluated);  // Arguments below the level are never evaluated
+    TEE_DEBUG(tee) << "debug " << count() << "\n";
+    TEE_LOG_TAG(tee, LogLevel::Error, "disk") << "error " << count() << "\n";
+    tee << "plain\n";
+
+    // Statements nest in if/else without braces
+    if (evaluated == 2)
+        TEE_WARN(tee) << "warn\n";
+    else
+        ADD_FAILURE();
+    tee.flush();
+
+    EXPECT_EQ(2, evaluated);
+    EXPECT_EQ("debug 1\nerror 2\nplain\nwarn\n", file.str());
+    EXPECT_EQ("error 2\nwarn\n", console.str());
+
+    // Once the only stream taking low levels is gone, they are skipped up front
+    tee.set_level(LogLevel::Trace);
+    tee.remove_stream(file);
+    EXPECT_FALSE(tee.is_level_enabled(LogLevel::Info));
+    TEE_INFO(tee) << count();
+    EXPECT_EQ(2, evaluated);
+
+    tee.set_level(LogLevel::Off);
+    EXPECT_FALSE(tee.is_level_enabled(LogLevel::Fatal));
+}
+
+// Test per-stream and per-call-site sampling and rate limits
+TEST(TeeStreamTest, RateLimitingAndSampling) {
+    std::ostringstream all, sampled, limited;
+    TeeStream tee;
+    tee.add_stream(all);
+
+    SinkOptions every_third;
+    every_third.sample_every = 3;
+    tee.add_stream(sampled, every_third);
+
+    SinkOptions two_per_second;
+    two_per_second.rate_limit.per_second = 2;
+    tee.add_stream(limited, two_per_second);
+
+    for (int i = 0; i < 9; i++) {
+        TEE_INFO(tee) << "record " << i << "\n";
+    }
+    tee.flush();
+    EXPECT_EQ("record 0\nrecord 3\nrecord 6\n", sampled.str());
+    EXPECT_EQ("record 0\nrecord 1\nsuppressed 7 records\n", limited.str());  // Summed up on the flush
+
+    // The bucket refills
+    std::this_thread::sleep_for(std::chrono::milliseconds(600));
+    TEE_INFO(tee) << "record 9\n";
+    tee.flush();
+    EXPECT_EQ("record 0\nrecord 1\nsuppressed 7 records\nrecord 9\n", limited.str());
+
+    // Records suppressed later are summed up on the next flush too, and at teardown
+    for (int i = 10; i < 13; i++) {
+        TEE_INFO(tee) << "record " << i << "\n";
+    }
+    tee.flush();
+    EXPECT_EQ("record 0\nrecord 1\nsuppressed 7 records\nrecord 9\nsuppressed 3 records\n", limited.str());
+    std::ostringstream torn_down;
+    {
+        TeeStream short_lived;
+        short_lived.add_stream(torn_down, two_per_second);
+        for (int i = 0; i < 3; i++) {
+            TEE_INFO(short_lived) << "record " << i << "\n";
+        }
+    }
+    EXPECT_EQ("record 0\nrecord 1\nsuppressed 1 record\n", torn_down.str());
+
+    // Byte limits count deferred records by their formatted size
+    std::ostringstream bytes_limited;
+    {
+        TeeStream deferred_tee;
+        SinkOptions ten_bytes;
+        ten_bytes.rate_limit.per_second = 0.001;
+        ten_bytes.rate_limit.burst = 10;
+        ten_bytes.rate_limit.unit = RateUnit::Bytes;
+        deferred_tee.add_stream(bytes_limited, ten_bytes);
+        for (int i = 0; i < 8; i++) {
+            deferred_tee.print_deferred("{}\n", i);
+        }
+    }
+    EXPECT_EQ("0\n1\n2\n3\n4\nsuppressed 3 records\n", bytes_limited.str());
+
+    // In async mode, records a stream rejects are never queued for it
+    {
+        GatedBuf gated_buf;
+        std::ostream gated_stream(&gated_buf);
+        TeeStream async_tee;
+        async_tee.enable_async(16);
+        SinkOptions one_record;
+        one_record.rate_limit.per_second = 0.001;
+        one_record.rate_limit.burst = 1;
+        async_tee.add_stream(gated_stream, one_record);
+
+        // The writer blocks on the first record; the rest do not fill the queue behind it
+        for (int i = 0; i < 6; i++) {
+            TEE_INFO(async_tee) << "record " << i << "\n";
+            async_tee.flush_thread_buffer();
+        }
+        EXPECT_FALSE(async_tee.backpressured());
+        gated_buf.open();
+        async_tee.drain();
+        EXPECT_EQ("record 0\nsuppressed 5 records\n", gated_buf.str());
+    }
+
+    // Call-site limits count statements before anything is formatted or buffered
+    all.str("");
+    int evaluated = 0;
+    auto hot = [&](int i) {
+        TEE_LOG_RATE(tee, LogLevel::Warn, 2) << "hot " << i << " " << ++evaluated << "\n";
+    };
+    auto sampled_site = [&](int i) {
+        TEE_LOG_EVERY_N(tee, LogLevel::Warn, 4) << "every " << i << "\n";
+    };
+    for (int i = 0; i < 5; i++) {
+        hot(i);
+        sampled_site(i);
+    }
+    EXPECT_EQ(2, evaluated);
+    std::this_thread::sleep_for(std::chrono::milliseconds(600));
+    hot(5);
+    tee.flush();
+    EXPECT_EQ("hot 0 1\nevery 0\nhot 1 2\nevery 4\nsuppressed 3 records\nhot 5 3\n", all.str());
+
+    // Less than one per second still lets the first through, and 0 means no limit
+    all.str("");
+    for (int i = 0; i < 3; i++) {
+        TEE_LOG_RATE(tee, LogLevel::Warn, 0.2) << "slow " << i << "\n";
+        TEE_LOG_RATE(tee, LogLevel::Warn, 0) << "free " << i << "\n";
+    }
+    tee.flush();
+    EXPECT_EQ("slow 0\nfree 0\nfree 1\nfree 2\n", all.str());
+
+    // Threads flushing at once share the bucket: no more than the burst gets through, and
+    // every sampled record is either written or summed up
+    std::ostringstream shared;
+    {
+        TeeStream contended(256);
+        contended.set_record_atomic(true);
+        SinkOptions sampled_limit;
+        sampled_limit.sample_every = 10;
+        sampled_limit.rate_limit.per_second = 0.001;
+        sampled_limit.rate_limit.burst = 50;
+        contended.add_stream(shared, sampled_limit);
+        std::vector<std::thread> threads;
+        for (int t = 0; t < 4; t++) {
+            threads.emplace_back([&contended, t]() {
+                for (int i = 0; i < 1000; i++) {
+                    TEE_INFO(contended) << "thread " << t << " record " << i << "\n";
+                }
+            });
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+    }
+    std::istringstream lines(shared.str());
+    int written = 0;
+    uint64_t summed = 0;
+    for (std::string line; std::getline(lines, line);) {
+        if (line.rfind("suppressed ", 0) == 0) {
+            summed += std::stoull(line.substr(11));
+        } else {
+            written++;
+        }
+    }
+    EXPECT_EQ(50, written);
+    EXPECT_EQ(350u, summed);
+}
+
+// Test routing records to a stream by their content
+TEST(TeeStreamTest, ContentRouting) {
+    std::ostringstream all, alerts;
+    std::string expected;
+    {
+        TeeStream tee;
+        tee.add_stream(all);
+        SinkOptions routing;
+        routing.match = {"ERROR", "trace=7f", "!"};
+        tee.add_stream(alerts, routing);
+
+        std::string padding(70, '.');
+        for (int i = 0; i < 200; i++) {
+            std::string line;
+            switch (i % 5) {
+                case 0: line = "ERROR at start " + std::to_string(i); break;
+                case 1: line = padding + " trace=7f" + std::to_string(i); break;   // Past the first 64 bytes
+                case 2: line = "nothing here " + std::to_string(i) + padding; break;
+                case 3: line = std::to_string(i) + " ends with ERR"; break;        // Completed by the next record
+                case 4: line = "OR, and trace=7 only " + std::to_string(i); break;
+            }
+            TEE_INFO(tee) << line << "\n";
+            if (i % 5 < 2) {
+                expected += line + "\n";
+            }
+        }
+        TEE_INFO(tee) << "short!\n";
+        expected += "short!\n";
+    }
+    EXPECT_EQ(expected, alerts.str());
+    EXPECT_GT(all.str().size(), alerts.str().size());
+
+    // Plain writes are records too, one per line however the lines were written
+    std::ostringstream plain_alerts;
+    {
+        TeeStream tee;
+        SinkOptions routing;
+        routing.match = {"ERROR"};
+        tee.add_stream(plain_alerts, routing);
+
+        tee << "info line 1\n" << "ERROR boom\n" << "info line 2\n";
+        tee << "info line 3\nERROR twice\nERR" << "OR split\ninfo ";
+        tee << "line 4\n";
+    }
+    EXPECT_EQ("ERROR boom\nERROR twice\nERROR split\n", plain_alerts.str());
+
+    // Deferred records are matched by their formatted text, a line at a time
+    for (bool binary : {false, true}) {
+        std::ostringstream routed;
+        {
+            TeeStream tee;
+            SinkOptions routing;
+            routing.match = {"ERROR 4"};
+            routing.format = binary ? SinkFormat::Binary : SinkFormat::Text;
+            tee.add_stream(routed, routing);
+
+            for (int code = 0; code < 10; code++) {
+                tee.print_deferred("{} {}\n", code % 2 ? "ERROR" : "INFO", 40 + code);
+            }
+            TEE_WARN(tee) << "ERROR 4 as text\n";
+        }
+        if (binary) {
+            // The five matching records still in their encoding, each a run of its own that
+            // defines its format, then the text
+            std::string data = routed.str();
+            std::string types;
+            for (size_t pos = 0; pos + 5 <= data.size();) {
+                uint32_t length;
+                memcpy(&length, data.data() + pos + 1, sizeof(length));
+                types += data[pos];
+                pos += 5 + length;
+            }
+            EXPECT_EQ("FRFRFRFRFRT", types);
+        } else {
+            EXPECT_EQ("ERROR 41\nERROR 43\nERROR 45\nERROR 47\nERROR 49\nERROR 4 as text\n", routed.str());
+        }
+    }
+}
+
+// Test that consecutive repeats of a record are collapsed into a summary
+TEST(TeeStreamTest, RepeatedRecordSuppression) {
+    std::ostringstream raw, collapsed;
+    {
+        TeeStream tee(256, 192);
+        tee.add_stream(raw);
+        SinkOptions dedup;
+        dedup.dedup_window = std::chrono::minutes(1);
+        tee.add_stream(collapsed, dedup);
+
+        // Repeats span many flushes
+        for (int i = 0; i < 1000; i++) {
+            TEE_WARN(tee) << "connect failed: connection refused\n";
+        }
+        TEE_INFO(tee) << "connected\n";
+        TEE_INFO(tee) << "connected\n";
+        TEE_INFO(tee) << "sent 1\n";
+        TEE_INFO(tee) << "sent 2\n";
+    }
+
+    EXPECT_EQ(1000 * strlen("connect failed: connection refused\n") + strlen("connected\n") * 2 +
+              strlen("sent 1\n") * 2, raw.str().size());
+    EXPECT_EQ("connect failed: connection refused\nrepeated 999 times\n"
+              "connected\nrepeated 1 time\nsent 1\nsent 2\n", collapsed.str());
+
+    // Plain writes are compared a line at a time, and timestamp prefixes are left out
+    for (bool timestamps : {false, true}) {
+        std::ostringstream lines;
+        {
+            TeeStream tee(256, 192);
+            if (timestamps) {
+                tee.enable_timestamps();
+            }
+            SinkOptions dedup;
+            dedup.dedup_window = std::chrono::minutes(1);
+            tee.add_stream(lines, dedup);
+
+            for (int i = 0; i < 100; i++) {
+                tee << "retry failed\n";
+            }
+            for (int i = 0; i < 100; i++) {
+                TEE_WARN(tee) << "retry failed again\n";
+            }
+            for (int i = 0; i < 100; i++) {
+                tee.print_deferred("retry {} failed\n", 3);
+            }
+            tee << "gave up\n";
+        }
+        std::string expected = "retry failed\nrepeated 99 times\nretry failed again\nrepeated 99 times\n"
+                               "retry 3 failed\nrepeated 99 times\ngave up\n";
+        std::string output = lines.str();
+        if (timestamps) {
+            // Each record written keeps its prefix; the summaries have none
+            std::regex prefix(R"(\[\d{4}-\d\d-\d\d \d\d:\d\d:\d\d\.\d{6}\] )");
+            EXPECT_EQ(4, std::distance(std::sregex_iterator(output.begin(), output.end(), prefix),
+                                       std::sregex_iterator()));
+            output = std::regex_replace(output, prefix, "");
+        }
+        EXPECT_EQ(expected, output);
+    }
+
+    // A line a flush cuts in two is compared whole, not as a prefix and a continuation
+    {
+        std::ostringstream cut;
+        {
+            TeeStream tee(64, 48);
+            tee.enable_timestamps();
+            SinkOptions dedup;
+            dedup.dedup_window = std::chrono::minutes(1);
+            tee.add_stream(cut, dedup);
+
+            tee << std::string(30, 'x');
+            tee << "first\n";
+            tee << std::string(30, 'x');
+            tee << "second\n";
+        }
+        std::regex prefix(R"(\[\d{4}-\d\d-\d\d \d\d:\d\d:\d\d\.\d{6}\] )");
+        EXPECT_EQ(std::string(30, 'x') + "first\n" + std::string(30, 'x') + "second\n",
+                  std::regex_replace(cut.str(), prefix, ""));
+    }
+
+    // Repeats not yet summed up are written on a flush, on removal and at teardown
+    for (bool async : {false, true}) {
+        std::ostringstream pending, removed;
+        {
+            TeeStream tee;
+            if (async) {
+                tee.enable_async();
+            }
+            SinkOptions dedup;
+            dedup.dedup_window = std::chrono::minutes(1);
+            tee.add_stream(pending, dedup);
+            SinkHandle removed_handle = tee.add_stream(removed, dedup);
+
+            for (int i = 0; i < 3; i++) {
+                TEE_WARN(tee) << "retrying\n";
+            }
+            tee.flush();
+            if (async) {
+                tee.drain();
+            }
+            EXPECT_EQ("retrying\nrepeated 2 times\n", pending.str());
+
+            TEE_WARN(tee) << "retrying\n";
+            tee.flush();
+            if (async) {
+                tee.drain();
+            }
+            removed_handle.remove();
+            EXPECT_EQ("retrying\nrepeated 2 times\nrepeated 1 time\n", removed.str());
+
+            TEE_WARN(tee) << "retrying\n";
+        }
+        EXPECT_EQ("retrying\nrepeated 2 times\nrepeated 1 time\nrepeated 1 time\n", pending.str());
+    }
+}
+
+// Test that a redacting stream gets secrets masked while other streams get the raw text
+TEST(TeeStreamTest, RedactionRules) {
+    for (bool async : {false, true}) {
+        std::ostringstream file, socket;
+        {
+            TeeStream tee;
+            if (async) {
+                tee.enable_async();
+            }
+            tee.add_stream(file);
+            SinkOptions masked;
+            masked.redact = {RedactionRule{}, RedactionRule{RedactionKind::ValueAfter, "token="}};
+            tee.add_stream(socket, masked);
+
+            tee << "paid with 4111 1111 1111 1111 at 1700000000123\n";
+            tee << "GET /api?token=abc123&user=7\n";
+            tee.print_deferred("card {} ok\n", std::string("5500-0000-0000-0004"));
+            // Only groups of 4 with one kind of separator join into a number
+            tee << "plain 4111111111111111 dashed 4111-1111-1111-1111\n";
+            tee << "ids 4 111 1111 1111 1111 and 4111-1111 1111-1111\n";
+            tee << "token=4111111111111111 id=7\n";
+        }
+
+        const std::string ids = "ids 4 111 1111 1111 1111 and 4111-1111 1111-1111\n";
+        EXPECT_EQ("paid with 4111 1111 1111 1111 at 1700000000123\n"
+                  "GET /api?token=abc123&user=7\n"
+                  "card 5500-0000-0000-0004 ok\n"
+                  "plain 4111111111111111 dashed 4111-1111-1111-1111\n" + ids +
+                  "token=4111111111111111 id=7\n", file.str());
+        EXPECT_EQ("paid with **** **** **** 1111 at 1700000000123\n"
+                  "GET /api?token=******&user=7\n"
+                  "card ****-****-****-0004 ok\n"
+                  "plain ************1111 dashed ****-****-****-1111\n" + ids +
+                  "token=**************** id=7\n", socket.str());
+    }
+
+    // Secrets cut in two by threshold flushes are still masked
+    for (bool async : {false, true}) {
+        std::ostringstream file, socket;
+        std::string padding(40, '.');
+        {
+            TeeStream tee(64, 48);
+            if (async) {
+                tee.enable_async();
+            }
+            tee.add_stream(file);
+            SinkOptions masked;
+            masked.redact = {RedactionRule{}, RedactionRule{RedactionKind::ValueAfter, "token="}};
+            tee.add_stream(socket, masked);
+
+            tee << padding << " 4111 1111";
+            tee << " 1111 1111 " << padding << " tok";
+            tee << "en=abc" << padding;
+            tee << "def\n";
+            tee.flush();
+            if (async) {
+                tee.drain();
+            }
+            EXPECT_EQ(file.str().size(), socket.str().size());
+        }
+
+        EXPECT_EQ(padding + " 4111 1111 1111 1111 " + padding + " token=abc" + padding + "def\n", file.str());
+        EXPECT_EQ(padding + " **** **** **** 1111 " + padding + " token=" + std::string(46, '*') + "\n",
+                  socket.str());
+    }
+}
+
+// Test that a tee added to another tee passes records on in order, with their levels
+TEST(TeeStreamTest, NestedTees) {
+    for (bool async : {false, true}) {
+        std::ostringstream file, warnings, console;
+        {
+            TeeStream global;
+            global.add_stream(file);
+            SinkOptions warn;
+            warn.min_level = LogLevel::Warn;
+            global.add_stream(warnings, warn);
+
+            TeeStream middle;
+            middle.add_stream(global);
+            TeeStream module;
+            if (async) {
+                module.enable_async();
+            }
+            module.add_stream(console);
+            module.add_stream(middle);
+
+            // Written to the global tee first, so a synchronous flush writes it first
+            if (!async) {
+                global << "global\n";
+            }
+            TEE_INFO(module) << "starting\n";
+            TEE_ERROR(module) << "failed\n";
+            module.flush();
+            if (async) {
+                module.drain();
+            }
+            EXPECT_EQ("starting\nfailed\n", console.str());
+
+            module.remove_stream(middle);
+            module << "console only\n";
+        }
+
+        EXPECT_EQ("starting\nfailed\nconsole only\n", console.str());
+        EXPECT_EQ(std::string(async ? "" : "global\n") + "starting\nfailed\n", file.str());
+        EXPECT_EQ("failed\n", warnings.str());
+    }
+
+    // A tee cannot be nested in itself, directly or through the tees nested in it
+    TeeStream outer, inner;
+    outer.add_stream(inner);
+    EXPECT_THROW(outer.add_stream(outer), std::invalid_argument);
+    EXPECT_THROW(inner.add_stream(outer), std::invalid_argument);
+    SinkOptions binary;
+    binary.format = SinkFormat::Binary;
+    EXPECT_THROW(inner.add_stream(outer, binary), std::invalid_argument);
+    outer.remove_stream(inner);
+    EXPECT_NO_THROW(inner.add_stream(outer));
+
+    // A tee destroyed while it is still a stream of another is skipped from then on,
+    // linked or not
+    for (bool async : {false, true}) {
+        std::ostringstream console, child_out;
+        {
+            TeeStream parent;
+            if (async) {
+                parent.enable_async();
+            }
+            parent.add_stream(console);
+            auto child = std::make_unique<TeeStream>();
+            child->add_stream(child_out);
+            parent.add_stream(*child);
+            SinkOptions errors;
+            errors.min_level = LogLevel::Error;
+            parent.add_stream(*child, errors);
+
+            TEE_ERROR(parent) << "before\n";
+            parent.flush();
+            parent.drain();
+            child.reset();
+
+            TEE_ERROR(parent) << "after\n";
+            parent.flush();
+            parent.drain();
+        }
+        EXPECT_EQ("before\nafter\n", console.str());
+        EXPECT_EQ("before\nbefore\n", child_out.str());
+    }
+}
+
 int main(int argc, char **argv) {
     ::testing::InitGoogleTest(&argc, argv);
     return RUN_ALL_TESTS();
@@ -0,0 +1,270 @@
+#include "TeeStreamCoro.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <sstream>
+#include <string>
+#include <thread>
+
+#include <gtest/gtest.h>
+
+// Runs posted work on its own thread
+class ThreadExecutor {
+private:
+    struct State {
+        std::mutex mutex;
+        std::condition_variable cv;
+        std::deque<std::function<void()>> work;
+        bool stop = false;
+        std::thread thread;
+    };
+    std::shared_ptr<State> state;
+
+public:
+    ThreadExecutor() : state(std::make_shared<State>()) {
+        state->thread = std::thread([state = state]() {
+            std::unique_lock<std::mutex> lock(state->mutex);
+            for (;;) {
+                state->cv.wait(lock, [&state] { return !state->work.empty() || state->stop; });
+                if (state->work.empty()) {
+                    return;
+                }
+                auto f = std::move(state->work.front());
+                state->work.pop_front();
+                lock.unlock();
+                f();
+                lock.lock();
+            }
+        });
+    }
+
+    void execute(std::function<void()> f) const {
+        std::lock_guard<std::mutex> lock(state->mutex);
+        state->work.push_back(std::move(f));
+        state->cv.notify_one();
+    }
+
+    std::thread::id thread_id() const {
+        return state->thread.get_id();
+    }
+
+    void shutdown() {
+        {
+            std::lock_guard<std::mutex> lock(state->mutex);
+            state->stop = true;
+        }
+        state->cv.notify_one();
+        state->thread.join();
+    }
+};
+
+// Fire-and-forget coroutine
+struct DetachedTask {
+    struct promise_type {
+        DetachedTask get_return_object() { return {}; }
+        std::suspend_never initial_suspend() { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+// A sink that blocks every write until it is opened
+class GatedBuf : public std::streambuf {
+public:
+    void open() {
+        std::lock_guard<std::mutex> lock(mutex);
+        is_open = true;
+        cv.notify_all();
+    }
+
+    std::string str() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return data;
+    }
+
+    int writes() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return write_count;
+    }
+
+protected:
+    virtual int overflow(int c) override {
+        char ch = static_cast<char>(c);
+        return xsputn(&ch, 1) == 1 ? c : traits_type::eof();
+    }
+
+    virtual std::streamsize xsputn(const char* s, std::streamsize n) override {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [this] { return is_open; });
+        data.append(s, static_cast<size_t>(n));
+        write_count++;
+        return n;
+    }
+
+private:
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool is_open = false;
+    std::string data;
+    int write_count = 0;
+};
+
+DetachedTask write_lines(AsyncTeeStream<ThreadExecutor>& tee, int count,
+                         std::promise<std::thread::id>& done) {
+    for (int i = 0; i < count; i++) {
+        std::string line = "line " + std::to_string(i) + "\n";
+        co_await tee.async_write(line);
+    }
+    co_await tee.async_flush();
+    done.set_value(std::this_thread::get_id());
+}
+
+// Test that writes complete without suspending when there is no backpressure
+TEST(TeeStreamCoroTest, WriteWithoutBackpressure) {
+    ThreadExecutor executor;
+    std::ostringstream stream;
+    {
+        AsyncTeeStream<ThreadExecutor> tee(executor);
+        tee.add_stream(stream);
+
+        std::promise<std::thread::id> done;
+        write_lines(tee, 3, done);
+        auto finished = done.get_future();
+        ASSERT_EQ(std::future_status::ready, finished.wait_for(std::chrono::seconds(10)));
+
+        EXPECT_EQ("line 0\nline 1\nline 2\n", stream.str());
+    }
+    executor.shutdown();
+}
+
+// Test that a coroutine suspends under backpressure and resumes on the executor
+TEST(TeeStreamCoroTest, ResumesOnExecutorAfterBackpressure) {
+    ThreadExecutor executor;
+    GatedBuf gated_buf;
+    std::ostream gated_stream(&gated_buf);
+    {
+        AsyncTeeStream<ThreadExecutor> tee(executor, 16, 64, 48);
+        tee.add_stream(gated_stream);
+
+        // The first flush fills the queue, and the write that needs the next one suspends
+        // the coroutine rather than block this thread, which gets here
+        std::promise<std::thread::id> done;
+        write_lines(tee, 40, done);
+        auto finished = done.get_future();
+
+        // The sink is closed, so the coroutine has to be waiting
+        EXPECT_TRUE(tee.backpressured());
+        EXPECT_EQ(std::future_status::timeout, finished.wait_for(std::chrono::milliseconds(50)));
+
+        gated_buf.open();
+        ASSERT_EQ(std::future_status::ready, finished.wait_for(std::chrono::seconds(10)));
+        EXPECT_EQ(executor.thread_id(), finished.get());
+
+        std::string expected;
+        for (int i = 0; i < 40; i++) {
+            expected += "line " + std::to_string(i) + "\n";
+        }
+        EXPECT_EQ(expected, gated_buf.str());
+
+        // Consecutive writes were queued together, a few lines to a chunk
+        EXPECT_LT(gated_buf.writes(), 20);
+    }
+    executor.shutdown();
+}
+
+// Test that a coroutine suspends while the memory budget has no room, rather than block
+TEST(TeeStreamCoroTest, ResumesAfterMemoryBudgetFrees) {
+    ThreadExecutor executor;
+    GatedBuf gated_buf;
+    std::ostream gated_stream(&gated_buf);
+    BufferPool::trim();
+    size_t base = BufferPool::memory_usage();
+    BufferPool::set_memory_budget(base + 8 * 1024, BudgetPolicy::Block);
+    {
+        AsyncTeeStream<ThreadExecutor> tee(executor, 1024 * 1024, 1024, 512);
+        tee.add_stream(gated_stream);
+
+        std::promise<std::thread::id> done;
+        write_lines(tee, 400, done);
+        auto finished = done.get_future();
+
+        // No queue is full, but the queued chunks hold the budget until the sink opens
+        EXPECT_FALSE(tee.backpressured());
+        EXPECT_EQ(std::future_status::timeout, finished.wait_for(std::chrono::milliseconds(50)));
+        EXPECT_LE(BufferPool::memory_usage(), base + 8 * 1024);
+
+        gated_buf.open();
+        ASSERT_EQ(std::future_status::ready, finished.wait_for(std::chrono::seconds(10)));
+        EXPECT_EQ(executor.thread_id(), finished.get());
+
+        std::string expected;
+        for (int i = 0; i < 400; i++) {
+            expected += "line " + std::to_string(i) + "\n";
+        }
+        EXPECT_EQ(expected, gated_buf.str());
+    }
+    executor.shutdown();
+    BufferPool::set_memory_budget(0);
+    BufferPool::trim();
+}
+
+// Moves the awaiting coroutine to an executor's thread
+template<typename Executor>
+struct ResumeOn {
+    Executor executor;
+
+    bool await_ready() { return false; }
+    void await_suspend(std::coroutine_handle<> handle) {
+        executor.execute([handle]() { handle.resume(); });
+    }
+    void await_resume() {}
+};
+
+DetachedTask write_and_move(AsyncTeeStream<ThreadExecutor>& tee, ThreadExecutor other,
+                            std::promise<std::thread::id>& done) {
+    co_await tee.async_write(std::string_view("line1\n"));
+    ResumeOn<ThreadExecutor> move{other};
+    co_await move;
+    co_await tee.async_flush(other);
+    done.set_value(std::this_thread::get_id());
+}
+
+// Test that what a coroutine wrote is flushed after it moves to another thread
+TEST(TeeStreamCoroTest, FlushAfterResumingOnAnotherThread) {
+    ThreadExecutor executor;
+    ThreadExecutor other;
+    std::ostringstream stream;
+    {
+        AsyncTeeStream<ThreadExecutor> tee(executor);
+        tee.add_stream(stream);
+
+        // The coroutine writes on the executor's thread and flushes from the other one,
+        // while the executor's thread sits idle
+        std::promise<std::thread::id> done;
+        executor.execute([&tee, other, &done]() { write_and_move(tee, other, done); });
+        auto finished = done.get_future();
+        ASSERT_EQ(std::future_status::ready, finished.wait_for(std::chrono::seconds(10)));
+        EXPECT_EQ(other.thread_id(), finished.get());
+        EXPECT_EQ("line1\n", stream.str());
+
+        // A drain from a third thread also reaches data written from a coroutine
+        std::promise<void> written;
+        executor.execute([&tee, &written]() {
+            EXPECT_TRUE(tee.try_write_shared("line2\n", 6));
+            written.set_value();
+        });
+        written.get_future().wait();
+        tee.drain();
+        EXPECT_EQ("line1\nline2\n", stream.str());
+    }
+    executor.shutdown();
+    other.shutdown();
+}
+
+int main(int argc, char **argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}